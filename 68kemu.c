@@ -18,10 +18,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <mint/osbind.h>
-#include <mint/basepage.h>
+#include <ctype.h>
 #include "musashi/m68k.h"
 #include "musashi/m68kcpu.h"
+#include "gdbstub.h"
+#include "osstats.h"
+#include "ostrace.h"
+#include "prgload.h"
+#include "tosdefs.h"
+
+#ifdef HOST_LINUX
+#include "jobserver.h"
+#include "linuxos.h"
+#else
+#include <mint/osbind.h>
+#include <mint/basepage.h>
+#include "guestheap.h"
+#include "process.h"
+#include "querycache.h"
+
+// The OS calls are run by the underlying TOS
 
 static void* old_ssp_real;
 
@@ -43,7 +59,6 @@ static void* BothSuperFromUser(void* new_ssp_emu)
 
     old_ssp_emu = (void*)m68k_get_reg(NULL, M68K_REG_SP);
     m68k_set_reg(M68K_REG_SP, (int)new_ssp_emu);
-    m68k_set_reg(M68K_REG_D0, (int)old_ssp_emu);
     
     return old_ssp_emu;
 }
@@ -60,64 +75,288 @@ static void BothSuperToUser(void* old_ssp_emu)
     sr = (unsigned short)m68k_get_reg(NULL, M68K_REG_SR);
     sr &= ~0x2000;
     m68k_set_reg(M68K_REG_SR, sr);
+}
+
+// Console output is buffered, and flushed on newline, when the buffer is
+// full, before any other OS call, and between two timeslices
+#define CONSOLE_BUFFER_SIZE 1024
+
+enum
+{
+    CONSOLE_GEMDOS, // Cconout(), Cconws(): to the standard output
+    CONSOLE_BIOS    // Bconout(2): to the console device
+};
+
+static char consoleBuffer[CONSOLE_BUFFER_SIZE];
+static long consoleLength;
+static int consoleKind;
+
+static void consoleFlush(void)
+{
+    long i;
+
+    if (consoleLength == 0)
+        return;
+
+    if (consoleKind == CONSOLE_GEMDOS)
+        Fwrite(1, consoleLength, consoleBuffer);
+    else
+    {
+        for (i = 0; i < consoleLength; ++i)
+            Bconout(2, (unsigned char)consoleBuffer[i]);
+    }
+
+    consoleLength = 0;
+}
+
+static void consoleOut(int kind, char c)
+{
+    if (kind != consoleKind)
+    {
+        consoleFlush();
+        consoleKind = kind;
+    }
 
-    m68k_set_reg(M68K_REG_D0, (int)0);
+    consoleBuffer[consoleLength++] = c;
+    if (c == '\n' || consoleLength == CONSOLE_BUFFER_SIZE)
+        consoleFlush();
 }
 
-void m68ki_hook_trap1()
+// Run a GEMDOS call on the real CPU
+static long gemdos(unsigned short* sp)
 {
-    unsigned short* sp = (unsigned short *)m68k_get_reg(NULL, M68K_REG_SP);
-    unsigned short num = *sp;
+    register long reg_d0 __asm__("d0");
+
+    __asm__ volatile
+    (
+        "move.l	sp,a3\n\t"
+        "move.l	%1,sp\n\t"
+        "trap	#1\n\t"
+        "move.l	a3,sp"
+    : "=r"(reg_d0)			/* outputs */
+    : "g"(sp)
+    : "d1", "d2", "a0", "a1", "a2", "a3", "memory"    /* clobbered regs */
+    );
+
+    return reg_d0;
+}
 
-    //printf("GEMDOS(0x%02x)\n", num);
+// Owner basepage of the files opened through TOS, by handle
+#define TOS_MAX_HANDLES 128
+static unsigned int tosHandleOwner[TOS_MAX_HANDLES];
 
-    if (num == 0x20)
+static void tosTrackHandle(const unsigned short* sp, long result)
+{
+    short handle = (short)sp[1];
+
+    switch (sp[0])
     {
-        void* param = *(void**)(sp + 1);
-        //printf("Super(0x%08lx)\n", (long)param);
-        
-        if (param != (void*)1)
+        case 0x3c: // Fcreate()
+        case 0x3d: // Fopen()
+        case 0x45: // Fdup()
+            if (result >= 0 && result < TOS_MAX_HANDLES)
+                tosHandleOwner[result] = processCurrent();
+            break;
+
+        case 0x3e: // Fclose()
+            if (result == 0 && handle >= 0 && handle < TOS_MAX_HANDLES)
+                tosHandleOwner[handle] = 0;
+            break;
+    }
+}
+
+// The files left open by a terminated child
+static void tosCloseFiles(unsigned int bp)
+{
+    int handle;
+
+    for (handle = 0; handle < TOS_MAX_HANDLES; ++handle)
+    {
+        if (tosHandleOwner[handle] == bp)
         {
-            long current_super = Super(SUP_INQUIRE);
-            if (current_super)
-            {
-                BothSuperToUser(param);
-                return;
-            }
-            else /* current user */
-            {
-                BothSuperFromUser(param);
-                return;
-            }
+            Fclose(handle);
+            tosHandleOwner[handle] = 0;
         }
     }
+}
 
-    // Standard block
+static void m68ki_hook_trap1()
+{
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned short* sp = (unsigned short *)regs[M68K_REG_A7];
+    unsigned long result;
+
+    //printf("GEMDOS(0x%02x)\n", *sp);
+
+    if (queryCacheLookup(1, sp, &result))
     {
-        register long reg_d0 __asm__("d0");
-
-        __asm__ volatile
-        (
-            "move.l	sp,a3\n\t"
-            "move.l	%1,sp\n\t"
-            "trap	#1\n\t"
-            "move.l	a3,sp"
-        : "=r"(reg_d0)			/* outputs */
-        : "g"(sp)
-        : "d1", "d2", "a0", "a1", "a2", "a3", "memory"    /* clobbered regs */
-        );
-        
-        m68k_set_reg(M68K_REG_D0, (int)reg_d0);
+        regs[M68K_REG_D0] = (unsigned int)result;
+        return;
     }
+
+    consoleFlush();
+    result = (unsigned long)gemdos(sp);
+    queryCacheStore(1, sp, result);
+    tosTrackHandle(sp, (long)result);
+    regs[M68K_REG_D0] = (unsigned int)result;
 }
 
-void m68ki_hook_trap2()
+static int gemdosCconout(unsigned int sp)
 {
-    void* sp = (void*)m68k_get_reg(NULL, M68K_REG_SP);
-    unsigned long ad0 = (unsigned long)m68k_get_reg(NULL, M68K_REG_D0);
-    unsigned long ad1 = (unsigned long)m68k_get_reg(NULL, M68K_REG_D1);
+    consoleOut(CONSOLE_GEMDOS, (char)*(unsigned short*)(sp + 2));
+    return 0;
+}
+
+static int gemdosCconws(unsigned int sp)
+{
+    const char* s = *(const char**)(sp + 2);
+
+    while (*s != '\0')
+        consoleOut(CONSOLE_GEMDOS, *s++);
+
+    return 0;
+}
+
+// Super() must switch both the real and the emulated CPU
+static int gemdosSuper(unsigned int sp)
+{
+    void* param = *(void**)(sp + 2);
+
+    //printf("Super(0x%08lx)\n", (long)param);
+
+    consoleFlush();
+
+    if (param == (void*)1)
+        return (int)gemdos((unsigned short*)sp);
+
+    if (Super(SUP_INQUIRE))
+    {
+        BothSuperToUser(param);
+        return 0;
+    }
+    else /* current user */
+    {
+        return (int)BothSuperFromUser(param);
+    }
+}
+
+// The guest memory blocks are managed by the host, in arenas taken from TOS
+#define HEAP_CHUNK (256 * 1024)
+
+static unsigned int tosHeapGrow(unsigned int size, int mode, unsigned int* arenaSize)
+{
+    unsigned int chunk = size < HEAP_CHUNK ? HEAP_CHUNK : size;
+    long p;
+
+    for (;;)
+    {
+        p = mode == HEAP_ANY ? (long)Malloc(chunk) : (long)Mxalloc(chunk, mode);
+        if (p > 0 || chunk == size)
+            break;
+        chunk = size;
+    }
+
+    if (p <= 0)
+        return 0;
+
+    *arenaSize = chunk;
+    return (unsigned int)p;
+}
+
+static void tosHeapRelease(unsigned int start)
+{
+    Mfree((void*)start);
+}
+
+static unsigned int tosHeapAvailable(int mode)
+{
+    long size = mode == HEAP_ANY ? (long)Malloc(-1) : (long)Mxalloc(-1, mode);
+
+    return size > 0 ? (unsigned int)size : 0;
+}
+
+// Malloc() and Mxalloc()
+static int gemdosMalloc(unsigned int sp)
+{
+    unsigned short* args = (unsigned short*)sp;
+    unsigned long size = *(unsigned long*)(sp + 2);
+    int mode = args[0] == 0x44 ? args[3] & 3 : HEAP_ANY;
+
+    if (size == 0xffffffff)
+        return (int)heapLargest(mode);
+
+    return (int)heapAlloc(size, mode);
+}
+
+// The blocks not allocated by the heap, like the basepage, belong to TOS
+static int gemdosMfree(unsigned int sp)
+{
+    unsigned int address = *(unsigned int*)(sp + 2);
+
+    if (heapOwns(address))
+        return heapFree(address);
+
+    consoleFlush();
+    return gemdos((unsigned short*)sp);
+}
+
+static int gemdosMshrink(unsigned int sp)
+{
+    unsigned int address = *(unsigned int*)(sp + 4);
+
+    if (heapOwns(address))
+        return heapShrink(address, *(unsigned int*)(sp + 8));
+
+    consoleFlush();
+    return gemdos((unsigned short*)sp);
+}
+
+static unsigned int tosGetDta(void)
+{
+    return (unsigned int)Fgetdta();
+}
+
+static void tosSetDta(unsigned int dta)
+{
+    Fsetdta((void*)dta);
+}
+
+// Pexec() runs the child on the emulated CPU, not on the real one
+static int gemdosPexec(unsigned int sp)
+{
+    unsigned short* args = (unsigned short*)sp;
+
+    consoleFlush();
+    queryCacheNotify(1, args);
+
+    return (int)processExec(args[1], *(const char**)(sp + 4), *(unsigned int*)(sp + 8),
+        *(unsigned int*)(sp + 12));
+}
+
+// Pterm0(), Pterm() and Ptermres() resume the parent of a child.
+// The main program terminates 68Kemu through TOS.
+static int gemdosPterm(unsigned int sp)
+{
+    unsigned short* args = (unsigned short*)sp;
+    long keep = args[0] == 0x31 ? (long)*(unsigned int*)(sp + 2) : -1;
+    int code = args[0] == 0x00 ? 0 : (short)args[args[0] == 0x31 ? 3 : 1];
+
+    consoleFlush();
+    if (processTerminate(keep))
+        return code;
+
+    return (int)gemdos(args);
+}
+
+static void m68ki_hook_trap2()
+{
+    unsigned int* regs = m68k_get_reg_file();
+    void* sp = (void*)regs[M68K_REG_A7];
+    unsigned long ad0 = regs[M68K_REG_D0];
+    unsigned long ad1 = regs[M68K_REG_D1];
 
     //printf("GEM\n");
+    consoleFlush();
     __asm__ volatile
     (
         "move.l	sp,a3\n\t"
@@ -132,14 +371,11 @@ void m68ki_hook_trap2()
     );
 }
 
-void m68ki_hook_trap13()
+// Run a BIOS call on the real CPU
+static long bios(unsigned short* sp)
 {
-    unsigned short* sp = (unsigned short *)m68k_get_reg(NULL, M68K_REG_SP);
-    //unsigned short num = *sp;
     register long reg_d0 __asm__("d0");
 
-    //printf("BIOS(0x%02x)\n", num);
-
     __asm__ volatile
     (
         "move.l	sp,a3\n\t"
@@ -150,8 +386,43 @@ void m68ki_hook_trap13()
     : "g"(sp)
     : "d1", "d2", "a0", "a1", "a2", "a3", "memory"    /* clobbered regs */
     );
-    
-    m68k_set_reg(M68K_REG_D0, (int)reg_d0);
+
+    return reg_d0;
+}
+
+static void m68ki_hook_trap13()
+{
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned short* sp = (unsigned short *)regs[M68K_REG_A7];
+    unsigned long result;
+
+    //printf("BIOS(0x%02x)\n", *sp);
+
+    if (queryCacheLookup(13, sp, &result))
+    {
+        regs[M68K_REG_D0] = (unsigned int)result;
+        return;
+    }
+
+    consoleFlush();
+    result = (unsigned long)bios(sp);
+    queryCacheStore(13, sp, result);
+    regs[M68K_REG_D0] = (unsigned int)result;
+}
+
+static int biosBconout(unsigned int sp)
+{
+    unsigned short* args = (unsigned short*)sp;
+
+    // Only the console device is buffered
+    if (args[1] != 2)
+    {
+        consoleFlush();
+        return (int)bios(args);
+    }
+
+    consoleOut(CONSOLE_BIOS, (char)args[2]);
+    return 0;
 }
 
 typedef void VOIDFUNC(void);
@@ -198,34 +469,43 @@ unsigned long SupexecImpl(SUPEXEC_CALLBACK_TYPE* f)
     return ret;
 }
 */
-void m68ki_hook_trap14()
+
+// Supexec() runs the routine on the emulated CPU
+static int xbiosSupexec(unsigned int sp)
+{
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned long* usp = (unsigned long*)sp;
+    void* pc = (void*)m68k_get_reg(NULL, M68K_REG_PC);
+
+    //printf("Supexec(0x%08lx)\n", *(unsigned long*)(sp + 2));
+
+    consoleFlush();
+    queryCacheNotify(14, (unsigned short*)sp);
+
+    *--usp = (unsigned long)pc;
+    regs[M68K_REG_A7] = (unsigned int)usp;
+    m68k_set_reg(M68K_REG_PC, (int)SupexecImpl);
+
+    return regs[M68K_REG_D0];
+}
+
+static void m68ki_hook_trap14()
 {
-    unsigned char* sp = (unsigned char *)m68k_get_reg(NULL, M68K_REG_SP);
-    unsigned short num = *(unsigned short*)sp;
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned char* sp = (unsigned char *)regs[M68K_REG_A7];
     register long reg_d0 __asm__("d0");
+    unsigned long result;
 
-    //printf("XBIOS(0x%02x)\n", num);
+    //printf("XBIOS(0x%02x)\n", *(unsigned short*)sp);
 
-    if (num == 0x26)
+    if (queryCacheLookup(14, (unsigned short*)sp, &result))
     {
-        //SUPEXEC_CALLBACK_TYPE* pCallback = *(SUPEXEC_CALLBACK_TYPE**)(sp + 2);
-        //unsigned long ret;
-        unsigned long* sp;
-        void* pc;
-
-        //printf("Supexec(0x%08lx)\n", (unsigned long)pCallback);
-        //ret = RunEmulatedFunction(SupexecImpl, pCallback);
-        //m68k_set_reg(M68K_REG_D0, (int)ret);
-        pc = (void*)m68k_get_reg(NULL, M68K_REG_PC);
-        //printf("*pc = 0x%04x\n", *(((unsigned short*)pc)-1));
-        //return;
-        sp = (unsigned long*)m68k_get_reg(NULL, M68K_REG_SP);
-        *--sp = (unsigned long)pc;
-        m68k_set_reg(M68K_REG_SP, (int)sp);
-        m68k_set_reg(M68K_REG_PC, (int)SupexecImpl);
+        regs[M68K_REG_D0] = (unsigned int)result;
         return;
     }
-    
+
+    consoleFlush();
+
     __asm__ volatile
     (
         "move.l	sp,a3\n\t"
@@ -237,15 +517,15 @@ void m68ki_hook_trap14()
     : "d1", "d2", "a0", "a1", "a2", "a3", "memory" /* clobbered regs */
     );
     
-    //nextCallback = NULL;
-    
-    m68k_set_reg(M68K_REG_D0, (int)reg_d0);
+    queryCacheStore(14, (unsigned short*)sp, (unsigned long)reg_d0);
+    regs[M68K_REG_D0] = (unsigned int)reg_d0;
 }
 
 void m68ki_hook_linea()
 {
+    unsigned int* regs = m68k_get_reg_file();
     unsigned short* pc = (unsigned short *)m68k_get_reg(NULL, M68K_REG_PC);
-    unsigned short* sp = (unsigned short *)m68k_get_reg(NULL, M68K_REG_SP);
+    unsigned short* sp = (unsigned short *)regs[M68K_REG_A7];
     register long reg_d0 __asm__("d0");
     register long reg_a0 __asm__("a0");
     register long reg_a1 __asm__("a1");
@@ -255,6 +535,8 @@ void m68ki_hook_linea()
     
     //printf("Line A %u 0x%04x\n", num, opcode);
 
+    consoleFlush();
+
     __asm__ volatile
     (
         "move.l	 sp,a3\n\t"
@@ -302,12 +584,65 @@ void m68ki_hook_linea()
     : "d1", "d2", "a3", "memory"    /* clobbered regs */
     );
     
-    m68k_set_reg(M68K_REG_D0, (int)reg_d0);
-    m68k_set_reg(M68K_REG_A0, (int)reg_a0);
-    m68k_set_reg(M68K_REG_A1, (int)reg_a1);
-    m68k_set_reg(M68K_REG_A2, (int)reg_a2);
+    regs[M68K_REG_D0] = (unsigned int)reg_d0;
+    regs[M68K_REG_A0] = (unsigned int)reg_a0;
+    regs[M68K_REG_A1] = (unsigned int)reg_a1;
+    regs[M68K_REG_A2] = (unsigned int)reg_a2;
 }
 
+// Load the program with a copy of the environment of 68Kemu
+static long tosLoadProgram(const char* path, const char* tail)
+{
+    const char* parentEnv = _base->p_env;
+    size_t size = 0;
+    unsigned int env;
+    long bp;
+
+    while (parentEnv[size] != '\0' || parentEnv[size + 1] != '\0')
+        ++size;
+    size += 2;
+
+    env = heapAlloc(size, HEAP_ANY);
+    if (env == 0)
+        return TOS_ENSMEM;
+    memcpy((void*)env, parentEnv, size);
+
+    bp = prgLoad(path, tail, env, (unsigned int)_base);
+    if (bp < 0)
+        heapFree(env);
+    else
+        processInit(bp, tosGetDta, tosSetDta, tosCloseFiles);
+
+    return bp;
+}
+
+static void installTosHooks(void)
+{
+    heapInit(tosHeapGrow, tosHeapRelease, tosHeapAvailable);
+
+    m68k_set_trap_callback(1, m68ki_hook_trap1);
+    m68k_set_trap_callback(2, m68ki_hook_trap2);
+    m68k_set_trap_callback(13, m68ki_hook_trap13);
+    m68k_set_trap_callback(14, m68ki_hook_trap14);
+
+    m68k_set_os_call_callback(1, 0x00, gemdosPterm);
+    m68k_set_os_call_callback(1, 0x02, gemdosCconout);
+    m68k_set_os_call_callback(1, 0x09, gemdosCconws);
+    m68k_set_os_call_callback(1, 0x20, gemdosSuper);
+    m68k_set_os_call_callback(1, 0x31, gemdosPterm);
+    m68k_set_os_call_callback(1, 0x44, gemdosMalloc);
+    m68k_set_os_call_callback(1, 0x48, gemdosMalloc);
+    m68k_set_os_call_callback(1, 0x49, gemdosMfree);
+    m68k_set_os_call_callback(1, 0x4a, gemdosMshrink);
+    m68k_set_os_call_callback(1, 0x4b, gemdosPexec);
+    m68k_set_os_call_callback(1, 0x4c, gemdosPterm);
+    m68k_set_os_call_callback(13, 0x03, biosBconout);
+    m68k_set_os_call_callback(14, 0x26, xbiosSupexec);
+}
+
+unsigned char systack[64*1024];
+#endif /* HOST_LINUX */
+
 static int int_ack_callback_vector = M68K_INT_ACK_AUTOVECTOR;
 
 // Exception vector callback
@@ -316,8 +651,7 @@ int int_ack_callback(int int_level)
     return int_ack_callback_vector;
 }
 
-unsigned char systack[64*1024];
-
+// The arguments which don't fit in the tail are truncated
 void buildCommandTail(char tail[128], char* argv[], int argc)
 {
     int i;
@@ -325,24 +659,300 @@ void buildCommandTail(char tail[128], char* argv[], int argc)
     tail[1] = '\0';
     for (i = 0; i < argc; ++i)
     {
-        if (i > 0)
-            strcat(tail + 1, " ");
-            
-        strcat(tail + 1, argv[i]);
+        size_t len = strlen(tail + 1);
+
+        snprintf(tail + 1 + len, 127 - len, "%s%s", i > 0 ? " " : "", argv[i]);
     }
     
     tail[0] = (char)strlen(tail + 1);
 }
 
+static int statsEnabled;
+static int traceEnabled;
+
+// Observer of the OS calls, for the statistics and the trace
+static void osCallHook(unsigned int vector, int enter)
+{
+    if (statsEnabled)
+        osStatsHook(vector, enter);
+    if (traceEnabled)
+        osTraceHook(vector, enter);
+}
+
+// Load a program and set the CPU to start it.
+// argv[0] is the program, followed by its arguments.
+// Returns the basepage, or a negative GEMDOS error after printing it.
+static long loadProgram(char* argv[], int argc)
+{
+    char tail[128];
+    long bp;
+    unsigned long pStack;
+
+    buildCommandTail(tail, argv + 1, argc - 1);
+#ifdef HOST_LINUX
+    bp = linuxLoadProgram(argv[0], tail);
+#else
+    bp = tosLoadProgram(argv[0], tail);
+#endif
+    if (bp < 0)
+    {
+        fprintf(stderr, "error: cannot load %s.\n", argv[0]);
+        return bp;
+    }
+
+    m68k_set_cpu_type(M68K_CPU_TYPE_68020);
+    m68k_pulse_reset(); // Patched
+    //m68k_set_int_ack_callback(int_ack_callback);
+    
+    pStack = m68k_read_memory_32(bp + BP_HITPA);
+    pStack -= 4;
+    m68k_write_memory_32(pStack, bp);
+    pStack -= 4;
+    m68k_write_memory_32(pStack, 0);
+    
+#ifdef HOST_LINUX
+    m68k_set_reg(M68K_REG_SP, LINUX_SSP);
+#else
+    m68k_set_reg(M68K_REG_SP, (int)(systack + 1));
+#endif
+    m68k_set_reg(M68K_REG_SR, 0x0300);
+    m68k_set_reg(M68K_REG_SP, pStack);
+    m68k_set_reg(M68K_REG_PC, m68k_read_memory_32(bp + BP_TBASE));
+
+    return bp;
+}
+
+// Run the loaded program until it terminates
+static void runLoadedProgram(void)
+{
+    for (;;)
+    {
+        m68k_execute(10000);
+#ifdef HOST_LINUX
+        linuxConsoleFlush();
+#else
+        consoleFlush();
+        queryCachePoll();
+#endif
+        gdbPoll();
+        osStatsPoll();
+        osTracePoll();
+    }
+}
+
+// Load a program and run it until it terminates.
+// argv[0] is the program, followed by its arguments. Returns only on error.
+static int runProgram(char* argv[], int argc)
+{
+    if (loadProgram(argv, argc) < 0)
+        return 1;
+
+    runLoadedProgram();
+    return 0;
+}
+
+#ifdef HOST_LINUX
+// Program loaded by the job server before forking the jobs
+static long parkedBasepage;
+
+// Job of the parked program: only its arguments and environment change
+static int resumeParkedProgram(char* argv[], int argc)
+{
+    char tail[128];
+
+    buildCommandTail(tail, argv + 1, argc - 1);
+    if (linuxSetArguments(parkedBasepage, tail) < 0)
+    {
+        fprintf(stderr, "error: cannot allocate the environment.\n");
+        return 1;
+    }
+
+    runLoadedProgram();
+    return 0;
+}
+
+// Job of another program, which needs the memory of the parked one
+static int runOtherProgram(char* argv[], int argc)
+{
+    linuxUnloadProgram(parkedBasepage);
+    return runProgram(argv, argc);
+}
+#endif
+
 int main(int argc, char* argv[])
 {
-    BASEPAGE* bp;
-    unsigned long* pStack;
+    int arg = 1;
+#ifdef HOST_LINUX
+    const char* serverPath = NULL;
+    int gdbEnabled = 0;
+    int overlayUpper = 0;
+#endif
+
+    // Options before the program name
+    while (arg < argc && argv[arg][0] == '-')
+    {
+        if (strcmp(argv[arg], "-g") == 0 && arg + 1 < argc)
+        {
+            int port = atoi(argv[arg + 1]);
+            if (gdbListen(port) < 0)
+            {
+                fprintf(stderr, "error: cannot listen on port %d.\n", port);
+                return 1;
+            }
+#ifdef HOST_LINUX
+            gdbEnabled = 1;
+#endif
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-s") == 0)
+        {
+            osStatsInit();
+            statsEnabled = 1;
+            arg++;
+        }
+        else if (strcmp(argv[arg], "-c") == 0 && arg + 1 < argc)
+        {
+            // Budget of the program image cache in MB, 0 to disable it
+            prgCacheSetBudget(strtoul(argv[arg + 1], NULL, 10) * 1024 * 1024);
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc)
+        {
+            if (osTraceOpen(argv[arg + 1]) < 0)
+            {
+                fprintf(stderr, "error: cannot create %s.\n", argv[arg + 1]);
+                return 1;
+            }
+            traceEnabled = 1;
+            arg += 2;
+        }
+#ifdef HOST_LINUX
+        else if (strcmp(argv[arg], "-r") == 0 && arg + 1 < argc)
+        {
+            // Drive letter, and optional size in MB
+            const char* spec = argv[arg + 1];
+            unsigned long size = spec[1] == ':' ? strtoul(spec + 2, NULL, 10) * 1024 * 1024 : 0;
+
+            if (linuxRamDisk(toupper((unsigned char)spec[0]) - 'A', size) < 0)
+            {
+                fprintf(stderr, "error: cannot create the RAM disk %s.\n", spec);
+                return 1;
+            }
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-a") == 0 && arg + 1 < argc)
+        {
+            // Drive letter and archive path
+            const char* spec = argv[arg + 1];
+
+            if (spec[0] == '\0' || spec[1] != ':'
+                || linuxArchiveDrive(toupper((unsigned char)spec[0]) - 'A', spec + 2) < 0)
+            {
+                fprintf(stderr, "error: cannot mount the archive %s.\n", spec);
+                return 1;
+            }
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-o") == 0 && arg + 1 < argc)
+        {
+            // Drive letter, lower directory and optional upper directory
+            char* spec = strdup(argv[arg + 1]);
+            char* upper;
+            int ret;
+
+            upper = spec[0] != '\0' && spec[1] == ':' ? strchr(spec + 2, ':') : NULL;
+            if (upper != NULL)
+                *upper++ = '\0';
+
+            ret = spec[0] == '\0' || spec[1] != ':' ? -1
+                : linuxOverlayDrive(toupper((unsigned char)spec[0]) - 'A', spec + 2, upper);
+            overlayUpper |= upper != NULL;
+            free(spec);
+            if (ret < 0)
+            {
+                fprintf(stderr, "error: cannot mount the overlay %s.\n", argv[arg + 1]);
+                return 1;
+            }
+            arg += 2;
+        }
+        else if (strcmp(argv[arg], "-S") == 0 && arg + 1 < argc)
+        {
+            // Serve the jobs of 68kjob on a Unix domain socket
+            serverPath = argv[arg + 1];
+            arg += 2;
+        }
+#endif
+        else
+        {
+            fprintf(stderr, "error: unknown option %s.\n", argv[arg]);
+            return 1;
+        }
+    }
+
+    if (statsEnabled || traceEnabled)
+        m68k_set_os_call_hook_callback(osCallHook);
+
+    if (statsEnabled)
+        atexit(prgCacheReport);
 
-    if (argc < 2)
+#ifdef HOST_LINUX
+    // After the files are flushed, before the RAM disk is deleted
+    if (statsEnabled)
+        atexit(linuxRamDiskReport);
+#endif
+
+#ifdef HOST_LINUX
+    if (serverPath != NULL)
     {
-        fprintf(stderr, "usage: %s <program.tos> [arguments...]\n", argv[0]);
+        // The jobs are forked processes, which can't share these
+        if (gdbEnabled || traceEnabled)
+        {
+            fprintf(stderr, "error: -S cannot be used with -g or -t.\n");
+            return 1;
+        }
+
+        // Concurrent jobs would race on the same upper directory
+        if (overlayUpper)
+        {
+            fprintf(stderr, "error: -S cannot be used with an upper directory for -o.\n");
+            return 1;
+        }
 
+        if (linuxInit() < 0)
+        {
+            fprintf(stderr, "error: cannot allocate the guest memory.\n");
+            return 1;
+        }
+
+        // With a program, it is loaded and parked ready to run, so that
+        // starting its jobs only costs a fork
+        if (arg < argc)
+        {
+            parkedBasepage = loadProgram(argv + arg, argc - arg);
+            if (parkedBasepage < 0)
+                return 1;
+
+            return jobServerRun(serverPath, runOtherProgram, argv[arg], resumeParkedProgram, statsEnabled);
+        }
+
+        // Build the opcode tables once for all the jobs
+        m68k_set_cpu_type(M68K_CPU_TYPE_68020);
+        m68k_pulse_reset();
+
+        return jobServerRun(serverPath, runProgram, NULL, NULL, statsEnabled);
+    }
+#endif
+
+    if (arg >= argc)
+    {
+#ifdef HOST_LINUX
+        fprintf(stderr, "usage: %s [-g port] [-s] [-c MB] [-t trace.bin] [-r drive[:MB]] [-a drive:archive] [-o drive:lower[:upper]] <program.tos> [arguments...]\n"
+            "       %s [options] -S socket [program.tos]\n", argv[0], argv[0]);
+#else
+        fprintf(stderr, "usage: %s [-g port] [-s] [-c MB] [-t trace.bin] <program.tos> [arguments...]\n", argv[0]);
+#endif
+
+#ifndef HOST_LINUX
         fputs(
           "\033E" // Clear screen
           "68Kemu 20120317 ALPHA - A CPU emulator for Atari TOS computers\n"
@@ -357,36 +967,20 @@ int main(int argc, char* argv[])
           , stderr);
 
         Cnecin();
+#endif
 
         return 1;
     }
 
-    char tail[128];
-    buildCommandTail(tail, argv + 2, argc - 2);
-    bp = (BASEPAGE*)Pexec(PE_LOAD, argv[1], tail, NULL);
-    if ((long)bp < 0)
+#ifdef HOST_LINUX
+    if (linuxInit() < 0)
     {
-        fprintf(stderr, "error: cannot load %s.\n", argv[1]);
+        fprintf(stderr, "error: cannot allocate the guest memory.\n");
         return 1;
     }
+#else
+    installTosHooks();
+#endif
 
-    m68k_set_cpu_type(M68K_CPU_TYPE_68020);
-    m68k_pulse_reset(); // Patched
-    //m68k_set_int_ack_callback(int_ack_callback);
-    
-    pStack = (unsigned long*)bp->p_hitpa;
-    *--pStack = (unsigned long)bp;
-    *--pStack = (unsigned long)0;
-    
-    m68k_set_reg(M68K_REG_SP, (int)(systack + 1));
-    m68k_set_reg(M68K_REG_SR, 0x0300);
-    m68k_set_reg(M68K_REG_SP, (int)pStack);
-    m68k_set_reg(M68K_REG_PC, (int)bp->p_tbase);
-
-    for (;;)
-    {
-        m68k_execute(10000);
-    }
-    
-    return 0;
+    return runProgram(argv + arg, argc - arg);
 }
@@ -0,0 +1,171 @@
+/*
+  68kjob.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Client of the 68Kemu job server, for the Linux host.
+
+  Runs a TOS program in a server started with "68kemu -S socket", with the
+  current directory, environment and standard handles of the client, and
+  exits with the exit code of the program.
+*/
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "jobserver.h"
+
+extern char** environ;
+
+// Append a string to the request, or count its size if buffer is NULL
+static unsigned int addString(char* buffer, unsigned int length, const char* s)
+{
+    size_t size = strlen(s) + 1;
+
+    if (buffer != NULL)
+        memcpy(buffer + length, s, size);
+
+    return length + size;
+}
+
+static unsigned int buildStrings(char* buffer, const char* cwd, char* argv[], int argc, unsigned int* envc)
+{
+    unsigned int length = addString(buffer, 0, cwd);
+    char** var;
+    int i;
+
+    for (i = 0; i < argc; ++i)
+        length = addString(buffer, length, argv[i]);
+
+    *envc = 0;
+    for (var = environ; *var != NULL; ++var, ++*envc)
+        length = addString(buffer, length, *var);
+
+    return length;
+}
+
+static int sendRequest(int fd, char* argv[], int argc)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * JOB_NUM_FDS)];
+    } control;
+    static const int fds[JOB_NUM_FDS] = { 0, 1, 2 };
+    char cwd[PATH_MAX];
+    JobRequest request;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    char* strings;
+    ssize_t ret;
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return -1;
+
+    request.magic = JOB_MAGIC;
+    request.argc = argc;
+    request.length = buildStrings(NULL, cwd, argv, argc, &request.envc);
+    if (request.length > JOB_MAX_LENGTH)
+        return -1;
+
+    strings = malloc(request.length);
+    if (strings == NULL)
+        return -1;
+    buildStrings(strings, cwd, argv, argc, &request.envc);
+
+    // The handles go with the header, the strings may take several writes
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &request;
+    iov.iov_len = sizeof(request);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (ret == sizeof(request))
+    {
+        unsigned int done = 0;
+
+        while (done < request.length)
+        {
+            ret = send(fd, strings + done, request.length - done, MSG_NOSIGNAL);
+            if (ret <= 0)
+                break;
+            done += ret;
+        }
+        ret = done == request.length ? 0 : -1;
+    }
+    else
+        ret = -1;
+
+    free(strings);
+    return (int)ret;
+}
+
+int main(int argc, char* argv[])
+{
+    struct sockaddr_un addr;
+    int code;
+    int fd;
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: %s <socket> <program.tos> [arguments...]\n", argv[0]);
+        return 1;
+    }
+
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "error: socket path too long.\n");
+        return 1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        fprintf(stderr, "error: cannot connect to %s.\n", argv[1]);
+        return 1;
+    }
+
+    if (sendRequest(fd, argv + 2, argc - 2) < 0)
+    {
+        fprintf(stderr, "error: cannot send the job.\n");
+        return 1;
+    }
+
+    // The job writes directly to our handles, we only wait for the exit code
+    if (recv(fd, &code, sizeof(code), MSG_WAITALL) != sizeof(code))
+    {
+        fprintf(stderr, "error: the job server closed the connection.\n");
+        return 1;
+    }
+
+    return code;
+}
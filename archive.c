@@ -0,0 +1,500 @@
+/*
+  archive.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Read-only ZIP and tar archives, for the archive drives of the Linux host.
+
+  The archive is mapped into memory. A ZIP archive is indexed from its
+  central directory only, so opening it does not depend on its size. A tar
+  archive has no directory, so its headers are read one after the other.
+  The index is sorted by name ignoring case, so lookups are binary searches
+  and the entries of a directory are contiguous.
+
+  Stored entries are served straight from the mapping. Deflated entries are
+  inflated when they are opened, and kept while they are in use.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "archive.h"
+
+struct Archive
+{
+    const unsigned char* base;
+    size_t length;
+    int zip;
+    ArchiveEntry* entries;
+    size_t count;
+    size_t capacity;
+};
+
+#define GET16(p) ((unsigned int)(p)[0] | ((unsigned int)(p)[1] << 8))
+#define GET32(p) (GET16(p) | (GET16((p) + 2) << 16))
+
+// ZIP records
+#define ZIP_EOCD_SIG    0x06054b50
+#define ZIP_EOCD_SIZE   22
+#define ZIP_CENTRAL_SIG 0x02014b50
+#define ZIP_CENTRAL_SIZE 46
+#define ZIP_LOCAL_SIG   0x04034b50
+#define ZIP_LOCAL_SIZE  30
+
+#define TAR_BLOCK 512
+
+static time_t dosToTime(unsigned int dosTime, unsigned int dosDate)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_hour = dosTime >> 11;
+    tm.tm_min = (dosTime >> 5) & 0x3f;
+    tm.tm_sec = (dosTime & 0x1f) * 2;
+    tm.tm_year = (dosDate >> 9) + 80;
+    tm.tm_mon = ((dosDate >> 5) & 0x0f) - 1;
+    tm.tm_mday = dosDate & 0x1f;
+    tm.tm_isdst = -1;
+
+    return mktime(&tm);
+}
+
+// Append an entry. The name is copied without leading "./" and slashes,
+// and without trailing slashes.
+static ArchiveEntry* addEntry(Archive* archive, const char* name, size_t len)
+{
+    ArchiveEntry* entry;
+
+    for (;;)
+    {
+        if (len > 0 && name[0] == '/')
+            name++, len--;
+        else if (len > 1 && name[0] == '.' && name[1] == '/')
+            name += 2, len -= 2;
+        else
+            break;
+    }
+    while (len > 0 && name[len - 1] == '/')
+        --len;
+    if (len == 0)
+        return NULL;
+
+    if (archive->count == archive->capacity)
+    {
+        size_t capacity = archive->capacity ? archive->capacity * 2 : 256;
+        ArchiveEntry* entries = realloc(archive->entries, capacity * sizeof(ArchiveEntry));
+        if (entries == NULL)
+            return NULL;
+        archive->entries = entries;
+        archive->capacity = capacity;
+    }
+
+    entry = &archive->entries[archive->count];
+    memset(entry, 0, sizeof(*entry));
+    entry->name = malloc(len + 1);
+    if (entry->name == NULL)
+        return NULL;
+    memcpy(entry->name, name, len);
+    entry->name[len] = '\0';
+
+    archive->count++;
+    return entry;
+}
+
+static int readZip(Archive* archive)
+{
+    const unsigned char* p;
+    const unsigned char* end = archive->base + archive->length;
+    const unsigned char* eocd = NULL;
+    unsigned int count;
+    unsigned int i;
+
+    if (archive->length < ZIP_EOCD_SIZE)
+        return -1;
+
+    // The end record is followed by a comment of up to 64 KB
+    for (p = end - ZIP_EOCD_SIZE; p >= archive->base && p >= end - ZIP_EOCD_SIZE - 0xffff; --p)
+    {
+        if (GET32(p) == ZIP_EOCD_SIG)
+        {
+            eocd = p;
+            break;
+        }
+    }
+    if (eocd == NULL)
+        return -1;
+
+    count = GET16(eocd + 10);
+    p = archive->base + GET32(eocd + 16);
+
+    for (i = 0; i < count; ++i)
+    {
+        ArchiveEntry* entry;
+        unsigned int nameLen;
+
+        if (p + ZIP_CENTRAL_SIZE > end || GET32(p) != ZIP_CENTRAL_SIG)
+            return -1;
+
+        nameLen = GET16(p + 28);
+        if (p + ZIP_CENTRAL_SIZE + nameLen > end)
+            return -1;
+
+        // Encrypted entries are ignored
+        if (!(GET16(p + 8) & 1))
+        {
+            entry = addEntry(archive, (const char*)p + ZIP_CENTRAL_SIZE, nameLen);
+            if (entry != NULL)
+            {
+                entry->isDir = p[ZIP_CENTRAL_SIZE + nameLen - 1] == '/';
+                entry->method = GET16(p + 10);
+                entry->mtime = dosToTime(GET16(p + 12), GET16(p + 14));
+                entry->compressedSize = GET32(p + 20);
+                entry->size = entry->isDir ? 0 : GET32(p + 24);
+                entry->offset = GET32(p + 42);
+            }
+        }
+
+        p += ZIP_CENTRAL_SIZE + nameLen + GET16(p + 30) + GET16(p + 32);
+    }
+
+    // Only now, as a tar member may contain a stray end record signature
+    archive->zip = 1;
+    return 0;
+}
+
+static unsigned long octal(const unsigned char* p, size_t len)
+{
+    unsigned long value = 0;
+
+    while (len > 0 && (*p == ' ' || *p == '\0'))
+        ++p, --len;
+    while (len > 0 && *p >= '0' && *p <= '7')
+        value = value * 8 + (*p++ - '0'), --len;
+
+    return value;
+}
+
+static int readTar(Archive* archive)
+{
+    size_t offset = 0;
+    const char* longName = NULL;
+    size_t longLen = 0;
+
+    if (archive->length < TAR_BLOCK || memcmp(archive->base + 257, "ustar", 5) != 0)
+        return -1;
+
+    while (offset + TAR_BLOCK <= archive->length)
+    {
+        const unsigned char* h = archive->base + offset;
+        unsigned long size = octal(h + 124, 12);
+        char type = (char)h[156];
+        char name[256];
+        ArchiveEntry* entry;
+
+        if (h[0] == '\0')
+            break; // End of archive
+
+        offset += TAR_BLOCK;
+        if (offset + size > archive->length)
+            return -1;
+
+        // GNU long name, for the next header
+        if (type == 'L')
+        {
+            longName = (const char*)archive->base + offset;
+            longLen = strnlen(longName, size);
+            offset += (size + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1);
+            continue;
+        }
+
+        if (type == '0' || type == '\0' || type == '5')
+        {
+            if (longName != NULL)
+                entry = addEntry(archive, longName, longLen);
+            else
+            {
+                // Ustar prefix, then name
+                size_t prefixLen = strnlen((const char*)h + 345, 155);
+                size_t nameLen = strnlen((const char*)h, 100);
+
+                memcpy(name, h + 345, prefixLen);
+                if (prefixLen > 0)
+                    name[prefixLen++] = '/';
+                memcpy(name + prefixLen, h, nameLen);
+                entry = addEntry(archive, name, prefixLen + nameLen);
+            }
+
+            if (entry != NULL)
+            {
+                entry->isDir = type == '5';
+                entry->size = entry->isDir ? 0 : size;
+                entry->compressedSize = entry->size;
+                entry->mtime = octal(h + 136, 12);
+                entry->offset = offset;
+            }
+        }
+
+        longName = NULL;
+        offset += (size + TAR_BLOCK - 1) & ~(size_t)(TAR_BLOCK - 1);
+    }
+
+    return 0;
+}
+
+// By name ignoring case, then the real entries before the implicit ones
+static int compareEntries(const void* a, const void* b)
+{
+    const ArchiveEntry* ea = a;
+    const ArchiveEntry* eb = b;
+    int c = strcasecmp(ea->name, eb->name);
+
+    return c != 0 ? c : ea->implicit - eb->implicit;
+}
+
+// Add the parent directories which have no entry, then sort and remove the
+// duplicates, so the index can be searched.
+static void buildIndex(Archive* archive)
+{
+    size_t count = archive->count;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < count; ++i)
+    {
+        const char* slash = archive->entries[i].name;
+
+        while ((slash = strchr(slash, '/')) != NULL)
+        {
+            ArchiveEntry* dir = addEntry(archive, archive->entries[i].name, slash - archive->entries[i].name);
+            if (dir != NULL)
+            {
+                dir->isDir = 1;
+                dir->implicit = 1;
+                dir->mtime = archive->entries[i].mtime;
+            }
+            ++slash;
+        }
+    }
+
+    qsort(archive->entries, archive->count, sizeof(ArchiveEntry), compareEntries);
+
+    for (i = j = 0; i < archive->count; ++i)
+    {
+        if (j > 0 && strcasecmp(archive->entries[j - 1].name, archive->entries[i].name) == 0)
+            free(archive->entries[i].name);
+        else
+            archive->entries[j++] = archive->entries[i];
+    }
+    archive->count = j;
+}
+
+Archive* archiveOpen(const char* path)
+{
+    Archive* archive;
+    struct stat st;
+    void* base;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0
+        || (base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+
+    archive = calloc(1, sizeof(Archive));
+    if (archive == NULL)
+    {
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    archive->base = base;
+    archive->length = st.st_size;
+
+    if (readZip(archive) < 0 && (archive->count != 0 || readTar(archive) < 0))
+    {
+        size_t i;
+
+        for (i = 0; i < archive->count; ++i)
+            free(archive->entries[i].name);
+        munmap(base, st.st_size);
+        free(archive->entries);
+        free(archive);
+        return NULL;
+    }
+
+    buildIndex(archive);
+    return archive;
+}
+
+// Index of the first entry not before name
+static size_t lowerBound(const Archive* archive, const char* name)
+{
+    size_t low = 0;
+    size_t high = archive->count;
+
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+
+        if (strcasecmp(archive->entries[mid].name, name) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+const ArchiveEntry* archiveFind(const Archive* archive, const char* path)
+{
+    static ArchiveEntry root = { "", 1 };
+    size_t i;
+
+    if (path[0] == '\0')
+        return &root;
+
+    i = lowerBound(archive, path);
+    if (i < archive->count && strcasecmp(archive->entries[i].name, path) == 0)
+        return &archive->entries[i];
+
+    return NULL;
+}
+
+const ArchiveEntry* archiveReadDir(const Archive* archive, const char* dir, size_t* cursor)
+{
+    size_t len = strlen(dir);
+    size_t i = *cursor;
+
+    if (i == 0 && len > 0)
+    {
+        char prefix[PATH_MAX];
+
+        if (len + 2 > sizeof(prefix))
+            return NULL;
+        memcpy(prefix, dir, len);
+        strcpy(prefix + len, "/");
+        i = lowerBound(archive, prefix);
+    }
+
+    for (; i < archive->count; ++i)
+    {
+        const char* name = archive->entries[i].name;
+
+        if (len > 0 && (strncasecmp(name, dir, len) != 0 || name[len] != '/'))
+            break;
+
+        // Not in a subdirectory
+        if (strchr(name + (len > 0 ? len + 1 : 0), '/') == NULL)
+        {
+            *cursor = i + 1;
+            return &archive->entries[i];
+        }
+    }
+
+    *cursor = i;
+    return NULL;
+}
+
+const unsigned char* archiveData(Archive* archive, const ArchiveEntry* constEntry)
+{
+    ArchiveEntry* entry = (ArchiveEntry*)constEntry;
+    const unsigned char* data;
+    z_stream zs;
+    int ret;
+
+    if (entry->isDir)
+        return NULL;
+
+    data = archive->base + entry->offset;
+
+    // The ZIP local header has its own variable fields
+    if (archive->zip)
+    {
+        if (entry->offset + ZIP_LOCAL_SIZE > archive->length || GET32(data) != ZIP_LOCAL_SIG)
+            return NULL;
+        data += ZIP_LOCAL_SIZE + GET16(data + 26) + GET16(data + 28);
+    }
+
+    if ((size_t)(data - archive->base) + entry->compressedSize > archive->length)
+        return NULL;
+
+    if (entry->method == 0)
+    {
+        // The reads go up to the size, which must be in the archive too
+        if (entry->size != entry->compressedSize)
+            return NULL;
+        entry->refs++;
+        return data;
+    }
+
+    if (entry->method != 8)
+        return NULL;
+
+    if (entry->inflated == NULL)
+    {
+        entry->inflated = malloc(entry->size ? entry->size : 1);
+        if (entry->inflated == NULL)
+            return NULL;
+
+        memset(&zs, 0, sizeof(zs));
+        zs.next_in = (unsigned char*)data;
+        zs.avail_in = entry->compressedSize;
+        zs.next_out = entry->inflated;
+        zs.avail_out = entry->size;
+
+        // Raw deflate stream, without zlib header
+        ret = inflateInit2(&zs, -MAX_WBITS);
+        if (ret == Z_OK)
+        {
+            ret = inflate(&zs, Z_FINISH);
+            inflateEnd(&zs);
+        }
+
+        if (ret != Z_STREAM_END || zs.total_out != entry->size)
+        {
+            free(entry->inflated);
+            entry->inflated = NULL;
+            return NULL;
+        }
+    }
+
+    entry->refs++;
+    return entry->inflated;
+}
+
+void archiveRelease(Archive* archive, const ArchiveEntry* constEntry)
+{
+    ArchiveEntry* entry = (ArchiveEntry*)constEntry;
+
+    if (--entry->refs == 0 && entry->inflated != NULL)
+    {
+        free(entry->inflated);
+        entry->inflated = NULL;
+    }
+}
@@ -0,0 +1,60 @@
+/*
+  archive.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_ARCHIVE_H__
+#define __INC_ARCHIVE_H__
+
+#include <time.h>
+
+typedef struct
+{
+    char* name;          // Path in the archive, with '/' separators
+    int isDir;
+    unsigned int size;   // Uncompressed size
+    time_t mtime;
+
+    // Private
+    int method;          // 0 stored, 8 deflate
+    int implicit;        // Directory without its own entry
+    unsigned int compressedSize;
+    size_t offset;       // ZIP local header, or tar data
+    unsigned char* inflated;
+    int refs;
+} ArchiveEntry;
+
+typedef struct Archive Archive;
+
+// Map a ZIP or tar archive and index its entries.
+// Returns NULL on error.
+Archive* archiveOpen(const char* path);
+
+// Find an entry by path, ignoring case. The root directory is "".
+// Returns NULL if there is no such entry.
+const ArchiveEntry* archiveFind(const Archive* archive, const char* path);
+
+// Iterate the entries of a directory. Start with *cursor set to 0.
+// Returns NULL after the last entry.
+const ArchiveEntry* archiveReadDir(const Archive* archive, const char* dir, size_t* cursor);
+
+// Get the contents of a file entry, decompressed if needed.
+// Returns NULL on error. Each successful call must be paired with
+// archiveRelease().
+const unsigned char* archiveData(Archive* archive, const ArchiveEntry* entry);
+
+// Release the contents returned by archiveData().
+void archiveRelease(Archive* archive, const ArchiveEntry* entry);
+
+#endif /* __INC_ARCHIVE_H__ */
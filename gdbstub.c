@@ -0,0 +1,642 @@
+/*
+  gdbstub.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  GDB Remote Serial Protocol server for the emulated CPU.
+
+  The stub never runs inside m68k_execute(). Breakpoints and watchpoints
+  end the current timeslice, and gdbPoll() is called by the run loop
+  between timeslices to report the stop and serve the debugger until it
+  resumes execution.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "musashi/m68k.h"
+#include "gdbstub.h"
+#ifdef HOST_LINUX
+#include "linuxos.h"
+#endif
+
+#define PACKET_SIZE 4096
+
+// Signal numbers used in stop replies
+#define GDB_SIGINT  2
+#define GDB_SIGTRAP 5
+
+// Registers in the order of GDB's m68k core feature
+#define NUM_REGS 18
+
+static const char targetXml[] =
+    "<?xml version=\"1.0\"?>"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+    "<target>"
+    "<architecture>m68k:68020</architecture>"
+    "<feature name=\"org.gnu.gdb.m68k.core\">"
+    "<reg name=\"d0\" bitsize=\"32\"/>"
+    "<reg name=\"d1\" bitsize=\"32\"/>"
+    "<reg name=\"d2\" bitsize=\"32\"/>"
+    "<reg name=\"d3\" bitsize=\"32\"/>"
+    "<reg name=\"d4\" bitsize=\"32\"/>"
+    "<reg name=\"d5\" bitsize=\"32\"/>"
+    "<reg name=\"d6\" bitsize=\"32\"/>"
+    "<reg name=\"d7\" bitsize=\"32\"/>"
+    "<reg name=\"a0\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"a1\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"a2\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"a3\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"a4\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"a5\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"fp\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>"
+    "<reg name=\"ps\" bitsize=\"32\"/>"
+    "<reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>"
+    "</feature>"
+    "</target>";
+
+static int listenFd = -1;
+static int clientFd = -1;
+
+// Reason of the pending stop, 0 if running
+static int stopSignal;
+static const char* stopWatchKind;
+static unsigned int stopWatchAddress;
+
+static char packet[PACKET_SIZE];
+static char reply[PACKET_SIZE];
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Parse a hex number, stopping at the first non-hex character
+static unsigned int parseHex(const char** p)
+{
+    unsigned int value = 0;
+    int digit;
+
+    while ((digit = hexValue(**p)) >= 0)
+    {
+        value = (value << 4) | digit;
+        ++*p;
+    }
+
+    return value;
+}
+
+static char* putHex32(char* p, unsigned int value)
+{
+    int shift;
+
+    for (shift = 28; shift >= 0; shift -= 4)
+        *p++ = hexDigits[(value >> shift) & 0xf];
+
+    return p;
+}
+
+static unsigned int regNum(int gdbReg)
+{
+    if (gdbReg < 16)
+        return M68K_REG_D0 + gdbReg;
+
+    return gdbReg == 16 ? M68K_REG_SR : M68K_REG_PC;
+}
+
+static int isAccessible(unsigned int address, unsigned int length)
+{
+#ifdef HOST_LINUX
+    return linuxIsRam(address, length);
+#else
+    // The TOS system variables are only readable in supervisor mode
+    return address >= 0x800 && address + length >= address;
+#endif
+}
+
+/* ------------------------------------------------------------------------ */
+/* Transport                                                                */
+/* ------------------------------------------------------------------------ */
+
+static void disconnect(void)
+{
+    close(clientFd);
+    clientFd = -1;
+    stopSignal = 0;
+
+    m68k_clear_breakpoints();
+#if M68K_EMULATE_WATCHPOINTS
+    m68k_clear_watchpoints();
+#endif
+}
+
+static int getChar(void)
+{
+    unsigned char c;
+
+    if (recv(clientFd, &c, 1, 0) != 1)
+        return -1;
+
+    return c;
+}
+
+static int sendPacket(const char* data)
+{
+    static char buffer[PACKET_SIZE + 4];
+    unsigned char checksum = 0;
+    size_t len = strlen(data);
+    size_t i;
+    int c;
+
+    buffer[0] = '$';
+    memcpy(buffer + 1, data, len);
+    for (i = 0; i < len; ++i)
+        checksum += (unsigned char)data[i];
+    buffer[len + 1] = '#';
+    buffer[len + 2] = hexDigits[checksum >> 4];
+    buffer[len + 3] = hexDigits[checksum & 0xf];
+
+    do
+    {
+        if (send(clientFd, buffer, len + 4, 0) != (ssize_t)(len + 4))
+            return -1;
+
+        c = getChar();
+    } while (c == '-');
+
+    return c == '+' ? 0 : -1;
+}
+
+// Wait for the next packet. Returns -1 if the connection is lost.
+static int receivePacket(void)
+{
+    unsigned char checksum;
+    int len;
+    int c;
+
+    for (;;)
+    {
+        do
+        {
+            c = getChar();
+            if (c < 0)
+                return -1;
+        } while (c != '$');
+
+        checksum = 0;
+        len = 0;
+        while ((c = getChar()) >= 0 && c != '#')
+        {
+            if (len < PACKET_SIZE - 1)
+                packet[len++] = (char)c;
+            checksum += (unsigned char)c;
+        }
+        if (c < 0)
+            return -1;
+        packet[len] = '\0';
+
+        c = (hexValue(getChar()) << 4);
+        c |= hexValue(getChar());
+
+        if (c == checksum)
+        {
+            send(clientFd, "+", 1, 0);
+            return 0;
+        }
+
+        send(clientFd, "-", 1, 0);
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Events from the CPU core                                                 */
+/* ------------------------------------------------------------------------ */
+
+static void breakpointHit(unsigned int address)
+{
+    stopSignal = GDB_SIGTRAP;
+}
+
+#if M68K_EMULATE_WATCHPOINTS
+static void watchpointHit(unsigned int address, unsigned int pc, int type)
+{
+    stopSignal = GDB_SIGTRAP;
+    stopWatchAddress = address;
+
+    if (type == M68K_WATCH_WRITE)
+        stopWatchKind = "watch";
+    else if (type == M68K_WATCH_READ)
+        stopWatchKind = "rwatch";
+    else
+        stopWatchKind = "awatch";
+}
+#endif
+
+/* ------------------------------------------------------------------------ */
+/* Commands                                                                 */
+/* ------------------------------------------------------------------------ */
+
+static void stopReply(char* out)
+{
+    if (stopWatchKind != NULL)
+    {
+        sprintf(out, "T%02x%s:%08x;", stopSignal, stopWatchKind, stopWatchAddress);
+        stopWatchKind = NULL;
+    }
+    else
+    {
+        sprintf(out, "S%02x", stopSignal);
+    }
+}
+
+static void readRegisters(char* out)
+{
+    int i;
+
+    for (i = 0; i < NUM_REGS; ++i)
+        out = putHex32(out, m68k_get_reg(NULL, regNum(i)));
+
+    *out = '\0';
+}
+
+static void writeRegisters(const char* in, char* out)
+{
+    int i;
+
+    for (i = 0; i < NUM_REGS && strlen(in) >= 8; ++i)
+    {
+        char hex[9];
+        const char* p = hex;
+
+        memcpy(hex, in, 8);
+        hex[8] = '\0';
+        m68k_set_reg(regNum(i), parseHex(&p));
+        in += 8;
+    }
+
+    strcpy(out, "OK");
+}
+
+static void readMemory(const char* in, char* out)
+{
+    unsigned int address = parseHex(&in);
+    unsigned int length;
+
+    ++in; // ','
+    length = parseHex(&in);
+    if (length > (PACKET_SIZE - 1) / 2)
+        length = (PACKET_SIZE - 1) / 2;
+
+    if (!isAccessible(address, length))
+    {
+        strcpy(out, "E14");
+        return;
+    }
+
+    // Not a hit of the guest
+#if M68K_EMULATE_WATCHPOINTS
+    m68k_suspend_watchpoints();
+#endif
+    while (length--)
+    {
+        unsigned int byte = m68k_read_memory_8(address++);
+        *out++ = hexDigits[byte >> 4];
+        *out++ = hexDigits[byte & 0xf];
+    }
+    *out = '\0';
+#if M68K_EMULATE_WATCHPOINTS
+    m68k_resume_watchpoints();
+#endif
+}
+
+static void writeMemory(const char* in, char* out)
+{
+    unsigned int address = parseHex(&in);
+    unsigned int length;
+
+    ++in; // ','
+    length = parseHex(&in);
+    ++in; // ':'
+
+    if (!isAccessible(address, length) || strlen(in) < length * 2)
+    {
+        strcpy(out, "E14");
+        return;
+    }
+
+#if M68K_EMULATE_WATCHPOINTS
+    m68k_suspend_watchpoints();
+#endif
+    while (length--)
+    {
+        m68k_write_memory_8(address++, (hexValue(in[0]) << 4) | hexValue(in[1]));
+        in += 2;
+    }
+#if M68K_EMULATE_WATCHPOINTS
+    m68k_resume_watchpoints();
+#endif
+
+    strcpy(out, "OK");
+}
+
+// Z/z packets: insert or remove a breakpoint or watchpoint
+static void setPoint(const char* in, char* out, int insert)
+{
+    int type = *in++ - '0';
+    unsigned int address;
+    int ret;
+
+    ++in; // ','
+    address = parseHex(&in);
+    ++in; // ','
+
+    switch (type)
+    {
+        case 0: // Software breakpoint
+            // The opcode is patched in memory, which may be watched
+#if M68K_EMULATE_WATCHPOINTS
+            m68k_suspend_watchpoints();
+#endif
+            ret = insert ? m68k_set_breakpoint(address) : m68k_clear_breakpoint(address);
+#if M68K_EMULATE_WATCHPOINTS
+            m68k_resume_watchpoints();
+#endif
+            break;
+
+#if M68K_EMULATE_WATCHPOINTS
+        case 2: // Write watchpoint
+        case 3: // Read watchpoint
+        case 4: // Access watchpoint
+        {
+            unsigned int length = parseHex(&in);
+            int watch = type == 2 ? M68K_WATCH_WRITE
+                      : type == 3 ? M68K_WATCH_READ
+                      : M68K_WATCH_READ | M68K_WATCH_WRITE;
+
+            ret = insert ? m68k_add_watchpoint(address, length, watch)
+                         : m68k_remove_watchpoint(address, length, watch);
+            break;
+        }
+#endif
+
+        default: // Unsupported
+            out[0] = '\0';
+            return;
+    }
+
+    strcpy(out, ret == 0 ? "OK" : "E01");
+}
+
+static void query(const char* in, char* out)
+{
+    static const char xferTarget[] = "qXfer:features:read:target.xml:";
+
+    out[0] = '\0';
+
+    if (strncmp(in, "qSupported", 10) == 0)
+    {
+        sprintf(out, "PacketSize=%x;qXfer:features:read+", PACKET_SIZE - 1);
+    }
+    else if (strcmp(in, "qAttached") == 0)
+    {
+        strcpy(out, "1");
+    }
+    else if (strncmp(in, xferTarget, sizeof(xferTarget) - 1) == 0)
+    {
+        const char* p = in + sizeof(xferTarget) - 1;
+        unsigned int offset = parseHex(&p);
+        unsigned int length;
+        unsigned int total = sizeof(targetXml) - 1;
+
+        ++p; // ','
+        length = parseHex(&p);
+        if (length > PACKET_SIZE - 2)
+            length = PACKET_SIZE - 2;
+
+        if (offset >= total)
+        {
+            strcpy(out, "l");
+        }
+        else
+        {
+            if (length > total - offset)
+                length = total - offset;
+            out[0] = offset + length < total ? 'm' : 'l';
+            memcpy(out + 1, targetXml + offset, length);
+            out[length + 1] = '\0';
+        }
+    }
+}
+
+// Serve the debugger until it resumes execution.
+// Returns -1 if the debugger has gone.
+static int serve(void)
+{
+    stopReply(reply);
+    if (sendPacket(reply) < 0)
+        return -1;
+
+    for (;;)
+    {
+        if (receivePacket() < 0)
+            return -1;
+
+        reply[0] = '\0';
+
+        switch (packet[0])
+        {
+            case '?':
+                stopReply(reply);
+                break;
+
+            case 'g':
+                readRegisters(reply);
+                break;
+
+            case 'G':
+                writeRegisters(packet + 1, reply);
+                break;
+
+            case 'p':
+            {
+                const char* p = packet + 1;
+                unsigned int n = parseHex(&p);
+
+                if (n < NUM_REGS)
+                    putHex32(reply, m68k_get_reg(NULL, regNum(n)))[0] = '\0';
+                else
+                    strcpy(reply, "E45");
+                break;
+            }
+
+            case 'P':
+            {
+                const char* p = packet + 1;
+                unsigned int n = parseHex(&p);
+
+                ++p; // '='
+                if (n < NUM_REGS)
+                {
+                    m68k_set_reg(regNum(n), parseHex(&p));
+                    strcpy(reply, "OK");
+                }
+                else
+                {
+                    strcpy(reply, "E45");
+                }
+                break;
+            }
+
+            case 'm':
+                readMemory(packet + 1, reply);
+                break;
+
+            case 'M':
+                writeMemory(packet + 1, reply);
+                break;
+
+            case 'Z':
+            case 'z':
+                setPoint(packet + 1, reply, packet[0] == 'Z');
+                break;
+
+            case 'q':
+                query(packet, reply);
+                break;
+
+            case 'H':
+                strcpy(reply, "OK");
+                break;
+
+            case 'c':
+                if (packet[1] != '\0')
+                {
+                    const char* p = packet + 1;
+                    m68k_set_reg(M68K_REG_PC, parseHex(&p));
+                }
+                stopSignal = 0;
+                return 0;
+
+            case 's':
+                if (packet[1] != '\0')
+                {
+                    const char* p = packet + 1;
+                    m68k_set_reg(M68K_REG_PC, parseHex(&p));
+                }
+                m68k_step();
+                stopSignal = GDB_SIGTRAP;
+                stopReply(reply);
+                break;
+
+            case 'D':
+                sendPacket("OK");
+                return -1;
+
+            case 'k':
+                exit(1);
+        }
+
+        if (sendPacket(reply) < 0)
+            return -1;
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Public interface                                                         */
+/* ------------------------------------------------------------------------ */
+
+int gdbListen(int port)
+{
+    struct sockaddr_in addr;
+    int on = 1;
+
+    listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd < 0)
+        return -1;
+
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(listenFd, 1) < 0)
+    {
+        close(listenFd);
+        listenFd = -1;
+        return -1;
+    }
+
+    // Only poll for connections between timeslices
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+
+    return 0;
+}
+
+void gdbPoll(void)
+{
+    if (listenFd < 0)
+        return;
+
+    if (clientFd < 0)
+    {
+        clientFd = accept(listenFd, NULL, NULL);
+        if (clientFd < 0)
+            return;
+
+        // Stop the program as soon as the debugger is attached
+        fcntl(clientFd, F_SETFL, fcntl(clientFd, F_GETFL) & ~O_NONBLOCK);
+        m68k_set_breakpoint_callback(breakpointHit);
+#if M68K_EMULATE_WATCHPOINTS
+        m68k_set_watchpoint_callback(watchpointHit);
+#endif
+        stopSignal = GDB_SIGTRAP;
+    }
+    else if (stopSignal == 0)
+    {
+        unsigned char c;
+        ssize_t n = recv(clientFd, &c, 1, MSG_DONTWAIT);
+
+        if (n == 0)
+        {
+            disconnect();
+            return;
+        }
+
+        // Ctrl-C from the debugger
+        if (n == 1 && c == 0x03)
+            stopSignal = GDB_SIGINT;
+    }
+
+    if (stopSignal != 0 && serve() < 0)
+        disconnect();
+}
@@ -0,0 +1,28 @@
+/*
+  gdbstub.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_GDBSTUB_H__
+#define __INC_GDBSTUB_H__
+
+// Listen for a GDB remote connection on 127.0.0.1:port.
+// Returns 0 on success, -1 on error.
+int gdbListen(int port);
+
+// Serve the debugger, if any. Must be called between two m68k_execute().
+// When no debugger is attached, this only checks for a new connection.
+void gdbPoll(void);
+
+#endif /* __INC_GDBSTUB_H__ */
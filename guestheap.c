@@ -0,0 +1,655 @@
+/*
+  guestheap.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Guest memory allocator for Malloc(), Mxalloc(), Mfree() and Mshrink().
+
+  All the bookkeeping is in host memory, so the guest can't corrupt it.
+  The small blocks are taken from slabs of objects of the same size class,
+  with a free list per slab. The large blocks are kept in address order,
+  and the free ones are in lists by power of two of their size, with a bitmap
+  of the non-empty lists: a list large enough is found with a single bit
+  scan, and a freed block is merged with its free neighbours at once.
+  The blocks are found by address with a hash table.
+
+  The ST and TT RAM have separate free lists, for the modes of Mxalloc().
+  Each allocation records its owner, so the memory of a terminated child
+  process can be found and freed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "guestheap.h"
+#include "tosdefs.h"
+
+#define HEAP_ALIGN   16
+#define SMALL_MAX    1024                      // Largest size served by slabs
+#define NUM_CLASSES  (SMALL_MAX / HEAP_ALIGN)
+#define SLAB_SIZE    8192
+#define NUM_LISTS    32
+
+enum
+{
+    TYPE_ST,
+    TYPE_TT,
+    NUM_TYPES
+};
+
+struct Slab;
+
+typedef struct Block
+{
+    unsigned int start;
+    unsigned int size;
+    unsigned int arena;          // Start of the arena given to heapAddArena()
+    unsigned char used;
+    unsigned char type;
+    unsigned char releasable;
+    struct Block* prevPhys;      // Neighbours in the arena
+    struct Block* nextPhys;
+    struct Block* prevFree;      // Free list of the size
+    struct Block* nextFree;
+    struct Slab* slab;           // Objects carved from this block, or NULL
+} Block;
+
+typedef struct Slab
+{
+    Block* block;
+    unsigned int objectSize;
+    unsigned short count;
+    unsigned short used;
+    unsigned short freeHead;     // First free object, or count
+    unsigned short* next;        // Free list links, by object
+    struct Slab* prev;           // Slabs of the class with free objects
+    struct Slab* nextSlab;
+} Slab;
+
+// Allocated block or object, by address
+typedef struct
+{
+    unsigned int address;        // 0 if the entry is empty
+    Block* block;
+    Slab* slab;
+    unsigned int owner;          // Basepage of the owner process
+} Entry;
+
+static Block* freeLists[NUM_TYPES][NUM_LISTS];
+static unsigned int freeMap[NUM_TYPES];
+static Slab* partialSlabs[NUM_TYPES][NUM_CLASSES];
+
+static Entry* entries;
+static unsigned int entryCapacity;
+static unsigned int entryCount;
+static unsigned int currentOwner;
+
+static HeapGrowFunc* growFunc;
+static HeapReleaseFunc* releaseFunc;
+static HeapAvailableFunc* availableFunc;
+
+static void* hostAlloc(size_t size)
+{
+    void* p = malloc(size);
+
+    if (p == NULL)
+    {
+        fprintf(stderr, "68kemu: out of host memory.\n");
+        exit(1);
+    }
+
+    return p;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Address table                                                            */
+/* ------------------------------------------------------------------------ */
+
+static unsigned int entryHash(unsigned int address)
+{
+    return ((address >> 4) * 2654435761u) & (entryCapacity - 1);
+}
+
+static Entry* findEntry(unsigned int address)
+{
+    unsigned int i;
+
+    if (entryCount == 0 || address == 0)
+        return NULL;
+
+    for (i = entryHash(address); entries[i].address != 0; i = (i + 1) & (entryCapacity - 1))
+    {
+        if (entries[i].address == address)
+            return &entries[i];
+    }
+
+    return NULL;
+}
+
+static void addEntry(unsigned int address, Block* block, Slab* slab, unsigned int owner)
+{
+    unsigned int i;
+
+    // Keep the table at most half full
+    if ((entryCount + 1) * 2 > entryCapacity)
+    {
+        Entry* old = entries;
+        unsigned int oldCapacity = entryCapacity;
+
+        entryCapacity = entryCapacity != 0 ? entryCapacity * 2 : 256;
+        entries = hostAlloc(entryCapacity * sizeof(Entry));
+        memset(entries, 0, entryCapacity * sizeof(Entry));
+        entryCount = 0;
+
+        for (i = 0; i < oldCapacity; ++i)
+        {
+            if (old[i].address != 0)
+                addEntry(old[i].address, old[i].block, old[i].slab, old[i].owner);
+        }
+        free(old);
+    }
+
+    for (i = entryHash(address); entries[i].address != 0; i = (i + 1) & (entryCapacity - 1))
+        ;
+
+    entries[i].address = address;
+    entries[i].block = block;
+    entries[i].slab = slab;
+    entries[i].owner = owner;
+    entryCount++;
+}
+
+// Remove an entry, moving back the following ones of the probe sequence
+static void removeEntry(Entry* entry)
+{
+    unsigned int hole = (unsigned int)(entry - entries);
+    unsigned int i = hole;
+
+    for (;;)
+    {
+        unsigned int home;
+
+        i = (i + 1) & (entryCapacity - 1);
+        if (entries[i].address == 0)
+            break;
+
+        home = entryHash(entries[i].address);
+        if (((i - home) & (entryCapacity - 1)) >= ((i - hole) & (entryCapacity - 1)))
+        {
+            entries[hole] = entries[i];
+            hole = i;
+        }
+    }
+
+    entries[hole].address = 0;
+    entryCount--;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Large blocks                                                             */
+/* ------------------------------------------------------------------------ */
+
+static int floorLog2(unsigned int size)
+{
+    return 31 - __builtin_clz(size);
+}
+
+static void insertFree(Block* block)
+{
+    int list = floorLog2(block->size);
+    Block** head = &freeLists[block->type][list];
+
+    block->prevFree = NULL;
+    block->nextFree = *head;
+    if (*head != NULL)
+        (*head)->prevFree = block;
+    *head = block;
+    freeMap[block->type] |= 1u << list;
+}
+
+static void removeFree(Block* block)
+{
+    int list = floorLog2(block->size);
+
+    if (block->prevFree != NULL)
+        block->prevFree->nextFree = block->nextFree;
+    else
+        freeLists[block->type][list] = block->nextFree;
+    if (block->nextFree != NULL)
+        block->nextFree->prevFree = block->prevFree;
+
+    if (freeLists[block->type][list] == NULL)
+        freeMap[block->type] &= ~(1u << list);
+}
+
+// Split the end of a block into a new used block
+static Block* splitBlock(Block* block, unsigned int size)
+{
+    Block* tail = hostAlloc(sizeof(Block));
+
+    *tail = *block;
+    tail->start = block->start + size;
+    tail->size = block->size - size;
+    tail->used = 1;
+    tail->slab = NULL;
+    tail->prevPhys = block;
+    if (block->nextPhys != NULL)
+        block->nextPhys->prevPhys = tail;
+    block->nextPhys = tail;
+    block->size = size;
+
+    return tail;
+}
+
+static Block* largeAlloc(int type, unsigned int size)
+{
+    int list = floorLog2(size);
+    unsigned int map = freeMap[type];
+    Block* block = NULL;
+
+    // Any block of the lists above the size fits
+    if (size & (size - 1))
+        list++;
+    if (list < NUM_LISTS)
+        map &= ~((1u << list) - 1);
+    else
+        map = 0;
+
+    if (map != 0)
+        block = freeLists[type][__builtin_ctz(map)];
+    else
+    {
+        // Only some blocks of the list of the size may fit
+        for (block = freeLists[type][floorLog2(size)]; block != NULL; block = block->nextFree)
+        {
+            if (block->size >= size)
+                break;
+        }
+    }
+
+    if (block == NULL)
+        return NULL;
+
+    removeFree(block);
+    block->used = 1;
+    if (block->size - size >= HEAP_ALIGN)
+    {
+        Block* tail = splitBlock(block, size);
+        tail->used = 0;
+        insertFree(tail);
+    }
+
+    return block;
+}
+
+static void largeFree(Block* block)
+{
+    Block* next = block->nextPhys;
+    Block* prev = block->prevPhys;
+
+    block->used = 0;
+
+    if (next != NULL && !next->used)
+    {
+        removeFree(next);
+        block->size += next->size;
+        block->nextPhys = next->nextPhys;
+        if (next->nextPhys != NULL)
+            next->nextPhys->prevPhys = block;
+        free(next);
+    }
+
+    if (prev != NULL && !prev->used)
+    {
+        removeFree(prev);
+        prev->size += block->size;
+        prev->nextPhys = block->nextPhys;
+        if (block->nextPhys != NULL)
+            block->nextPhys->prevPhys = prev;
+        free(block);
+        block = prev;
+    }
+
+    // The whole arena is free
+    if (block->releasable && block->prevPhys == NULL && block->nextPhys == NULL && releaseFunc != NULL)
+    {
+        releaseFunc(block->arena);
+        free(block);
+        return;
+    }
+
+    insertFree(block);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Small blocks                                                             */
+/* ------------------------------------------------------------------------ */
+
+static void linkSlab(Slab* slab, Slab** head)
+{
+    slab->prev = NULL;
+    slab->nextSlab = *head;
+    if (*head != NULL)
+        (*head)->prev = slab;
+    *head = slab;
+}
+
+static void unlinkSlab(Slab* slab, Slab** head)
+{
+    if (slab->prev != NULL)
+        slab->prev->nextSlab = slab->nextSlab;
+    else
+        *head = slab->nextSlab;
+    if (slab->nextSlab != NULL)
+        slab->nextSlab->prev = slab->prev;
+}
+
+static unsigned int smallAlloc(int type, unsigned int size)
+{
+    int sizeClass = size / HEAP_ALIGN - 1;
+    Slab** head = &partialSlabs[type][sizeClass];
+    Slab* slab = *head;
+    unsigned int index;
+    unsigned int address;
+
+    if (slab == NULL)
+    {
+        Block* block = largeAlloc(type, SLAB_SIZE);
+        unsigned int i;
+
+        if (block == NULL)
+            return 0;
+
+        slab = hostAlloc(sizeof(Slab));
+        slab->block = block;
+        slab->objectSize = size;
+        slab->count = SLAB_SIZE / size;
+        slab->used = 0;
+        slab->freeHead = 0;
+        slab->next = hostAlloc(slab->count * sizeof(unsigned short));
+        for (i = 0; i < slab->count; ++i)
+            slab->next[i] = i + 1;
+        block->slab = slab;
+        linkSlab(slab, head);
+    }
+
+    index = slab->freeHead;
+    slab->freeHead = slab->next[index];
+    if (++slab->used == slab->count)
+        unlinkSlab(slab, head);
+
+    address = slab->block->start + index * slab->objectSize;
+    addEntry(address, NULL, slab, currentOwner);
+    return address;
+}
+
+static void smallFree(Slab* slab, unsigned int address)
+{
+    Slab** head = &partialSlabs[slab->block->type][slab->objectSize / HEAP_ALIGN - 1];
+    unsigned int index = (address - slab->block->start) / slab->objectSize;
+    int wasFull = slab->used == slab->count;
+
+    slab->next[index] = slab->freeHead;
+    slab->freeHead = index;
+    slab->used--;
+
+    if (slab->used == 0)
+    {
+        // Give the slab back to the large blocks
+        if (!wasFull)
+            unlinkSlab(slab, head);
+        slab->block->slab = NULL;
+        largeFree(slab->block);
+        free(slab->next);
+        free(slab);
+    }
+    else if (wasFull)
+        linkSlab(slab, head);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Interface                                                                */
+/* ------------------------------------------------------------------------ */
+
+void heapInit(HeapGrowFunc* grow, HeapReleaseFunc* release, HeapAvailableFunc* available)
+{
+    growFunc = grow;
+    releaseFunc = release;
+    availableFunc = available;
+}
+
+void heapAddArena(unsigned int start, unsigned int size, int releasable)
+{
+    unsigned int aligned = (start + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    Block* block;
+
+    if (size < aligned - start + HEAP_ALIGN)
+        return;
+
+    block = hostAlloc(sizeof(Block));
+    memset(block, 0, sizeof(Block));
+    block->start = aligned;
+    block->size = (size - (aligned - start)) & ~(HEAP_ALIGN - 1);
+    block->arena = start;
+    block->type = start >= HEAP_TT_RAM_START ? TYPE_TT : TYPE_ST;
+    block->releasable = releasable != 0;
+    insertFree(block);
+}
+
+// RAM types allowed by a mode, in order of preference
+static int modeTypes(int mode, int types[NUM_TYPES])
+{
+    switch (mode)
+    {
+        case HEAP_ST_ONLY:
+            types[0] = TYPE_ST;
+            return 1;
+
+        case HEAP_TT_ONLY:
+            types[0] = TYPE_TT;
+            return 1;
+
+        case HEAP_TT_PREFERRED:
+            types[0] = TYPE_TT;
+            types[1] = TYPE_ST;
+            return 2;
+
+        default:
+            types[0] = TYPE_ST;
+            types[1] = TYPE_TT;
+            return 2;
+    }
+}
+
+static unsigned int allocTypes(unsigned int size, const int* types, int count)
+{
+    int i;
+
+    for (i = 0; i < count; ++i)
+    {
+        if (size <= SMALL_MAX)
+        {
+            unsigned int address = smallAlloc(types[i], size);
+            if (address != 0)
+                return address;
+        }
+        else
+        {
+            Block* block = largeAlloc(types[i], size);
+            if (block != NULL)
+            {
+                addEntry(block->start, block, NULL, currentOwner);
+                return block->start;
+            }
+        }
+    }
+
+    return 0;
+}
+
+unsigned int heapAlloc(unsigned int size, int mode)
+{
+    int types[NUM_TYPES];
+    int count = modeTypes(mode, types);
+    unsigned int address;
+    unsigned int arena;
+    unsigned int arenaSize;
+
+    if (size == 0 || size > 0xffffffffu - HEAP_ALIGN)
+        return 0;
+    size = (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+
+    address = allocTypes(size, types, count);
+    if (address != 0 || growFunc == NULL)
+        return address;
+
+    // Ask for more memory, with room for the alignment
+    arena = growFunc((size <= SMALL_MAX ? SLAB_SIZE : size) + HEAP_ALIGN, mode, &arenaSize);
+    if (arena == 0)
+        return 0;
+
+    heapAddArena(arena, arenaSize, 1);
+    return allocTypes(size, types, count);
+}
+
+long heapFree(unsigned int address)
+{
+    Entry* entry = findEntry(address);
+    Block* block;
+    Slab* slab;
+
+    if (entry == NULL)
+        return TOS_EIMBA;
+
+    block = entry->block;
+    slab = entry->slab;
+    removeEntry(entry);
+
+    if (slab != NULL)
+        smallFree(slab, address);
+    else
+        largeFree(block);
+
+    return TOS_E_OK;
+}
+
+long heapShrink(unsigned int address, unsigned int size)
+{
+    Entry* entry = findEntry(address);
+    Block* block;
+
+    if (entry == NULL)
+        return TOS_EIMBA;
+
+    if (size == 0)
+        return heapFree(address);
+
+    // The objects stay in their slab
+    if (entry->slab != NULL)
+        return size <= entry->slab->objectSize ? TOS_E_OK : TOS_EGSBF;
+
+    block = entry->block;
+    if (size > block->size)
+        return TOS_EGSBF;
+
+    size = (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    if (block->size - size >= HEAP_ALIGN)
+        largeFree(splitBlock(block, size));
+
+    return TOS_E_OK;
+}
+
+unsigned int heapLargest(int mode)
+{
+    int types[NUM_TYPES];
+    int count = modeTypes(mode, types);
+    unsigned int largest = 0;
+    unsigned int available;
+    int i;
+
+    // A new arena must leave room for the alignment
+    if (availableFunc != NULL)
+    {
+        available = availableFunc(mode);
+        if (available >= 2 * HEAP_ALIGN)
+            largest = (available - 2 * HEAP_ALIGN) & ~(HEAP_ALIGN - 1);
+    }
+
+    for (i = 0; i < count; ++i)
+    {
+        Block* block;
+
+        if (freeMap[types[i]] == 0)
+            continue;
+
+        for (block = freeLists[types[i]][floorLog2(freeMap[types[i]])]; block != NULL; block = block->nextFree)
+        {
+            if (block->size > largest)
+                largest = block->size;
+        }
+    }
+
+    return largest;
+}
+
+int heapOwns(unsigned int address)
+{
+    return findEntry(address) != NULL;
+}
+
+void heapSetOwner(unsigned int owner)
+{
+    currentOwner = owner;
+}
+
+void heapChown(unsigned int address, unsigned int owner)
+{
+    Entry* entry = findEntry(address);
+
+    if (entry != NULL)
+        entry->owner = owner;
+}
+
+void heapTransfer(unsigned int from, unsigned int to)
+{
+    unsigned int i;
+
+    for (i = 0; i < entryCapacity; ++i)
+    {
+        if (entries[i].address != 0 && entries[i].owner == from)
+            entries[i].owner = to;
+    }
+}
+
+void heapFreeOwner(unsigned int owner)
+{
+    unsigned int* addresses;
+    unsigned int count = 0;
+    unsigned int i;
+
+    // Freeing moves the entries, so collect the addresses first
+    if (entryCount == 0)
+        return;
+    addresses = hostAlloc(entryCount * sizeof(unsigned int));
+    for (i = 0; i < entryCapacity; ++i)
+    {
+        if (entries[i].address != 0 && entries[i].owner == owner)
+            addresses[count++] = entries[i].address;
+    }
+
+    for (i = 0; i < count; ++i)
+        heapFree(addresses[i]);
+    free(addresses);
+}
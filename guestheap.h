@@ -0,0 +1,71 @@
+/*
+  guestheap.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_GUESTHEAP_H__
+#define __INC_GUESTHEAP_H__
+
+// Allocation modes, as the low bits of Mxalloc()
+#define HEAP_ST_ONLY      0
+#define HEAP_TT_ONLY      1
+#define HEAP_ST_PREFERRED 2
+#define HEAP_TT_PREFERRED 3
+#define HEAP_ANY          4 // Malloc(): any RAM, ST first
+
+// The alternate RAM starts at this address, like on the TT
+#define HEAP_TT_RAM_START 0x01000000
+
+// Optional source of more guest memory. grow() returns the address of a
+// new arena for at least size bytes in the mode, and its size in *arenaSize,
+// or 0. release() gives back an arena which became free. available() returns
+// the size of the largest arena grow() could return in the mode.
+typedef unsigned int HeapGrowFunc(unsigned int size, int mode, unsigned int* arenaSize);
+typedef void HeapReleaseFunc(unsigned int start);
+typedef unsigned int HeapAvailableFunc(int mode);
+
+void heapInit(HeapGrowFunc* grow, HeapReleaseFunc* release, HeapAvailableFunc* available);
+
+// Add a range of guest memory to the heap.
+// A releasable arena is given back to release() when it becomes free.
+void heapAddArena(unsigned int start, unsigned int size, int releasable);
+
+// Allocate a block, like Mxalloc(). Returns 0 if there is not enough memory.
+unsigned int heapAlloc(unsigned int size, int mode);
+
+// Free a block. Returns 0 or a GEMDOS error.
+long heapFree(unsigned int address);
+
+// Shrink a block, like Mshrink(). Returns 0 or a GEMDOS error.
+long heapShrink(unsigned int address, unsigned int size);
+
+// Size of the largest block which can be allocated, like Malloc(-1).
+unsigned int heapLargest(int mode);
+
+// Returns nonzero if the address is a block allocated by the heap.
+int heapOwns(unsigned int address);
+
+// Set the owner of the next allocations, as the basepage of the process.
+void heapSetOwner(unsigned int owner);
+
+// Change the owner of a block.
+void heapChown(unsigned int address, unsigned int owner);
+
+// Give all the blocks of an owner to another one.
+void heapTransfer(unsigned int from, unsigned int to);
+
+// Free all the blocks of an owner.
+void heapFreeOwner(unsigned int owner);
+
+#endif /* __INC_GUESTHEAP_H__ */
@@ -0,0 +1,561 @@
+/*
+  jobserver.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Job server, for the Linux host.
+
+  The server initializes the emulator once, then waits for the jobs sent by
+  68kjob on a Unix domain socket. The server loads the program of each job
+  into its image cache, then forks: the job starts from the untouched guest
+  memory and CPU of the server, and shares its opcode tables and cached
+  images copy-on-write. The job gets the standard handles of the client, so
+  its output goes straight to the client, which receives the exit code when
+  the job terminates. A job whose client goes away is killed. Each job has
+  its own RAM disk and temporary overlay directories.
+  The requests are received as they arrive, along with the other events,
+  so a slow client does not hold up the server.
+
+  The server may also park a program, loaded and relocated, with the CPU
+  ready to start it. The jobs of that program are forks of the parked
+  server, which only set the command tail and the environment.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "jobserver.h"
+#include "linuxos.h"
+#include "prgload.h"
+
+#define MAX_JOBS        64
+#define REQUEST_TIMEOUT 5 // Seconds to receive a request
+
+extern char** environ;
+
+// Request being received
+typedef struct
+{
+    JobRequest header;
+    int headerDone;
+    char* strings;
+    unsigned int done;           // Bytes of strings received
+    int fds[JOB_NUM_FDS];
+    time_t deadline;
+} Request;
+
+typedef struct
+{
+    pid_t pid;                   // 0 if the slot is free
+    int client;
+    int abandoned;               // Killed because the client went away
+    Request* request;            // Not NULL while the request is received
+} Job;
+
+// Decoded request
+typedef struct
+{
+    char* strings;
+    const char* cwd;
+    char** argv;
+    char** envp;
+    int argc;
+    char program[PATH_MAX];      // Absolute path of argv[0]
+} JobArgs;
+
+static Job jobs[MAX_JOBS];
+static int jobCount;
+static int childPipe[2] = { -1, -1 };
+
+// Parked program, if any
+static JobFunc* resumeFunc;
+static int reportWarm;
+static struct stat parkedStat;
+
+static void onChild(int sig)
+{
+    int saved = errno;
+    ssize_t ret = write(childPipe[1], "", 1);
+
+    (void)ret;
+    errno = saved;
+}
+
+static int openListener(const char* path)
+{
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+
+    // The socket of a previous server
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, MAX_JOBS) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void closeFds(int fds[JOB_NUM_FDS])
+{
+    int i;
+
+    for (i = 0; i < JOB_NUM_FDS; ++i)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+static void freeRequest(Request* request)
+{
+    closeFds(request->fds);
+    free(request->strings);
+    free(request);
+}
+
+// Receive the header and the standard handles of the client.
+// The handles of any unexpected control message are closed.
+static ssize_t receiveHeader(int client, Request* request)
+{
+    union
+    {
+        struct cmsghdr align;
+        char buffer[CMSG_SPACE(sizeof(int) * JOB_NUM_FDS)];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr* cmsg;
+    ssize_t ret;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &request->header;
+    iov.iov_len = sizeof(request->header);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buffer;
+    msg.msg_controllen = sizeof(control.buffer);
+
+    ret = recvmsg(client, &msg, MSG_DONTWAIT);
+    if (ret < 0)
+        return ret;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        int* fds = (int*)CMSG_DATA(cmsg);
+        size_t count;
+        size_t i;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (count == JOB_NUM_FDS && request->fds[0] < 0)
+            memcpy(request->fds, fds, sizeof(int) * JOB_NUM_FDS);
+        else
+        {
+            for (i = 0; i < count; ++i)
+                close(fds[i]);
+        }
+    }
+
+    return ret;
+}
+
+// Receive what the client has sent so far, without waiting.
+// Returns 1 when the request is complete, 0 if more is expected, -1 on error.
+static int receiveRequest(int client, Request* request)
+{
+    JobRequest* header = &request->header;
+    ssize_t ret;
+
+    if (!request->headerDone)
+    {
+        ret = receiveHeader(client, request);
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return 0;
+
+        if (ret != sizeof(*header) || request->fds[0] < 0 || header->magic != JOB_MAGIC
+            || header->length == 0 || header->length > JOB_MAX_LENGTH
+            || header->argc == 0 || header->argc > header->length || header->envc > header->length)
+            return -1;
+
+        request->strings = malloc(header->length + 1);
+        if (request->strings == NULL)
+            return -1;
+        request->headerDone = 1;
+    }
+
+    ret = recv(client, request->strings + request->done, header->length - request->done, MSG_DONTWAIT);
+    if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    if (ret <= 0)
+        return -1;
+
+    request->done += ret;
+    return request->done == header->length;
+}
+
+// Decode a complete request. The arguments take the strings.
+// Returns 0 on success, -1 on error.
+static int decodeRequest(Request* request, JobArgs* args)
+{
+    JobRequest* header = &request->header;
+    unsigned int strings = 0;
+    unsigned int i;
+    char* p;
+
+    args->strings = request->strings;
+    args->argv = malloc((header->argc + 1) * sizeof(char*));
+    args->envp = malloc((header->envc + 1) * sizeof(char*));
+    request->strings = NULL;
+    if (args->argv == NULL || args->envp == NULL)
+        goto error;
+
+    args->strings[header->length] = '\0';
+    for (i = 0; i < header->length; ++i)
+        strings += args->strings[i] == '\0';
+    if (strings < 1 + header->argc + header->envc)
+        goto error;
+
+    // Working directory, arguments and environment
+    p = args->strings;
+    args->cwd = p;
+    p += strlen(p) + 1;
+    for (i = 0; i < header->argc; ++i, p += strlen(p) + 1)
+        args->argv[i] = p;
+    args->argv[i] = NULL;
+    for (i = 0; i < header->envc; ++i, p += strlen(p) + 1)
+        args->envp[i] = p;
+    args->envp[i] = NULL;
+    args->argc = header->argc;
+
+    // The server and the job must load the program by the same path
+    if (args->argv[0][0] == '/')
+        snprintf(args->program, sizeof(args->program), "%s", args->argv[0]);
+    else
+        snprintf(args->program, sizeof(args->program), "%s/%s", args->cwd, args->argv[0]);
+    args->argv[0] = args->program;
+
+    return 0;
+
+error:
+    free(args->strings);
+    free(args->argv);
+    free(args->envp);
+    return -1;
+}
+
+// Returns nonzero if the file is the parked program, unchanged since it was
+// loaded, as the image cache checks it
+static int isParked(const struct stat* st)
+{
+    return st->st_dev == parkedStat.st_dev && st->st_ino == parkedStat.st_ino
+        && st->st_size == parkedStat.st_size
+        && st->st_mtim.tv_sec == parkedStat.st_mtim.tv_sec && st->st_mtim.tv_nsec == parkedStat.st_mtim.tv_nsec
+        && st->st_ctim.tv_sec == parkedStat.st_ctim.tv_sec && st->st_ctim.tv_nsec == parkedStat.st_ctim.tv_nsec;
+}
+
+// Load the program in the server, so that the job finds it in the image cache
+static void warmProgram(const char* path)
+{
+    long ret = prgCacheWarm(path);
+
+    if (ret < 0 && reportWarm)
+        fprintf(stderr, "68kemu: cannot cache %s, error %ld\n", path, ret);
+}
+
+// In the forked process
+static void startJob(int listener, int client, JobArgs* args, int fds[JOB_NUM_FDS], JobFunc* run)
+{
+    struct sigaction sa;
+    int high[JOB_NUM_FDS];
+    int i;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    close(listener);
+    close(client);
+    close(childPipe[0]);
+    close(childPipe[1]);
+    for (i = 0; i < MAX_JOBS; ++i)
+    {
+        if (jobs[i].request != NULL)
+            closeFds(jobs[i].request->fds);
+        if (jobs[i].pid != 0 || jobs[i].request != NULL)
+            close(jobs[i].client);
+    }
+
+    // The received handles may be among the standard ones
+    for (i = 0; i < JOB_NUM_FDS; ++i)
+        high[i] = fcntl(fds[i], F_DUPFD, JOB_NUM_FDS);
+    closeFds(fds);
+    for (i = 0; i < JOB_NUM_FDS; ++i)
+    {
+        dup2(high[i], i);
+        close(high[i]);
+    }
+
+    if (linuxPrivateTemp() < 0)
+    {
+        fprintf(stderr, "error: cannot create the temporary directories of the job.\n");
+        exit(1);
+    }
+
+    environ = args->envp;
+    if (linuxChdir(args->cwd) < 0)
+    {
+        fprintf(stderr, "error: cannot change to %s.\n", args->cwd);
+        exit(1);
+    }
+
+    exit(run(args->argv, args->argc));
+}
+
+static void acceptJob(int listener)
+{
+    int client = accept(listener, NULL, NULL);
+    Request* request;
+    int slot;
+
+    if (client < 0)
+        return;
+
+    request = calloc(1, sizeof(Request));
+    if (request == NULL)
+    {
+        close(client);
+        return;
+    }
+    request->fds[0] = request->fds[1] = request->fds[2] = -1;
+    request->deadline = time(NULL) + REQUEST_TIMEOUT;
+
+    for (slot = 0; jobs[slot].pid != 0 || jobs[slot].request != NULL; ++slot)
+        ;
+
+    jobs[slot].client = client;
+    jobs[slot].abandoned = 0;
+    jobs[slot].request = request;
+    jobCount++;
+}
+
+// Forget a job whose request could not be received
+static void dropRequest(int slot)
+{
+    freeRequest(jobs[slot].request);
+    jobs[slot].request = NULL;
+    close(jobs[slot].client);
+    jobCount--;
+}
+
+// Start the job of a complete request
+static void launchJob(int listener, int slot, JobFunc* run)
+{
+    Job* job = &jobs[slot];
+    int fds[JOB_NUM_FDS];
+    JobArgs args;
+    struct stat st;
+    pid_t pid;
+    int parked;
+
+    memcpy(fds, job->request->fds, sizeof(fds));
+    job->request->fds[0] = job->request->fds[1] = job->request->fds[2] = -1;
+    if (decodeRequest(job->request, &args) < 0)
+    {
+        closeFds(fds);
+        dropRequest(slot);
+        return;
+    }
+    freeRequest(job->request);
+    job->request = NULL;
+
+    parked = resumeFunc != NULL && stat(args.argv[0], &st) == 0 && isParked(&st);
+    if (!parked)
+        warmProgram(args.argv[0]);
+
+    pid = fork();
+    if (pid == 0)
+        startJob(listener, job->client, &args, fds, parked ? resumeFunc : run);
+
+    closeFds(fds);
+    free(args.strings);
+    free(args.argv);
+    free(args.envp);
+
+    if (pid < 0)
+    {
+        int code = 1;
+
+        send(job->client, &code, sizeof(code), MSG_NOSIGNAL);
+        close(job->client);
+        jobCount--;
+        return;
+    }
+
+    job->pid = pid;
+}
+
+// Send the exit codes of the terminated jobs
+static void reapJobs(void)
+{
+    pid_t pid;
+    int status;
+    int i;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+        for (i = 0; i < MAX_JOBS; ++i)
+        {
+            if (jobs[i].pid != pid)
+                continue;
+
+            send(jobs[i].client, &code, sizeof(code), MSG_NOSIGNAL);
+            close(jobs[i].client);
+            jobs[i].pid = 0;
+            jobCount--;
+            break;
+        }
+    }
+}
+
+int jobServerRun(const char* path, JobFunc* run, const char* program, JobFunc* resume, int stats)
+{
+    struct pollfd fds[MAX_JOBS + 2];
+    struct sigaction sa;
+    int listener;
+    char drain[64];
+    int timeout;
+    time_t now;
+    int i;
+
+    listener = openListener(path);
+    if (listener < 0 || pipe(childPipe) != 0 || fcntl(childPipe[0], F_SETFL, O_NONBLOCK) != 0)
+    {
+        fprintf(stderr, "error: cannot listen on %s.\n", path);
+        return 1;
+    }
+
+    if (program != NULL)
+    {
+        struct stat st;
+
+        if (stat(program, &st) != 0)
+        {
+            fprintf(stderr, "error: cannot find %s.\n", program);
+            return 1;
+        }
+        parkedStat = st;
+        resumeFunc = resume;
+    }
+
+    reportWarm = stats;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onChild;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    for (;;)
+    {
+        // Negative descriptors are ignored by poll()
+        fds[0].fd = childPipe[0];
+        fds[1].fd = jobCount < MAX_JOBS ? listener : -1;
+        for (i = 0; i < MAX_JOBS; ++i)
+            fds[i + 2].fd = jobs[i].request != NULL || (jobs[i].pid != 0 && !jobs[i].abandoned) ? jobs[i].client : -1;
+        for (i = 0; i < MAX_JOBS + 2; ++i)
+            fds[i].events = POLLIN;
+
+        // Wake up for the requests which take too long
+        timeout = -1;
+        now = time(NULL);
+        for (i = 0; i < MAX_JOBS; ++i)
+        {
+            if (jobs[i].request == NULL)
+                continue;
+            if (jobs[i].request->deadline <= now)
+                timeout = 0;
+            else if (timeout < 0 || (jobs[i].request->deadline - now) * 1000 < timeout)
+                timeout = (jobs[i].request->deadline - now) * 1000;
+        }
+
+        if (poll(fds, MAX_JOBS + 2, timeout) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "error: cannot wait for the jobs.\n");
+            return 1;
+        }
+
+        now = time(NULL);
+        for (i = 0; i < MAX_JOBS; ++i)
+        {
+            if (jobs[i].request != NULL)
+            {
+                int ret = fds[i + 2].revents != 0 ? receiveRequest(jobs[i].client, jobs[i].request) : 0;
+
+                if (ret > 0)
+                    launchJob(listener, i, run);
+                else if (ret < 0 || jobs[i].request->deadline <= now)
+                    dropRequest(i);
+            }
+            else if (fds[i + 2].fd >= 0 && fds[i + 2].revents != 0)
+            {
+                // A client sends nothing after its request, until it goes away
+                kill(jobs[i].pid, SIGKILL);
+                jobs[i].abandoned = 1;
+            }
+        }
+
+        if (fds[0].revents != 0)
+        {
+            while (read(childPipe[0], drain, sizeof(drain)) > 0)
+                ;
+            reapJobs();
+        }
+
+        if (fds[1].fd >= 0 && fds[1].revents != 0)
+            acceptJob(listener);
+    }
+}
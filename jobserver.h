@@ -0,0 +1,49 @@
+/*
+  jobserver.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_JOBSERVER_H__
+#define __INC_JOBSERVER_H__
+
+// Job request, sent by 68kjob on the Unix domain socket.
+// The header is followed by length bytes of NUL-terminated strings: the
+// working directory, argc strings for the program and its arguments, and
+// envc environment variables. The standard input, output and error of the
+// client are sent with the header, as SCM_RIGHTS.
+// The reply is the exit code of the job, as an int.
+#define JOB_MAGIC       0x36384a42 // "68JB"
+#define JOB_MAX_LENGTH  (1024 * 1024)
+#define JOB_NUM_FDS     3
+
+typedef struct
+{
+    unsigned int magic;
+    unsigned int length;
+    unsigned int argc;
+    unsigned int envc;
+} JobRequest;
+
+// Run a program with its arguments, in the process of a job.
+// argv[0] is the program. Returns only on error.
+typedef int JobFunc(char* argv[], int argc);
+
+// Serve the jobs sent to the socket, forever. If program is not NULL, it
+// was loaded and parked by the caller: its jobs call resume() instead of
+// run() in a fork of the parked server. If stats is nonzero, the programs
+// which can't be loaded into the image cache before their job are reported.
+// Returns only on error, after printing it.
+int jobServerRun(const char* path, JobFunc* run, const char* program, JobFunc* resume, int stats);
+
+#endif /* __INC_JOBSERVER_H__ */
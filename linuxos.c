@@ -0,0 +1,3426 @@
+/*
+  linuxos.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  GEMDOS, BIOS and XBIOS implemented on top of Linux.
+
+  This replaces the passthrough to the real TOS when 68kemu is built with
+  HOST=linux. Only the calls used by command-line tools are implemented.
+  The other ones return TOS_EINVFN, and are reported at exit.
+
+  Drive C: is the host root directory, and its current directory is the
+  host current directory. TOS names are matched case-insensitively.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "musashi/m68k.h"
+#include "tosdefs.h"
+#include "linuxos.h"
+#include "archive.h"
+#include "guestheap.h"
+#include "prgload.h"
+#include "process.h"
+
+unsigned char* m68k_memory_base;
+
+extern char** environ;
+
+/* ------------------------------------------------------------------------ */
+/* Unsupported calls                                                        */
+/* ------------------------------------------------------------------------ */
+
+enum
+{
+    OS_GEMDOS,
+    OS_BIOS,
+    OS_XBIOS,
+    OS_GEM,
+    OS_LINEA,
+    OS_COUNT
+};
+
+static const char* const osNames[OS_COUNT] =
+{
+    "GEMDOS", "BIOS", "XBIOS", "GEM", "Line-A"
+};
+
+// Higher function numbers are counted together in the last entry
+#define MAX_FUNCTIONS 0x200
+
+static unsigned long unsupportedCount[OS_COUNT][MAX_FUNCTIONS];
+
+static long unsupported(int os, unsigned int num)
+{
+    if (num >= MAX_FUNCTIONS)
+        num = MAX_FUNCTIONS - 1;
+
+    unsupportedCount[os][num]++;
+    return TOS_EINVFN;
+}
+
+static void reportUnsupported(void)
+{
+    int os;
+    int num;
+
+    for (os = 0; os < OS_COUNT; ++os)
+    {
+        for (num = 0; num < MAX_FUNCTIONS; ++num)
+        {
+            if (unsupportedCount[os][num] != 0)
+                fprintf(stderr, "68kemu: unsupported %s(0x%02x) called %lu time(s)\n",
+                    osNames[os], num, unsupportedCount[os][num]);
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Guest memory                                                             */
+/* ------------------------------------------------------------------------ */
+
+// Arguments of an OS call, relative to the stack pointer at the trap
+#define ARG_W(o) m68k_read_memory_16(sp + (o))
+#define ARG_L(o) m68k_read_memory_32(sp + (o))
+
+int linuxIsRam(unsigned int address, unsigned int length)
+{
+    return address <= LINUX_RAM_SIZE && length <= LINUX_RAM_SIZE - address;
+}
+
+static void readGuestString(unsigned int address, char* buffer, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size - 1 && linuxIsRam(address + i, 1); ++i)
+    {
+        buffer[i] = (char)m68k_read_memory_8(address + i);
+        if (buffer[i] == '\0')
+            return;
+    }
+
+    buffer[i] = '\0';
+}
+
+static void writeGuestString(unsigned int address, const char* s)
+{
+    do
+        m68k_write_memory_8(address++, (unsigned char)*s);
+    while (*s++ != '\0');
+}
+
+/* ------------------------------------------------------------------------ */
+/* Files                                                                    */
+/* ------------------------------------------------------------------------ */
+
+#define MAX_HANDLES 64
+#define NUM_STD_HANDLES 6 // Handles 0 to 5 can be redirected with Fforce()
+
+// Host file descriptor of each GEMDOS handle, -1 if closed
+static int handleFd[MAX_HANDLES];
+
+// Host directory of the file of each handle, for the directory cache
+static char* handleDir[MAX_HANDLES];
+
+// Basepage of the process which opened or redirected each handle
+static unsigned int handleOwner[MAX_HANDLES];
+
+static const int defaultFd[NUM_STD_HANDLES] = { 0, 1, 2, -1, -1, -1 };
+
+#define NUM_DRIVES 26
+#define DRIVE_C 2
+
+// Host directory of each drive, NULL if the drive does not exist
+static const char* driveRoot[NUM_DRIVES];
+
+// Archive of each read-only archive drive, or NULL.
+// The root of such a drive is the host path of the archive, so the host
+// calls which would modify it fail anyway.
+static Archive* driveArchive[NUM_DRIVES];
+
+// Shared lower directory of each overlay drive, or NULL.
+// The root of such a drive is its private upper directory.
+static const char* driveLower[NUM_DRIVES];
+
+// Open archive entry of each handle
+typedef struct
+{
+    Archive* archive;
+    const ArchiveEntry* entry; // NULL if the handle is not in an archive
+    const unsigned char* data;
+    unsigned int pos;
+} ArchiveFile;
+
+static ArchiveFile archiveFiles[MAX_HANDLES];
+
+// Returns the archive containing a host path, or NULL.
+// inside receives the path in the archive, if not NULL.
+static Archive* archiveForPath(const char* hostPath, const char** inside)
+{
+    int drive;
+
+    for (drive = 0; drive < NUM_DRIVES; ++drive)
+    {
+        size_t len;
+
+        if (driveArchive[drive] == NULL)
+            continue;
+
+        len = strlen(driveRoot[drive]);
+        if (strncmp(hostPath, driveRoot[drive], len) == 0 && (hostPath[len] == '/' || hostPath[len] == '\0'))
+        {
+            if (inside != NULL)
+            {
+                for (hostPath += len; *hostPath == '/'; ++hostPath)
+                    ;
+                *inside = hostPath;
+            }
+            return driveArchive[drive];
+        }
+    }
+
+    return NULL;
+}
+
+static ArchiveFile* archiveFile(int handle)
+{
+    if (handle < 0 || handle >= MAX_HANDLES || archiveFiles[handle].entry == NULL)
+        return NULL;
+
+    return &archiveFiles[handle];
+}
+
+// Current directory of each drive, as a host path relative to the root
+static char currentPath[NUM_DRIVES][PATH_MAX];
+static int currentDrive = DRIVE_C;
+
+static unsigned int currentDta;
+
+static long errnoToGemdos(int err)
+{
+    switch (err)
+    {
+        case ENOENT:  return TOS_EFILNF;
+        case ENOTDIR: return TOS_EPTHNF;
+        case EMFILE:
+        case ENFILE:  return TOS_ENHNDL;
+        case EBADF:   return TOS_EIHNDL;
+        case ENOMEM:  return TOS_ENSMEM;
+        case EXDEV:   return TOS_ENSAME;
+        case EINVAL:
+        case EFAULT:  return TOS_ERANGE;
+        case EACCES:
+        case EPERM:
+        case EEXIST:
+        case ENOTEMPTY:
+        case EISDIR:
+        case EROFS:   return TOS_EACCDN;
+        default:      return TOS_ERROR;
+    }
+}
+
+// Copy the whole contents of a file, whatever its offset.
+// Returns 0 on success, or -1 with errno set.
+static int copyFd(int from, int to)
+{
+    static char buffer[65536];
+    off_t offset = 0;
+    ssize_t n;
+
+    while ((n = pread(from, buffer, sizeof(buffer), offset)) > 0)
+    {
+        if (write(to, buffer, n) != n)
+            return -1;
+        offset += n;
+    }
+
+    return n < 0 ? -1 : 0;
+}
+
+// RAM disk.
+// The drive is a private directory on the host shared memory file system,
+// so its files never touch the disk, and all the other code works on them
+// unchanged. The sizes of the files written through GEMDOS are accounted.
+// When they exceed the cap, the file being written is moved to a spill
+// directory on the disk, and replaced by a symbolic link to it. All the
+// handles open on it follow.
+#define RAM_DISK_DEFAULT_SIZE (256UL * 1024 * 1024)
+
+typedef struct
+{
+    char* path;  // Host path, NULL if the file of the handle is not in RAM
+    off_t size;  // Size of the file, as last accounted
+} RamFile;
+
+static RamFile ramFiles[MAX_HANDLES];
+static int ramDrive = -1;
+static char ramRoot[PATH_MAX];
+static char spillDir[PATH_MAX];
+static unsigned int spillCount;
+static unsigned long ramDiskCap;
+static unsigned long ramDiskUsed;
+static unsigned long ramDiskPeak;
+static unsigned long long ramDiskRead;
+static unsigned long long ramDiskWritten;
+static unsigned long long ramDiskSpilled;
+
+static int isRamPath(const char* hostPath)
+{
+    size_t len = strlen(ramRoot);
+
+    return ramDrive >= 0 && strncmp(hostPath, ramRoot, len) == 0
+        && (hostPath[len] == '/' || hostPath[len] == '\0');
+}
+
+// Track the file of a new handle, if it is in RAM
+static void ramDiskOpened(int handle, const char* hostPath)
+{
+    struct stat st;
+
+    // Not the links to the spilled files
+    if (!isRamPath(hostPath) || lstat(hostPath, &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+
+    ramFiles[handle].path = strdup(hostPath);
+    ramFiles[handle].size = st.st_size;
+}
+
+static void ramDiskClosed(int handle)
+{
+    free(ramFiles[handle].path);
+    ramFiles[handle].path = NULL;
+}
+
+// A file is about to be deleted or truncated
+static void ramDiskRemoving(const char* hostPath)
+{
+    char target[PATH_MAX];
+    struct stat st;
+    ssize_t len;
+
+    if (!isRamPath(hostPath) || lstat(hostPath, &st) != 0)
+        return;
+
+    if (S_ISREG(st.st_mode))
+        ramDiskUsed -= (unsigned long)st.st_size < ramDiskUsed ? (unsigned long)st.st_size : ramDiskUsed;
+    else if (S_ISLNK(st.st_mode) && (len = readlink(hostPath, target, sizeof(target) - 1)) > 0)
+    {
+        // Spilled files go away with their link
+        target[len] = '\0';
+        if (spillDir[0] != '\0' && strncmp(target, spillDir, strlen(spillDir)) == 0)
+            unlink(target);
+    }
+}
+
+// Move the file of a handle from RAM to the disk, along with the other
+// handles open on it. Returns 0 on success, or -1 with errno set.
+static int ramDiskSpill(int handle)
+{
+    RamFile* rf = &ramFiles[handle];
+    char ramPath[PATH_MAX];
+    char spillPath[PATH_MAX];
+    char linkPath[PATH_MAX];
+    const char* tmp = getenv("TMPDIR");
+    int fd = handleFd[handle];
+    int spillFd;
+    struct stat st;
+    off_t pos;
+    int h;
+
+    if (spillDir[0] == '\0')
+    {
+        snprintf(spillDir, sizeof(spillDir), "%s/68kemu-spill-XXXXXX", tmp != NULL ? tmp : "/tmp");
+        if (mkdtemp(spillDir) == NULL)
+        {
+            spillDir[0] = '\0';
+            return -1;
+        }
+    }
+
+    snprintf(ramPath, sizeof(ramPath), "%s", rf->path);
+    snprintf(spillPath, sizeof(spillPath), "%s/%u", spillDir, ++spillCount);
+    if (snprintf(linkPath, sizeof(linkPath), "%s/.68kemu-spill-%u", ramRoot, spillCount) >= (int)sizeof(linkPath))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (fstat(fd, &st) != 0 || (pos = lseek(fd, 0, SEEK_CUR)) < 0)
+        return -1;
+    spillFd = open(spillPath, O_RDWR | O_CREAT | O_EXCL, st.st_mode & 07777);
+    if (spillFd < 0)
+        return -1;
+
+    // The link replaces the file in one step, so its name never goes away
+    if (copyFd(fd, spillFd) < 0 || symlink(spillPath, linkPath) != 0)
+    {
+        close(spillFd);
+        unlink(spillPath);
+        return -1;
+    }
+    if (rename(linkPath, ramPath) != 0 || dup2(spillFd, fd) < 0)
+    {
+        unlink(linkPath);
+        close(spillFd);
+        unlink(spillPath);
+        return -1;
+    }
+
+    // The handle keeps its descriptor number and offset
+    close(spillFd);
+    lseek(fd, pos, SEEK_SET);
+
+    ramDiskUsed -= (unsigned long)rf->size < ramDiskUsed ? (unsigned long)rf->size : ramDiskUsed;
+    ramDiskSpilled += rf->size;
+
+    // The other handles on the file move with their own access mode and offset
+    for (h = 0; h < MAX_HANDLES; ++h)
+    {
+        int otherFd = handleFd[h];
+        int flags;
+
+        if (ramFiles[h].path == NULL || strcmp(ramFiles[h].path, ramPath) != 0)
+            continue;
+        ramDiskClosed(h);
+        if (otherFd == fd)
+            continue;
+
+        pos = lseek(otherFd, 0, SEEK_CUR);
+        flags = fcntl(otherFd, F_GETFL);
+        spillFd = open(spillPath, flags & (O_ACCMODE | O_APPEND));
+        if (pos < 0 || flags < 0 || spillFd < 0 || dup2(spillFd, otherFd) < 0)
+        {
+            if (spillFd >= 0)
+                close(spillFd);
+            return -1;
+        }
+        close(spillFd);
+        lseek(otherFd, pos, SEEK_SET);
+    }
+
+    return 0;
+}
+
+// Account the data written to the host file of a handle.
+// Returns 0 on success, or -1 with errno set if the file could not spill.
+static int ramDiskWrote(int handle)
+{
+    RamFile* rf = &ramFiles[handle];
+    struct stat st;
+
+    if (rf->path == NULL || fstat(handleFd[handle], &st) != 0)
+        return 0;
+
+    ramDiskUsed += st.st_size - rf->size;
+    rf->size = st.st_size;
+    if (ramDiskUsed > ramDiskPeak)
+        ramDiskPeak = ramDiskUsed;
+
+    return ramDiskUsed > ramDiskCap ? ramDiskSpill(handle) : 0;
+}
+
+// Delete a directory and its contents, without following the links
+static void removeTree(const char* path)
+{
+    char child[PATH_MAX];
+    struct dirent* entry;
+    DIR* dir = opendir(path);
+
+    if (dir != NULL)
+    {
+        while ((entry = readdir(dir)) != NULL)
+        {
+            struct stat st;
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0
+                || snprintf(child, sizeof(child), "%s/%s", path, entry->d_name) >= (int)sizeof(child))
+                continue;
+
+            if (lstat(child, &st) == 0 && S_ISDIR(st.st_mode))
+                removeTree(child);
+            else
+                unlink(child);
+        }
+        closedir(dir);
+    }
+
+    rmdir(path);
+}
+
+// Process which owns the temporary directories, the only one to delete them
+static pid_t tempOwner;
+
+static void ramDiskCleanup(void)
+{
+    if (getpid() != tempOwner)
+        return;
+
+    removeTree(ramRoot);
+    if (spillDir[0] != '\0')
+        removeTree(spillDir);
+}
+
+int linuxArchiveDrive(int drive, const char* path)
+{
+    char* root;
+
+    if (drive < 0 || drive >= NUM_DRIVES || drive == DRIVE_C || driveRoot[drive] != NULL)
+        return -1;
+
+    root = realpath(path, NULL);
+    if (root == NULL)
+        return -1;
+
+    driveArchive[drive] = archiveOpen(root);
+    if (driveArchive[drive] == NULL)
+    {
+        free(root);
+        return -1;
+    }
+
+    driveRoot[drive] = root;
+    return 0;
+}
+
+static char overlayTemp[PATH_MAX];
+static int overlayTempDrive = -1;
+
+static void overlayCleanup(void)
+{
+    if (getpid() != tempOwner)
+        return;
+
+    removeTree(overlayTemp);
+}
+
+int linuxOverlayDrive(int drive, const char* lower, const char* upper)
+{
+    char* lowerRoot;
+    char* upperRoot;
+
+    if (drive < 0 || drive >= NUM_DRIVES || drive == DRIVE_C || driveRoot[drive] != NULL)
+        return -1;
+
+    // Without an upper directory, the changes are kept in RAM until exit
+    if (upper == NULL)
+    {
+        if (overlayTemp[0] != '\0')
+            return -1;
+        strcpy(overlayTemp, "/dev/shm/68kemu-XXXXXX");
+        if (mkdtemp(overlayTemp) == NULL)
+        {
+            overlayTemp[0] = '\0';
+            return -1;
+        }
+        tempOwner = getpid();
+        atexit(overlayCleanup);
+        overlayTempDrive = drive;
+        upper = overlayTemp;
+    }
+
+    lowerRoot = realpath(lower, NULL);
+    upperRoot = realpath(upper, NULL);
+    if (lowerRoot == NULL || upperRoot == NULL || strcmp(lowerRoot, upperRoot) == 0)
+    {
+        free(lowerRoot);
+        free(upperRoot);
+        return -1;
+    }
+
+    driveLower[drive] = lowerRoot;
+    driveRoot[drive] = upperRoot;
+    return 0;
+}
+
+int linuxRamDisk(int drive, unsigned long size)
+{
+    if (drive < 0 || drive >= NUM_DRIVES || drive == DRIVE_C || ramDrive >= 0 || driveRoot[drive] != NULL)
+        return -1;
+
+    strcpy(ramRoot, "/dev/shm/68kemu-XXXXXX");
+    if (mkdtemp(ramRoot) == NULL)
+        return -1;
+
+    ramDrive = drive;
+    ramDiskCap = size != 0 ? size : RAM_DISK_DEFAULT_SIZE;
+    driveRoot[drive] = ramRoot;
+    tempOwner = getpid();
+    atexit(ramDiskCleanup);
+
+    return 0;
+}
+
+int linuxPrivateTemp(void)
+{
+    spillDir[0] = '\0';
+
+    if (ramDrive >= 0)
+    {
+        strcpy(ramRoot, "/dev/shm/68kemu-XXXXXX");
+        if (mkdtemp(ramRoot) == NULL)
+            return -1;
+    }
+
+    if (overlayTempDrive >= 0)
+    {
+        char* upperRoot = NULL;
+
+        strcpy(overlayTemp, "/dev/shm/68kemu-XXXXXX");
+        if (mkdtemp(overlayTemp) == NULL || (upperRoot = realpath(overlayTemp, NULL)) == NULL)
+        {
+            removeTree(overlayTemp);
+            if (ramDrive >= 0)
+                removeTree(ramRoot);
+            return -1;
+        }
+        free((char*)driveRoot[overlayTempDrive]);
+        driveRoot[overlayTempDrive] = upperRoot;
+    }
+
+    // The cleanup functions registered by the server now run for this process
+    tempOwner = getpid();
+    return 0;
+}
+
+void linuxRamDiskReport(void)
+{
+    if (ramDrive < 0)
+        return;
+
+    fprintf(stderr, "68kemu: RAM disk %c: %llu bytes read, %llu bytes written, "
+        "peak %lu of %lu bytes, %llu bytes spilled\n", 'A' + ramDrive,
+        ramDiskRead, ramDiskWritten, ramDiskPeak, ramDiskCap, ramDiskSpilled);
+}
+
+// Small Fread() calls on regular files are served from a per-handle buffer.
+// While the buffer holds data, the host file offset is at its end, so it
+// must be dropped before any other access which depends on the offset.
+#define READ_AHEAD_SIZE 16384
+
+typedef struct
+{
+    char* data;      // Allocated on first use
+    off_t offset;    // File offset of data[0]
+    size_t start;    // Next byte to return
+    size_t end;      // End of the valid data
+    int disabled;    // Not a regular file, or shares its offset with a dup
+} ReadAhead;
+
+static ReadAhead readAhead[MAX_HANDLES];
+
+// Restore the host file offset to the logical position, and empty the buffer
+static void readAheadDrop(int handle)
+{
+    ReadAhead* ra;
+
+    if (handle < NUM_STD_HANDLES || handle >= MAX_HANDLES)
+        return;
+
+    ra = &readAhead[handle];
+    if (ra->start != ra->end)
+        lseek(handleFd[handle], ra->offset + ra->start, SEEK_SET);
+
+    ra->start = ra->end = 0;
+}
+
+// Drop the buffers of the other handles on the file written through fd
+static void readAheadDropOthers(int handle, int fd)
+{
+    struct stat st;
+    struct stat other;
+    int statDone = 0;
+    int h;
+
+    for (h = NUM_STD_HANDLES; h < MAX_HANDLES; ++h)
+    {
+        if (h == handle || readAhead[h].start == readAhead[h].end)
+            continue;
+
+        if (!statDone)
+        {
+            if (fstat(fd, &st) != 0)
+                return;
+            statDone = 1;
+        }
+
+        if (fstat(handleFd[h], &other) == 0 && other.st_dev == st.st_dev && other.st_ino == st.st_ino)
+            readAheadDrop(h);
+    }
+}
+
+// Forget the buffer of a handle being opened or closed
+static void readAheadReset(int handle)
+{
+    readAhead[handle].start = readAhead[handle].end = 0;
+    readAhead[handle].disabled = 0;
+}
+
+static ssize_t readAheadRead(int handle, int fd, char* dst, size_t count)
+{
+    ReadAhead* ra;
+    struct stat st;
+    size_t copied;
+    ssize_t n;
+
+    if (handle < NUM_STD_HANDLES || handle >= MAX_HANDLES || readAhead[handle].disabled)
+        return read(fd, dst, count);
+
+    ra = &readAhead[handle];
+    if (ra->data == NULL)
+    {
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || (ra->data = malloc(READ_AHEAD_SIZE)) == NULL)
+        {
+            ra->disabled = 1;
+            return read(fd, dst, count);
+        }
+    }
+
+    // Buffered data first
+    copied = ra->end - ra->start;
+    if (copied > count)
+        copied = count;
+    memcpy(dst, ra->data + ra->start, copied);
+    ra->start += copied;
+    dst += copied;
+    count -= copied;
+
+    if (count == 0)
+        return copied;
+
+    // Large reads go straight to the guest memory
+    if (count >= READ_AHEAD_SIZE)
+    {
+        n = read(fd, dst, count);
+        if (n < 0)
+            return copied != 0 ? (ssize_t)copied : n;
+        return copied + n;
+    }
+
+    // Refill
+    ra->offset = lseek(fd, 0, SEEK_CUR);
+    n = read(fd, ra->data, READ_AHEAD_SIZE);
+    if (ra->offset < 0 || n <= 0)
+    {
+        ra->start = ra->end = 0;
+        if (n < 0)
+            return copied != 0 ? (ssize_t)copied : n;
+        return copied;
+    }
+
+    ra->start = count < (size_t)n ? count : (size_t)n;
+    ra->end = n;
+    memcpy(dst, ra->data, ra->start);
+
+    return copied + ra->start;
+}
+
+// Seek within the buffer without any host call, if possible.
+// Returns the new position, or -1 if the buffer must be dropped.
+static off_t readAheadSeek(int handle, off_t delta, int whence)
+{
+    ReadAhead* ra;
+    off_t pos;
+
+    if (handle < NUM_STD_HANDLES || handle >= MAX_HANDLES)
+        return -1;
+
+    ra = &readAhead[handle];
+    if (ra->start == ra->end || whence == SEEK_END)
+        return -1;
+
+    pos = whence == SEEK_SET ? delta : ra->offset + (off_t)ra->start + delta;
+    if (pos < ra->offset || pos > ra->offset + (off_t)ra->end)
+        return -1;
+
+    ra->start = pos - ra->offset;
+    return pos;
+}
+
+// Small Fwrite() calls on regular files are coalesced in a per-handle
+// buffer, which is written at the host file offset. It is flushed before
+// any other access to the handle, and before any call which may look at
+// the file by its name, so the guest never sees stale data.
+// The flushed data only goes to the host page cache: the guest never
+// waits for the disk anyway.
+#define WRITE_BEHIND_SIZE 16384
+
+typedef struct
+{
+    char* data;      // Allocated on first use
+    size_t length;   // Pending bytes
+    int disabled;    // Not a regular file, or shares its offset with a dup
+} WriteBehind;
+
+static WriteBehind writeBehind[MAX_HANDLES];
+static int writeBehindPending; // Number of handles with pending bytes
+
+// Returns 0 on success, or -1 with errno set
+static int writeBehindFlush(int handle)
+{
+    WriteBehind* wb;
+    const char* p;
+    size_t size;
+
+    if (handle < NUM_STD_HANDLES || handle >= MAX_HANDLES)
+        return 0;
+
+    wb = &writeBehind[handle];
+    if (wb->length == 0)
+        return 0;
+
+    p = wb->data;
+    size = wb->length;
+    wb->length = 0;
+    writeBehindPending--;
+
+    while (size > 0)
+    {
+        ssize_t n = write(handleFd[handle], p, size);
+        if (n < 0)
+            return -1;
+        p += n;
+        size -= n;
+    }
+
+    return ramDiskWrote(handle);
+}
+
+static void writeBehindFlushAll(void)
+{
+    int handle;
+
+    for (handle = NUM_STD_HANDLES; writeBehindPending > 0 && handle < MAX_HANDLES; ++handle)
+        writeBehindFlush(handle);
+}
+
+// Forget the buffer of a handle being opened or closed
+static void writeBehindReset(int handle)
+{
+    if (writeBehind[handle].length != 0)
+        writeBehindPending--;
+    writeBehind[handle].length = 0;
+    writeBehind[handle].disabled = 0;
+}
+
+static ssize_t writeBehindWrite(int handle, int fd, const char* src, size_t count)
+{
+    WriteBehind* wb;
+    struct stat st;
+
+    if (handle < NUM_STD_HANDLES || handle >= MAX_HANDLES || writeBehind[handle].disabled)
+        return write(fd, src, count);
+
+    wb = &writeBehind[handle];
+    if (wb->data == NULL)
+    {
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || (wb->data = malloc(WRITE_BEHIND_SIZE)) == NULL)
+        {
+            wb->disabled = 1;
+            return write(fd, src, count);
+        }
+    }
+
+    if (wb->length + count > WRITE_BEHIND_SIZE && writeBehindFlush(handle) < 0)
+        return -1;
+
+    // Large writes go straight from the guest memory
+    if (count >= WRITE_BEHIND_SIZE)
+        return write(fd, src, count);
+
+    if (wb->length == 0)
+        writeBehindPending++;
+    memcpy(wb->data + wb->length, src, count);
+    wb->length += count;
+
+    return count;
+}
+
+// Host file descriptor of a GEMDOS handle.
+// Character devices (negative handles) are the console.
+static int handleToFd(int handle, int output)
+{
+    if (handle < 0 && handle >= -3)
+        return output ? 1 : 0;
+
+    if (handle < -3 || handle >= MAX_HANDLES)
+        return -1;
+
+    return handleFd[handle];
+}
+
+static int newHandle(int fd)
+{
+    int handle;
+
+    for (handle = NUM_STD_HANDLES; handle < MAX_HANDLES; ++handle)
+    {
+        if (handleFd[handle] < 0)
+        {
+            handleFd[handle] = fd;
+            handleOwner[handle] = processCurrent();
+            readAheadReset(handle);
+            writeBehindReset(handle);
+            return handle;
+        }
+    }
+
+    close(fd);
+    return TOS_ENHNDL;
+}
+
+static long closeHandle(int handle)
+{
+    long ret = writeBehindFlush(handle) < 0 ? errnoToGemdos(errno) : TOS_E_OK;
+
+    // The console output goes where the standard output was
+    if (handle == 1)
+        linuxConsoleFlush();
+    if (handleFd[handle] > 2)
+        close(handleFd[handle]);
+    readAheadReset(handle);
+    writeBehindReset(handle);
+    free(handleDir[handle]);
+    handleDir[handle] = NULL;
+    ramDiskClosed(handle);
+    if (archiveFiles[handle].entry != NULL)
+    {
+        archiveRelease(archiveFiles[handle].archive, archiveFiles[handle].entry);
+        archiveFiles[handle].entry = NULL;
+    }
+
+    // Closing a standard handle restores it
+    handleFd[handle] = handle < NUM_STD_HANDLES ? defaultFd[handle] : -1;
+    handleOwner[handle] = 0;
+    return ret;
+}
+
+// The files left open by a terminated child
+static void closeProcessFiles(unsigned int bp)
+{
+    int handle;
+
+    for (handle = 0; handle < MAX_HANDLES; ++handle)
+    {
+        if (handleOwner[handle] == bp && (handle < NUM_STD_HANDLES || handleFd[handle] >= 0))
+            closeHandle(handle);
+    }
+}
+
+// Path translation cache.
+// Names which do not exist with the requested case are looked up in a
+// case-folded hash index of their directory, instead of scanning it.
+// Whole resolved paths are also remembered, so resolving a path again does
+// not touch the host file system at all. Both are dropped when a GEMDOS call
+// creates, deletes or renames a name. Remembered paths expire after a second,
+// so names changed by other host processes are seen soon.
+#define MAX_NAME_INDEXES 16
+#define PATH_MEMO_SIZE 1024 // Must be a power of 2
+#define PATH_MEMO_LIFETIME 1 // s
+
+typedef struct
+{
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char** names;
+    size_t count;
+    unsigned int* table; // Index + 1 of the names, 0 if free
+    unsigned int mask;
+} NameIndex;
+
+typedef struct
+{
+    char* key;     // TOS path, with the drive and current directory
+    char* path;    // Resolved path, relative to the drive root
+    char* hostKey; // Normalized host path, for invalidation
+    time_t time;
+} PathMemo;
+
+static NameIndex* nameIndexes[MAX_NAME_INDEXES];
+static int nextNameIndex;
+static PathMemo pathMemo[PATH_MEMO_SIZE];
+
+static unsigned int hashString(const char* s, int fold)
+{
+    unsigned int hash = 2166136261u; // FNV-1a
+
+    for (; *s != '\0'; ++s)
+        hash = (hash ^ (unsigned char)(fold ? tolower((unsigned char)*s) : *s)) * 16777619u;
+
+    return hash;
+}
+
+// Normalize a host path to a cache key: the path itself, or its parent
+// directory, without duplicate or trailing slashes.
+static void dirKey(const char* hostPath, char* key, int parent)
+{
+    char* p = key;
+    char* slash;
+
+    for (; *hostPath != '\0'; ++hostPath)
+    {
+        if (*hostPath != '/' || p == key || p[-1] != '/')
+            *p++ = *hostPath;
+    }
+    *p = '\0';
+
+    if (p > key + 1 && p[-1] == '/')
+        p[-1] = '\0';
+
+    if (parent && (slash = strrchr(key, '/')) != NULL)
+        slash[slash == key] = '\0';
+}
+
+static void freeNameIndex(NameIndex* index)
+{
+    size_t i;
+
+    for (i = 0; i < index->count; ++i)
+        free(index->names[i]);
+    free(index->names);
+    free(index->table);
+    free(index);
+}
+
+static NameIndex* readNameIndex(const char* key, const struct stat* dirSt)
+{
+    NameIndex* index;
+    DIR* dir;
+    struct dirent* entry;
+    size_t capacity = 0;
+    size_t i;
+
+    index = calloc(1, sizeof(NameIndex));
+    if (index == NULL)
+        return NULL;
+
+    dir = opendir(key);
+    if (dir == NULL)
+    {
+        free(index);
+        return NULL;
+    }
+
+    strcpy(index->path, key);
+    index->dev = dirSt->st_dev;
+    index->ino = dirSt->st_ino;
+    index->mtime = dirSt->st_mtim;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (index->count == capacity)
+        {
+            char** names = realloc(index->names, (capacity + 64) * sizeof(char*));
+            if (names == NULL)
+                break;
+            index->names = names;
+            capacity += 64;
+        }
+
+        index->names[index->count] = strdup(entry->d_name);
+        if (index->names[index->count] != NULL)
+            index->count++;
+    }
+
+    closedir(dir);
+
+    // At most half full, so the probe sequences stay short
+    index->mask = 15;
+    while (index->mask + 1 < index->count * 2)
+        index->mask = index->mask * 2 + 1;
+
+    index->table = calloc(index->mask + 1, sizeof(unsigned int));
+    if (index->table == NULL)
+    {
+        freeNameIndex(index);
+        return NULL;
+    }
+
+    // The first of the names which only differ by case wins, like a scan
+    for (i = 0; i < index->count; ++i)
+    {
+        unsigned int slot = hashString(index->names[i], 1) & index->mask;
+
+        while (index->table[slot] != 0)
+        {
+            if (strcasecmp(index->names[index->table[slot] - 1], index->names[i]) == 0)
+                break;
+            slot = (slot + 1) & index->mask;
+        }
+        if (index->table[slot] == 0)
+            index->table[slot] = i + 1;
+    }
+
+    return index;
+}
+
+// Get the name index of a host directory, read again if it was modified
+static NameIndex* getNameIndex(const char* dirPath)
+{
+    char key[PATH_MAX];
+    NameIndex* index;
+    struct stat st;
+    int i;
+
+    dirKey(dirPath[0] ? dirPath : "/", key, 0);
+    if (stat(key, &st) != 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    for (i = 0; i < MAX_NAME_INDEXES; ++i)
+    {
+        index = nameIndexes[i];
+        if (index == NULL || strcmp(index->path, key) != 0)
+            continue;
+
+        if (index->dev == st.st_dev && index->ino == st.st_ino
+            && index->mtime.tv_sec == st.st_mtim.tv_sec
+            && index->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            return index;
+
+        freeNameIndex(index);
+        nameIndexes[i] = NULL;
+        break;
+    }
+
+    index = readNameIndex(key, &st);
+    if (index == NULL)
+        return NULL;
+
+    if (nameIndexes[nextNameIndex] != NULL)
+        freeNameIndex(nameIndexes[nextNameIndex]);
+    nameIndexes[nextNameIndex] = index;
+    nextNameIndex = (nextNameIndex + 1) % MAX_NAME_INDEXES;
+
+    return index;
+}
+
+static const char* findName(const NameIndex* index, const char* name)
+{
+    unsigned int slot = hashString(name, 1) & index->mask;
+
+    while (index->table[slot] != 0)
+    {
+        const char* candidate = index->names[index->table[slot] - 1];
+        if (strcasecmp(candidate, name) == 0)
+            return candidate;
+        slot = (slot + 1) & index->mask;
+    }
+
+    return NULL;
+}
+
+// Forget the names of the directory containing a host path
+static void pathCacheInvalidate(const char* hostPath)
+{
+    char key[PATH_MAX];
+    size_t len;
+    int i;
+
+    dirKey(hostPath, key, 1);
+    len = strlen(key);
+
+    for (i = 0; i < MAX_NAME_INDEXES; ++i)
+    {
+        if (nameIndexes[i] != NULL && strcmp(nameIndexes[i]->path, key) == 0)
+        {
+            freeNameIndex(nameIndexes[i]);
+            nameIndexes[i] = NULL;
+        }
+    }
+
+    // Including the paths below, if a directory was renamed
+    for (i = 0; i < PATH_MEMO_SIZE; ++i)
+    {
+        PathMemo* memo = &pathMemo[i];
+
+        if (memo->key != NULL && strncmp(memo->hostKey, key, len) == 0
+            && (memo->hostKey[len] == '/' || memo->hostKey[len] == '\0' || len == 1))
+        {
+            free(memo->key);
+            memo->key = NULL;
+        }
+    }
+}
+
+static const PathMemo* findPathMemo(const char* key)
+{
+    PathMemo* memo = &pathMemo[hashString(key, 0) & (PATH_MEMO_SIZE - 1)];
+
+    if (memo->key == NULL || strcmp(memo->key, key) != 0
+        || time(NULL) - memo->time > PATH_MEMO_LIFETIME)
+        return NULL;
+
+    return memo;
+}
+
+static void addPathMemo(const char* key, const char* path, const char* hostPath)
+{
+    PathMemo* memo = &pathMemo[hashString(key, 0) & (PATH_MEMO_SIZE - 1)];
+    char hostKey[PATH_MAX];
+    size_t keyLen = strlen(key) + 1;
+    size_t pathLen = strlen(path) + 1;
+
+    dirKey(hostPath, hostKey, 0);
+
+    // The three strings share one allocation
+    free(memo->key);
+    memo->key = malloc(keyLen + pathLen + strlen(hostKey) + 1);
+    if (memo->key == NULL)
+        return;
+
+    memo->path = memo->key + keyLen;
+    memo->hostKey = memo->path + pathLen;
+    strcpy(memo->key, key);
+    strcpy(memo->path, path);
+    strcpy(memo->hostKey, hostKey);
+    memo->time = time(NULL);
+}
+
+// Replace a name by the real name of the directory entry, ignoring case.
+// Returns nonzero if the entry exists.
+static int matchName(const char* dirPath, char* name, size_t size)
+{
+    char path[PATH_MAX];
+    struct stat st;
+    NameIndex* index;
+    const char* realName;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dirPath, name) >= (int)sizeof(path))
+        return 0;
+    if (lstat(path, &st) == 0)
+        return 1;
+
+    index = getNameIndex(dirPath);
+    if (index == NULL)
+        return 0;
+
+    realName = findName(index, name);
+    if (realName == NULL || strlen(realName) >= size)
+        return 0;
+
+    strcpy(name, realName);
+    return 1;
+}
+
+// Overlay drives.
+// The drive root is a private upper directory, which receives all the
+// changes. The lower directory is shared, and it is never modified. A lower
+// file is copied up before it is modified, and a deleted lower name is
+// hidden by a whiteout file in the upper directory. A directory created in
+// place of a deleted one hides the lower contents with an opaque file.
+#define WHITEOUT_PREFIX ".wh."
+#define OPAQUE_NAME     ".wh..wh..opq"
+
+// Returns the overlay drive of a host path, or -1.
+// rest receives the path below the root of its layer,
+// and lower is set if the path is in the lower directory.
+static int overlayForPath(const char* hostPath, const char** rest, int* lower)
+{
+    int drive;
+    int layer;
+
+    for (drive = 0; drive < NUM_DRIVES; ++drive)
+    {
+        if (driveLower[drive] == NULL)
+            continue;
+
+        for (layer = 0; layer < 2; ++layer)
+        {
+            const char* root = layer ? driveLower[drive] : driveRoot[drive];
+            size_t len = strlen(root);
+
+            if (strncmp(hostPath, root, len) == 0 && (hostPath[len] == '/' || hostPath[len] == '\0'))
+            {
+                *rest = hostPath + len;
+                *lower = layer;
+                return drive;
+            }
+        }
+    }
+
+    return -1;
+}
+
+// Returns nonzero if a lower path is hidden by a whiteout of one of its
+// components, or by an opaque upper directory
+static int overlayHidden(int drive, const char* rest)
+{
+    char marker[PATH_MAX];
+    struct stat st;
+    const char* p = rest;
+
+    while (*p == '/')
+    {
+        const char* name = p + 1;
+        size_t len = strcspn(name, "/");
+
+        if (len == 0)
+            break;
+
+        if (snprintf(marker, sizeof(marker), "%s%.*s/" WHITEOUT_PREFIX "%.*s", driveRoot[drive],
+                (int)(p - rest), rest, (int)len, name) < (int)sizeof(marker)
+            && lstat(marker, &st) == 0)
+            return 1;
+
+        if (snprintf(marker, sizeof(marker), "%s%.*s/" OPAQUE_NAME, driveRoot[drive],
+                (int)(p - rest), rest) < (int)sizeof(marker)
+            && lstat(marker, &st) == 0)
+            return 1;
+
+        p = name + len;
+    }
+
+    return 0;
+}
+
+// Choose the layer of a path relative to the drive root: the upper one if
+// the name exists there, or if it does not exist in the lower one either
+static void overlayResolve(int drive, const char* path, char* hostPath)
+{
+    char lowerPath[PATH_MAX];
+    struct stat st;
+
+    snprintf(hostPath, PATH_MAX, "%s%s", driveRoot[drive], path[0] ? path : "/");
+    if (lstat(hostPath, &st) == 0)
+        return;
+
+    snprintf(lowerPath, sizeof(lowerPath), "%s%s", driveLower[drive], path[0] ? path : "/");
+    if (lstat(lowerPath, &st) == 0 && !overlayHidden(drive, path))
+        strcpy(hostPath, lowerPath);
+}
+
+// Translate a TOS path to a host path.
+// relPath receives the path relative to the drive root, if not NULL.
+// Returns 0 or a GEMDOS error.
+static long resolvePath(const char* tosPath, char* hostPath, int* pDrive, char* relPath)
+{
+    char path[PATH_MAX];
+    char dirPath[PATH_MAX];
+    char name[PATH_MAX];
+    char key[PATH_MAX];
+    const PathMemo* memo;
+    const char* p = tosPath;
+    int drive = currentDrive;
+    int relative;
+    size_t len;
+
+    // The file may be opened, listed or renamed by its name
+    writeBehindFlushAll();
+
+    if (p[0] != '\0' && p[1] == ':')
+    {
+        drive = toupper((unsigned char)p[0]) - 'A';
+        p += 2;
+    }
+
+    if (drive < 0 || drive >= NUM_DRIVES || driveRoot[drive] == NULL)
+        return TOS_EDRIVE;
+
+    relative = *p != '\\' && *p != '/';
+    if (snprintf(key, sizeof(key), "%c:%s\\%s", 'A' + drive, relative ? currentPath[drive] : "", p) >= (int)sizeof(key))
+        key[0] = '\0';
+
+    memo = key[0] != '\0' ? findPathMemo(key) : NULL;
+    if (memo != NULL)
+    {
+        strcpy(path, memo->path);
+        p += strlen(p);
+    }
+    else if (relative)
+        strcpy(path, currentPath[drive]);
+    else
+        path[0] = '\0';
+
+    while (*p != '\0')
+    {
+        while (*p == '\\' || *p == '/')
+            ++p;
+
+        len = strcspn(p, "\\/");
+        if (len == 0)
+            break;
+        if (len >= sizeof(name))
+            return TOS_EPTHNF;
+
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len;
+
+        if (strcmp(name, ".") == 0)
+            continue;
+
+        if (strcmp(name, "..") == 0)
+        {
+            char* slash = strrchr(path, '/');
+            if (slash != NULL)
+                *slash = '\0';
+            continue;
+        }
+
+        // Archives are searched ignoring case anyway
+        if (driveArchive[drive] == NULL)
+        {
+            snprintf(dirPath, sizeof(dirPath), "%s%s", driveRoot[drive], path);
+            if (!matchName(dirPath, name, sizeof(name)) && driveLower[drive] != NULL)
+            {
+                snprintf(dirPath, sizeof(dirPath), "%s%s", driveLower[drive], path);
+                matchName(dirPath, name, sizeof(name));
+            }
+        }
+
+        if (strlen(path) + 1 + strlen(name) >= sizeof(path))
+            return TOS_EPTHNF;
+        strcat(path, "/");
+        strcat(path, name);
+    }
+
+    if (memo != NULL)
+        strcpy(hostPath, memo->hostKey);
+    else
+    {
+        if (driveLower[drive] != NULL)
+            overlayResolve(drive, path, hostPath);
+        else
+            snprintf(hostPath, PATH_MAX, "%s%s", driveRoot[drive], path[0] ? path : "/");
+
+        if (key[0] != '\0')
+            addPathMemo(key, path, hostPath);
+    }
+
+    if (pDrive != NULL)
+        *pDrive = drive;
+    if (relPath != NULL)
+        strcpy(relPath, path);
+
+    return TOS_E_OK;
+}
+
+static long resolveGuestPath(unsigned int address, char* hostPath)
+{
+    char tosPath[PATH_MAX];
+
+    readGuestString(address, tosPath, sizeof(tosPath));
+    return resolvePath(tosPath, hostPath, NULL, NULL);
+}
+
+// Convert a host time to the GEMDOS format
+static void toDosTime(time_t t, unsigned int* pTime, unsigned int* pDate)
+{
+    struct tm* tm = localtime(&t);
+
+    *pTime = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+    *pDate = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+}
+
+static time_t fromDosTime(unsigned int dosTime, unsigned int dosDate)
+{
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_hour = dosTime >> 11;
+    tm.tm_min = (dosTime >> 5) & 0x3f;
+    tm.tm_sec = (dosTime & 0x1f) * 2;
+    tm.tm_year = (dosDate >> 9) + 80;
+    tm.tm_mon = ((dosDate >> 5) & 0x0f) - 1;
+    tm.tm_mday = dosDate & 0x1f;
+    tm.tm_isdst = -1;
+
+    return mktime(&tm);
+}
+
+static unsigned int fileAttributes(const struct stat* st)
+{
+    unsigned int attr = 0;
+
+    if (S_ISDIR(st->st_mode))
+        attr |= FA_DIR;
+    if (!(st->st_mode & S_IWUSR))
+        attr |= FA_RDONLY;
+
+    return attr;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Directory search                                                         */
+/* ------------------------------------------------------------------------ */
+
+#define MAX_SEARCHES 32
+
+#define MAX_CACHED_DIRS 16
+
+typedef struct
+{
+    char dosName[14];
+    unsigned char attr;
+    unsigned short time;
+    unsigned short date;
+    unsigned int length;
+} DirEntry;
+
+// Snapshot of the entries of a host directory which have an 8.3 name
+typedef struct
+{
+    int refs; // The cache, and each search reading it
+    char path[PATH_MAX];
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    DirEntry* entries;
+    size_t count;
+} DirListing;
+
+// Listings kept for the next searches in the same directories.
+// A listing is dropped when a GEMDOS call changes its directory or one of
+// its files, and it is read again when the host directory was modified.
+static DirListing* dirCache[MAX_CACHED_DIRS];
+static int nextCachedDir;
+
+// Searches in progress, identified by their DTA
+typedef struct
+{
+    unsigned int dta;
+    DirListing* listing;
+    size_t index;
+    char pattern[PATH_MAX];
+    unsigned int attr;
+} Search;
+
+static Search searches[MAX_SEARCHES];
+static int nextSearch;
+
+// Convert a host name to an upper-case 8.3 name.
+// Returns 0 if the name cannot be represented.
+static int toDosName(const char* name, char out[14])
+{
+    const char* dot = strrchr(name, '.');
+    size_t baseLen = dot != NULL ? (size_t)(dot - name) : strlen(name);
+    size_t extLen = dot != NULL ? strlen(dot + 1) : 0;
+    size_t i;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        strcpy(out, name);
+        return 1;
+    }
+
+    if (baseLen == 0 || baseLen > 8 || extLen > 3 || (dot != NULL && extLen == 0))
+        return 0;
+
+    for (i = 0; name[i] != '\0'; ++i)
+    {
+        unsigned char c = (unsigned char)name[i];
+
+        if (c <= ' ' || c >= 0x7f || strchr("*?\\/:\"<>|", c) != NULL)
+            return 0;
+        if (c == '.' && name + i != dot)
+            return 0;
+
+        out[i] = (char)toupper(c);
+    }
+    out[i] = '\0';
+
+    return 1;
+}
+
+// Match a TOS wildcard pattern, ignoring case.
+// A name without extension also matches as "NAME.", so "*.*" matches all.
+static int matchPattern(const char* pattern, const char* name)
+{
+    if (*pattern == '\0')
+        return *name == '\0';
+
+    if (*pattern == '*')
+        return matchPattern(pattern + 1, name) || (*name != '\0' && matchPattern(pattern, name + 1));
+
+    if (*name == '\0')
+        return strcmp(pattern, ".") == 0 || strcmp(pattern, ".*") == 0;
+
+    if (*pattern == '?' || toupper((unsigned char)*pattern) == toupper((unsigned char)*name))
+        return matchPattern(pattern + 1, name + 1);
+
+    return 0;
+}
+
+static void releaseListing(DirListing* listing)
+{
+    if (--listing->refs == 0)
+    {
+        free(listing->entries);
+        free(listing);
+    }
+}
+
+// Drop the listing of a directory, by key
+static void dirCacheDrop(const char* key)
+{
+    int i;
+
+    for (i = 0; i < MAX_CACHED_DIRS; ++i)
+    {
+        if (dirCache[i] != NULL && strcmp(dirCache[i]->path, key) == 0)
+        {
+            releaseListing(dirCache[i]);
+            dirCache[i] = NULL;
+        }
+    }
+}
+
+// Drop the listing of the directory containing a host path,
+// and the translations of the names in it, in both layers of an overlay
+static void dirCacheInvalidate(const char* hostPath)
+{
+    char key[PATH_MAX];
+    char other[PATH_MAX];
+    const char* rest;
+    int lower;
+    int drive;
+
+    dirKey(hostPath, key, 1);
+    dirCacheDrop(key);
+    pathCacheInvalidate(hostPath);
+
+    drive = overlayForPath(hostPath, &rest, &lower);
+    if (drive >= 0)
+    {
+        snprintf(other, sizeof(other), "%s%s", lower ? driveRoot[drive] : driveLower[drive], rest);
+        dirKey(other, key, 1);
+        dirCacheDrop(key);
+        pathCacheInvalidate(other);
+    }
+}
+
+static DirListing* readListing(const char* key, const struct stat* dirSt)
+{
+    DirListing* listing;
+    DIR* dir;
+    struct dirent* entry;
+    size_t capacity = 0;
+
+    listing = calloc(1, sizeof(DirListing));
+    if (listing == NULL)
+        return NULL;
+
+    dir = opendir(key);
+    if (dir == NULL)
+    {
+        free(listing);
+        return NULL;
+    }
+
+    strcpy(listing->path, key);
+    listing->dev = dirSt->st_dev;
+    listing->ino = dirSt->st_ino;
+    listing->mtime = dirSt->st_mtim;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char path[PATH_MAX];
+        DirEntry* e;
+        struct stat st;
+        unsigned int dosTime;
+        unsigned int dosDate;
+
+        if (listing->count == capacity)
+        {
+            DirEntry* entries = realloc(listing->entries, (capacity + 64) * sizeof(DirEntry));
+            if (entries == NULL)
+                break;
+            listing->entries = entries;
+            capacity += 64;
+        }
+
+        e = &listing->entries[listing->count];
+        if (!toDosName(entry->d_name, e->dosName))
+            continue;
+
+        if (snprintf(path, sizeof(path), "%s/%s", key, entry->d_name) >= (int)sizeof(path)
+            || stat(path, &st) != 0)
+            continue;
+
+        toDosTime(st.st_mtime, &dosTime, &dosDate);
+        e->attr = fileAttributes(&st);
+        e->time = dosTime;
+        e->date = dosDate;
+        e->length = (e->attr & FA_DIR) ? 0 : (unsigned int)st.st_size;
+        listing->count++;
+    }
+
+    closedir(dir);
+    return listing;
+}
+
+// Get the listing of a host directory, from the cache if it is still valid.
+// The caller owns a reference. Returns NULL if the directory cannot be read.
+static DirListing* getListing(const char* hostDir)
+{
+    char key[PATH_MAX];
+    DirListing* listing;
+    struct stat st;
+    int i;
+
+    dirKey(hostDir, key, 0);
+    if (stat(key, &st) != 0 || !S_ISDIR(st.st_mode))
+        return NULL;
+
+    for (i = 0; i < MAX_CACHED_DIRS; ++i)
+    {
+        listing = dirCache[i];
+        if (listing == NULL || strcmp(listing->path, key) != 0)
+            continue;
+
+        // Modified by another host process
+        if (listing->dev != st.st_dev || listing->ino != st.st_ino
+            || listing->mtime.tv_sec != st.st_mtim.tv_sec
+            || listing->mtime.tv_nsec != st.st_mtim.tv_nsec)
+        {
+            releaseListing(listing);
+            dirCache[i] = NULL;
+            break;
+        }
+
+        listing->refs++;
+        return listing;
+    }
+
+    listing = readListing(key, &st);
+    if (listing == NULL)
+        return NULL;
+
+    if (dirCache[nextCachedDir] != NULL)
+        releaseListing(dirCache[nextCachedDir]);
+    dirCache[nextCachedDir] = listing;
+    nextCachedDir = (nextCachedDir + 1) % MAX_CACHED_DIRS;
+    listing->refs = 2;
+
+    return listing;
+}
+
+static int addArchiveEntry(DirListing* listing, size_t* capacity, const char* name, const ArchiveEntry* entry)
+{
+    DirEntry* e;
+    unsigned int dosTime;
+    unsigned int dosDate;
+
+    if (listing->count == *capacity)
+    {
+        DirEntry* entries = realloc(listing->entries, (*capacity + 64) * sizeof(DirEntry));
+        if (entries == NULL)
+            return -1;
+        listing->entries = entries;
+        *capacity += 64;
+    }
+
+    e = &listing->entries[listing->count];
+    if (!toDosName(name, e->dosName))
+        return 0;
+
+    toDosTime(entry->mtime, &dosTime, &dosDate);
+    e->attr = FA_RDONLY | (entry->isDir ? FA_DIR : 0);
+    e->time = dosTime;
+    e->date = dosDate;
+    e->length = entry->size;
+    listing->count++;
+
+    return 0;
+}
+
+// Get the listing of a directory in an archive. It is not cached, as the
+// archive index already serves it without host calls.
+static DirListing* archiveListing(Archive* archive, const char* dir)
+{
+    const ArchiveEntry* entry = archiveFind(archive, dir);
+    DirListing* listing;
+    size_t capacity = 0;
+    size_t cursor = 0;
+
+    if (entry == NULL || !entry->isDir)
+        return NULL;
+
+    listing = calloc(1, sizeof(DirListing));
+    if (listing == NULL)
+        return NULL;
+    listing->refs = 1;
+
+    // Like the host directories
+    if (dir[0] != '\0')
+    {
+        addArchiveEntry(listing, &capacity, ".", entry);
+        addArchiveEntry(listing, &capacity, "..", entry);
+    }
+
+    while ((entry = archiveReadDir(archive, dir, &cursor)) != NULL)
+    {
+        const char* slash = strrchr(entry->name, '/');
+
+        if (addArchiveEntry(listing, &capacity, slash != NULL ? slash + 1 : entry->name, entry) < 0)
+            break;
+    }
+
+    return listing;
+}
+
+// Get the merged listing of a directory of an overlay drive.
+// The upper entries hide the lower ones with the same name, and the
+// whited out lower entries are skipped.
+static DirListing* overlayListing(int drive, const char* rest)
+{
+    char upperDir[PATH_MAX];
+    char lowerDir[PATH_MAX];
+    char marker[PATH_MAX + sizeof(OPAQUE_NAME)];
+    DirListing* upper;
+    DirListing* lower = NULL;
+    DirListing* merged;
+    NameIndex* index;
+    struct stat st;
+    size_t i;
+    size_t j;
+
+    snprintf(upperDir, sizeof(upperDir), "%s%s", driveRoot[drive], rest[0] ? rest : "/");
+    snprintf(lowerDir, sizeof(lowerDir), "%s%s", driveLower[drive], rest[0] ? rest : "/");
+    snprintf(marker, sizeof(marker), "%s/" OPAQUE_NAME, upperDir);
+
+    upper = getListing(upperDir);
+    if (!overlayHidden(drive, rest) && lstat(marker, &st) != 0)
+        lower = getListing(lowerDir);
+
+    if (lower == NULL || upper == NULL)
+        return lower != NULL ? lower : upper;
+
+    merged = calloc(1, sizeof(DirListing));
+    if (merged == NULL || (merged->entries = malloc((upper->count + lower->count) * sizeof(DirEntry))) == NULL)
+    {
+        free(merged);
+        releaseListing(upper);
+        releaseListing(lower);
+        return NULL;
+    }
+
+    merged->refs = 1;
+    memcpy(merged->entries, upper->entries, upper->count * sizeof(DirEntry));
+    merged->count = upper->count;
+    index = getNameIndex(upperDir);
+
+    for (i = 0; i < lower->count; ++i)
+    {
+        char whiteout[sizeof(WHITEOUT_PREFIX) + 14];
+
+        for (j = 0; j < upper->count; ++j)
+        {
+            if (strcmp(upper->entries[j].dosName, lower->entries[i].dosName) == 0)
+                break;
+        }
+        if (j < upper->count)
+            continue;
+
+        snprintf(whiteout, sizeof(whiteout), WHITEOUT_PREFIX "%s", lower->entries[i].dosName);
+        if (index != NULL && findName(index, whiteout) != NULL)
+            continue;
+
+        merged->entries[merged->count++] = lower->entries[i];
+    }
+
+    releaseListing(upper);
+    releaseListing(lower);
+    return merged;
+}
+
+static Search* findSearch(unsigned int dta)
+{
+    int i;
+
+    for (i = 0; i < MAX_SEARCHES; ++i)
+    {
+        if (searches[i].listing != NULL && searches[i].dta == dta)
+            return &searches[i];
+    }
+
+    return NULL;
+}
+
+static void endSearch(Search* search)
+{
+    releaseListing(search->listing);
+    search->listing = NULL;
+}
+
+// Fill the DTA with the next matching entry.
+// The search reads its own snapshot, so it is not disturbed when the guest
+// deletes or renames the files as it finds them.
+static long searchNext(Search* search)
+{
+    while (search->index < search->listing->count)
+    {
+        const DirEntry* entry = &search->listing->entries[search->index++];
+        unsigned int i;
+
+        if (!matchPattern(search->pattern, entry->dosName))
+            continue;
+        if ((entry->attr & FA_DIR) && !(search->attr & FA_DIR))
+            continue;
+
+        m68k_write_memory_8(search->dta + DTA_ATTRIB, entry->attr);
+        m68k_write_memory_16(search->dta + DTA_TIME, entry->time);
+        m68k_write_memory_16(search->dta + DTA_DATE, entry->date);
+        m68k_write_memory_32(search->dta + DTA_LENGTH, entry->length);
+        for (i = 0; i < sizeof(entry->dosName); ++i)
+            m68k_write_memory_8(search->dta + DTA_NAME + i, (unsigned char)entry->dosName[i]);
+
+        return TOS_E_OK;
+    }
+
+    endSearch(search);
+    return TOS_ENMFIL;
+}
+
+static int gemdosFsfirst(unsigned int sp)
+{
+    unsigned int attr = ARG_W(6);
+    char spec[PATH_MAX];
+    char hostDir[PATH_MAX];
+    char* pattern;
+    Archive* archive;
+    const char* inside;
+    Search* search;
+    int drive;
+    int lower;
+    int ret;
+
+    if (attr == FA_LABEL)
+        return TOS_EFILNF;
+
+    readGuestString(ARG_L(2), spec, sizeof(spec));
+
+    search = findSearch(currentDta);
+    if (search != NULL)
+        endSearch(search);
+    else
+    {
+        search = &searches[nextSearch];
+        nextSearch = (nextSearch + 1) % MAX_SEARCHES;
+        if (search->listing != NULL)
+            endSearch(search);
+    }
+
+    // Split the directory and the pattern
+    pattern = spec + strlen(spec);
+    while (pattern > spec && pattern[-1] != '\\' && pattern[-1] != '/' && pattern[-1] != ':')
+        --pattern;
+    strcpy(search->pattern, pattern);
+    *pattern = '\0';
+
+    ret = resolvePath(spec, hostDir, NULL, NULL);
+    if (ret < 0)
+        return ret;
+
+    archive = archiveForPath(hostDir, &inside);
+    drive = overlayForPath(hostDir, &inside, &lower);
+    if (archive != NULL)
+        search->listing = archiveListing(archive, inside);
+    else if (drive >= 0)
+        search->listing = overlayListing(drive, inside);
+    else
+        search->listing = getListing(hostDir);
+    if (search->listing == NULL)
+        return TOS_EPTHNF;
+
+    search->dta = currentDta;
+    search->index = 0;
+    search->attr = attr;
+
+    ret = searchNext(search);
+    return ret == TOS_ENMFIL ? TOS_EFILNF : ret;
+}
+
+static int gemdosFsnext(unsigned int sp)
+{
+    Search* search = findSearch(currentDta);
+
+    if (search == NULL)
+        return TOS_ENMFIL;
+
+    return searchNext(search);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Overlay changes                                                          */
+/* ------------------------------------------------------------------------ */
+
+// Create the missing parent directories of a path
+static void makeParents(const char* path)
+{
+    char dir[PATH_MAX];
+    char* p;
+
+    strcpy(dir, path);
+    for (p = strchr(dir + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+    {
+        *p = '\0';
+        mkdir(dir, 0777);
+        *p = '/';
+    }
+}
+
+// Copy a lower file or directory up before it is modified, and replace
+// hostPath by the upper path. Returns 0 or a GEMDOS error.
+static long overlayCopyUp(char* hostPath)
+{
+    char upper[PATH_MAX];
+    struct timespec times[2];
+    struct stat st;
+    const char* rest;
+    int lower;
+    int drive = overlayForPath(hostPath, &rest, &lower);
+    int from;
+    int to;
+
+    if (drive < 0 || !lower)
+        return TOS_E_OK;
+
+    if (snprintf(upper, sizeof(upper), "%s%s", driveRoot[drive], rest) >= (int)sizeof(upper))
+        return TOS_EPTHNF;
+    if (lstat(hostPath, &st) != 0)
+        return errnoToGemdos(errno);
+
+    dirCacheInvalidate(hostPath);
+    makeParents(upper);
+
+    if (S_ISDIR(st.st_mode))
+    {
+        if (mkdir(upper, st.st_mode & 07777) != 0 && errno != EEXIST)
+            return errnoToGemdos(errno);
+    }
+    else
+    {
+        from = open(hostPath, O_RDONLY);
+        if (from < 0)
+            return errnoToGemdos(errno);
+        to = open(upper, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+        if (to < 0 || copyFd(from, to) < 0)
+        {
+            int err = errno;
+            close(from);
+            if (to >= 0)
+                close(to);
+            unlink(upper);
+            return errnoToGemdos(err);
+        }
+
+        // The copy keeps the time of the original
+        times[0] = st.st_atim;
+        times[1] = st.st_mtim;
+        futimens(to, times);
+        close(from);
+        close(to);
+    }
+
+    strcpy(hostPath, upper);
+    return TOS_E_OK;
+}
+
+// Hide the lower name of a path below the roots, if it exists
+static long overlayWhiteout(int drive, const char* rest)
+{
+    char lowerPath[PATH_MAX];
+    char marker[PATH_MAX];
+    const char* name = strrchr(rest, '/');
+    struct stat st;
+    int fd;
+
+    snprintf(lowerPath, sizeof(lowerPath), "%s%s", driveLower[drive], rest);
+    if (lstat(lowerPath, &st) != 0)
+        return TOS_E_OK;
+
+    name = name != NULL ? name + 1 : rest;
+    if (snprintf(marker, sizeof(marker), "%s%.*s" WHITEOUT_PREFIX "%s", driveRoot[drive],
+            (int)(name - rest), rest, name) >= (int)sizeof(marker))
+        return TOS_EPTHNF;
+
+    makeParents(marker);
+    fd = open(marker, O_WRONLY | O_CREAT, 0666);
+    if (fd < 0)
+        return errnoToGemdos(errno);
+    close(fd);
+
+    return TOS_E_OK;
+}
+
+// Prepare the creation of a name: it is always created in the upper
+// directory, and hostPath is replaced by the upper path. The parent
+// directory is created in the upper layer if it only exists in the lower one.
+// Returns 1 if the name was whited out, 0, or a GEMDOS error.
+static long overlayPrepareCreate(char* hostPath)
+{
+    char upper[PATH_MAX];
+    char parent[PATH_MAX];
+    char marker[PATH_MAX];
+    struct stat st;
+    const char* rest;
+    const char* name;
+    int lower;
+    int drive = overlayForPath(hostPath, &rest, &lower);
+
+    if (drive < 0)
+        return 0;
+
+    if (snprintf(upper, sizeof(upper), "%s%s", driveRoot[drive], rest) >= (int)sizeof(upper))
+        return TOS_EPTHNF;
+
+    name = strrchr(rest, '/');
+    name = name != NULL ? name + 1 : rest;
+    snprintf(parent, sizeof(parent), "%s%.*s", driveRoot[drive], (int)(name - rest), rest);
+
+    if (stat(parent, &st) != 0)
+    {
+        // The parent must be visible in the lower layer
+        snprintf(parent, sizeof(parent), "%s%.*s", driveLower[drive], (int)(name - rest), rest);
+        if (stat(parent, &st) != 0 || !S_ISDIR(st.st_mode) || overlayHidden(drive, rest))
+            return TOS_EPTHNF;
+        makeParents(upper);
+    }
+
+    snprintf(marker, sizeof(marker), "%s%.*s" WHITEOUT_PREFIX "%s", driveRoot[drive],
+        (int)(name - rest), rest, name);
+    strcpy(hostPath, upper);
+
+    return unlink(marker) == 0;
+}
+
+// Returns nonzero if a directory of an overlay drive has no visible entry
+static int overlayDirEmpty(int drive, const char* rest)
+{
+    char path[PATH_MAX];
+    char marker[PATH_MAX + sizeof(OPAQUE_NAME)];
+    struct dirent* entry;
+    struct stat st;
+    DIR* dir;
+    int empty = 1;
+
+    // Only whiteouts in the upper directory
+    snprintf(path, sizeof(path), "%s%s", driveRoot[drive], rest);
+    dir = opendir(path);
+    if (dir != NULL)
+    {
+        while (empty && (entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0
+                && strncmp(entry->d_name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) != 0)
+                empty = 0;
+        }
+        closedir(dir);
+    }
+
+    snprintf(marker, sizeof(marker), "%s/" OPAQUE_NAME, path);
+    if (!empty || overlayHidden(drive, rest) || lstat(marker, &st) == 0)
+        return empty;
+
+    // And only whited out entries in the lower one
+    snprintf(path, sizeof(path), "%s%s", driveLower[drive], rest);
+    dir = opendir(path);
+    if (dir != NULL)
+    {
+        while (empty && (entry = readdir(dir)) != NULL)
+        {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+                continue;
+            snprintf(marker, sizeof(marker), "%s%s/" WHITEOUT_PREFIX "%s", driveRoot[drive], rest, entry->d_name);
+            if (lstat(marker, &st) != 0)
+                empty = 0;
+        }
+        closedir(dir);
+    }
+
+    return empty;
+}
+
+// Delete a file or an empty directory of an overlay drive.
+// Returns 0 or a GEMDOS error.
+static long overlayRemove(const char* hostPath, int isDir)
+{
+    char upper[PATH_MAX];
+    struct stat st;
+    const char* rest = "";
+    int lower = 0;
+    int drive = overlayForPath(hostPath, &rest, &lower);
+
+    if (lstat(hostPath, &st) != 0)
+        return isDir ? TOS_EPTHNF : TOS_EFILNF;
+    if (isDir != !!S_ISDIR(st.st_mode))
+        return TOS_EACCDN;
+    if (isDir && !overlayDirEmpty(drive, rest))
+        return TOS_EACCDN;
+
+    dirCacheInvalidate(hostPath);
+
+    if (!lower)
+    {
+        snprintf(upper, sizeof(upper), "%s%s", driveRoot[drive], rest);
+        if (isDir)
+        {
+            // Only the whiteouts are left
+            DIR* dir = opendir(upper);
+            struct dirent* entry;
+            char marker[PATH_MAX];
+
+            while (dir != NULL && (entry = readdir(dir)) != NULL)
+            {
+                if (strncmp(entry->d_name, WHITEOUT_PREFIX, strlen(WHITEOUT_PREFIX)) == 0
+                    && snprintf(marker, sizeof(marker), "%s/%s", upper, entry->d_name) < (int)sizeof(marker))
+                    unlink(marker);
+            }
+            if (dir != NULL)
+                closedir(dir);
+        }
+
+        if ((isDir ? rmdir(upper) : unlink(upper)) != 0)
+            return errnoToGemdos(errno);
+    }
+
+    return overlayWhiteout(drive, rest);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Console                                                                  */
+/* ------------------------------------------------------------------------ */
+
+static void writeAll(int fd, const void* buffer, size_t size)
+{
+    const char* p = buffer;
+
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return;
+        p += n;
+        size -= n;
+    }
+}
+
+// Console output is buffered, and flushed on newline, when the buffer is
+// full, before console input, before other file I/O, and between two
+// timeslices
+#define CONSOLE_BUFFER_SIZE 4096
+
+static char consoleBuffer[CONSOLE_BUFFER_SIZE];
+static size_t consoleLength;
+
+void linuxConsoleFlush(void)
+{
+    if (consoleLength == 0)
+        return;
+
+    // To the standard output, as redirected by Fforce()
+    writeAll(handleToFd(1, 1), consoleBuffer, consoleLength);
+    consoleLength = 0;
+}
+
+static void consoleWrite(const char* s, size_t size)
+{
+    int newline = memchr(s, '\n', size) != NULL;
+
+    while (size > 0)
+    {
+        size_t n = CONSOLE_BUFFER_SIZE - consoleLength;
+
+        if (n > size)
+            n = size;
+        memcpy(consoleBuffer + consoleLength, s, n);
+        consoleLength += n;
+        s += n;
+        size -= n;
+
+        if (consoleLength == CONSOLE_BUFFER_SIZE)
+            linuxConsoleFlush();
+    }
+
+    if (newline)
+        linuxConsoleFlush();
+}
+
+static void consoleOut(unsigned int c)
+{
+    char ch = (char)c;
+    consoleWrite(&ch, 1);
+}
+
+static long consoleIn(void)
+{
+    unsigned char c;
+
+    linuxConsoleFlush();
+
+    if (read(0, &c, 1) != 1)
+        return 0;
+
+    return c;
+}
+
+static long consoleStatus(void)
+{
+    struct pollfd pfd;
+
+    linuxConsoleFlush();
+
+    pfd.fd = 0;
+    pfd.events = POLLIN;
+
+    return poll(&pfd, 1, 0) > 0 ? -1 : 0;
+}
+
+static int gemdosCconws(unsigned int sp)
+{
+    unsigned int address = ARG_L(2);
+    char buffer[256];
+    size_t len;
+
+    do
+    {
+        readGuestString(address, buffer, sizeof(buffer));
+        len = strlen(buffer);
+        consoleWrite(buffer, len);
+        address += len;
+    } while (len == sizeof(buffer) - 1);
+
+    return TOS_E_OK;
+}
+
+static int gemdosCconrs(unsigned int sp)
+{
+    unsigned int address = ARG_L(2);
+    unsigned int max = m68k_read_memory_8(address);
+    unsigned int count = 0;
+    long c;
+
+    while (count < max && (c = consoleIn()) != 0 && c != '\n')
+    {
+        if (c != '\r')
+            m68k_write_memory_8(address + 2 + count++, c);
+    }
+
+    m68k_write_memory_8(address + 1, count);
+    return TOS_E_OK;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Processes                                                                */
+/* ------------------------------------------------------------------------ */
+
+// Resume the parent, or exit with the main program.
+// Returns the value of D0 for the parent.
+static int terminate(int code, long keep)
+{
+    if (!processTerminate(keep))
+        exit(code & 0xff);
+
+    return code;
+}
+
+// Super() acts on the emulated CPU only
+static int gemdosSuper(unsigned int sp)
+{
+    unsigned int param = ARG_L(2);
+    unsigned int sr = m68k_get_reg(NULL, M68K_REG_SR);
+    unsigned int* regs;
+    unsigned int oldSsp;
+
+    if (param == 1)
+        return (sr & 0x2000) ? -1 : 0;
+
+    // Changing SR swaps the stack pointers: get the registers after
+    regs = m68k_get_reg_file();
+    if (sr & 0x2000)
+    {
+        regs[M68K_REG_A7] = param;
+        m68k_set_reg(M68K_REG_SR, sr & ~0x2000);
+        return 0;
+    }
+
+    if (param == 0)
+        param = regs[M68K_REG_A7];
+
+    m68k_set_reg(M68K_REG_SR, sr | 0x2000);
+    oldSsp = regs[M68K_REG_A7];
+    regs[M68K_REG_A7] = param;
+
+    return oldSsp;
+}
+
+static unsigned int buildEnvironment(void)
+{
+    size_t size = 1;
+    unsigned int env;
+    char** var;
+
+    for (var = environ; *var != NULL; ++var)
+        size += strlen(*var) + 1;
+
+    env = heapAlloc(size, HEAP_ANY);
+    if (env == 0)
+        return 0;
+
+    size = 0;
+    for (var = environ; *var != NULL; ++var)
+    {
+        writeGuestString(env + size, *var);
+        size += strlen(*var) + 1;
+    }
+    m68k_write_memory_8(env + size, 0);
+
+    return env;
+}
+
+static unsigned int getDta(void)
+{
+    return currentDta;
+}
+
+static void setDta(unsigned int dta)
+{
+    currentDta = dta;
+}
+
+long linuxLoadProgram(const char* path, const char* tail)
+{
+    unsigned int env = buildEnvironment();
+    long bp = prgLoad(path, tail, env, 0);
+
+    if (bp < 0)
+    {
+        heapFree(env);
+        return bp;
+    }
+
+    currentDta = bp + BP_CMDLIN;
+    processInit(bp, getDta, setDta, closeProcessFiles);
+
+    return bp;
+}
+
+int linuxSetArguments(unsigned int bp, const char* tail)
+{
+    unsigned int env = buildEnvironment();
+
+    if (env == 0)
+        return -1;
+
+    heapFree(m68k_read_memory_32(bp + BP_ENV));
+    m68k_write_memory_32(bp + BP_ENV, env);
+    memcpy(m68k_host_ptr(bp + BP_CMDLIN), tail, 128);
+
+    return 0;
+}
+
+void linuxUnloadProgram(unsigned int bp)
+{
+    heapFree(m68k_read_memory_32(bp + BP_ENV));
+    heapFree(bp);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Trap hooks                                                               */
+/* ------------------------------------------------------------------------ */
+
+static int gemdosPterm0(unsigned int sp)
+{
+    return terminate(0, -1);
+}
+
+// Cconin(), Crawcin(), Cnecin()
+static int gemdosCconin(unsigned int sp)
+{
+    return consoleIn();
+}
+
+static int gemdosCconout(unsigned int sp)
+{
+    consoleOut(ARG_W(2));
+    return TOS_E_OK;
+}
+
+static int gemdosCrawio(unsigned int sp)
+{
+    if ((ARG_W(2) & 0xff) == 0xff)
+        return consoleStatus() ? consoleIn() : 0;
+    consoleOut(ARG_W(2));
+    return TOS_E_OK;
+}
+
+static int gemdosCconis(unsigned int sp)
+{
+    return consoleStatus();
+}
+
+// Bit map of the existing drives
+static unsigned int driveMap(void)
+{
+    unsigned int map = 0;
+    int i;
+
+    for (i = 0; i < NUM_DRIVES; ++i)
+    {
+        if (driveRoot[i] != NULL)
+            map |= 1 << i;
+    }
+    return map;
+}
+
+static int gemdosDsetdrv(unsigned int sp)
+{
+    unsigned int drive = ARG_W(2);
+
+    if (drive < NUM_DRIVES && driveRoot[drive] != NULL)
+        currentDrive = drive;
+
+    return driveMap();
+}
+
+static int gemdosCconos(unsigned int sp)
+{
+    return -1;
+}
+
+static int gemdosDgetdrv(unsigned int sp)
+{
+    return currentDrive;
+}
+
+static int gemdosFsetdta(unsigned int sp)
+{
+    currentDta = ARG_L(2);
+    return TOS_E_OK;
+}
+
+static int gemdosTgetdate(unsigned int sp)
+{
+    unsigned int dosTime;
+    unsigned int dosDate;
+
+    toDosTime(time(NULL), &dosTime, &dosDate);
+    return dosDate;
+}
+
+static int gemdosTgettime(unsigned int sp)
+{
+    unsigned int dosTime;
+    unsigned int dosDate;
+
+    toDosTime(time(NULL), &dosTime, &dosDate);
+    return dosTime;
+}
+
+static int gemdosFgetdta(unsigned int sp)
+{
+    return currentDta;
+}
+
+static int gemdosSversion(unsigned int sp)
+{
+    return 0x1900;
+}
+
+static int gemdosPtermres(unsigned int sp)
+{
+    return terminate((short)ARG_W(6), ARG_L(2));
+}
+
+static int gemdosDfree(unsigned int sp)
+{
+    unsigned int buf = ARG_L(2);
+    unsigned int drive = ARG_W(6);
+    struct statvfs vfs;
+    unsigned long clusterSectors;
+
+    drive = drive == 0 ? (unsigned int)currentDrive : drive - 1;
+    if (drive >= NUM_DRIVES || driveRoot[drive] == NULL)
+        return TOS_EDRIVE;
+    if (statvfs(driveRoot[drive][0] ? driveRoot[drive] : "/", &vfs) != 0)
+        return errnoToGemdos(errno);
+
+    clusterSectors = vfs.f_frsize >= 512 ? vfs.f_frsize / 512 : 1;
+    m68k_write_memory_32(buf + 0, vfs.f_bavail > 0x7fffffff ? 0x7fffffff : vfs.f_bavail);
+    m68k_write_memory_32(buf + 4, vfs.f_blocks > 0x7fffffff ? 0x7fffffff : vfs.f_blocks);
+    m68k_write_memory_32(buf + 8, 512);
+    m68k_write_memory_32(buf + 12, clusterSectors);
+    return TOS_E_OK;
+}
+
+static int gemdosDcreate(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    char marker[PATH_MAX + sizeof(OPAQUE_NAME)];
+    struct stat st;
+    long whiteout;
+    int fd;
+    int ret;
+
+    if ((ret = resolveGuestPath(ARG_L(2), hostPath)) < 0)
+        return ret;
+    if (archiveForPath(hostPath, NULL) != NULL)
+        return TOS_EACCDN;
+    dirCacheInvalidate(hostPath);
+    if (lstat(hostPath, &st) == 0)
+        return TOS_EACCDN;
+    if ((whiteout = overlayPrepareCreate(hostPath)) < 0)
+        return whiteout;
+    if (mkdir(hostPath, 0777) != 0)
+        return errnoToGemdos(errno);
+
+    // The new directory must not show the contents of the deleted one
+    if (whiteout && snprintf(marker, sizeof(marker), "%s/" OPAQUE_NAME, hostPath) < (int)sizeof(marker)
+        && (fd = open(marker, O_WRONLY | O_CREAT, 0666)) >= 0)
+        close(fd);
+
+    return TOS_E_OK;
+}
+
+static int gemdosDdelete(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    char key[PATH_MAX];
+    const char* rest;
+    int lower;
+    int ret;
+
+    if ((ret = resolveGuestPath(ARG_L(2), hostPath)) < 0)
+        return ret;
+    if (archiveForPath(hostPath, NULL) != NULL)
+        return TOS_EACCDN;
+    dirKey(hostPath, key, 0);
+    dirCacheDrop(key);
+    if (overlayForPath(hostPath, &rest, &lower) >= 0)
+        return overlayRemove(hostPath, 1);
+    dirCacheInvalidate(hostPath);
+    return rmdir(hostPath) == 0 ? TOS_E_OK : errnoToGemdos(errno);
+}
+
+static int gemdosDsetpath(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    struct stat st;
+    int ret;
+    char tosPath[PATH_MAX];
+    char relPath[PATH_MAX];
+    int drive;
+
+    readGuestString(ARG_L(2), tosPath, sizeof(tosPath));
+    if ((ret = resolvePath(tosPath, hostPath, &drive, relPath)) < 0)
+        return ret;
+    if (driveArchive[drive] != NULL)
+    {
+        const ArchiveEntry* entry = archiveFind(driveArchive[drive], relPath[0] == '/' ? relPath + 1 : relPath);
+        if (entry == NULL || !entry->isDir)
+            return TOS_EPTHNF;
+    }
+    else if (stat(hostPath, &st) != 0 || !S_ISDIR(st.st_mode))
+        return TOS_EPTHNF;
+
+    strcpy(currentPath[drive], relPath);
+    return TOS_E_OK;
+}
+
+// Allocate a handle for a file opened by name
+static int newFileHandle(int fd, const char* hostPath)
+{
+    char key[PATH_MAX];
+    int handle = newHandle(fd);
+
+    if (handle >= 0)
+    {
+        dirKey(hostPath, key, 1);
+        handleDir[handle] = strdup(key);
+        ramDiskOpened(handle, hostPath);
+    }
+
+    return handle;
+}
+
+static int gemdosFcreate(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    int ret;
+    int fd;
+
+    if ((ret = resolveGuestPath(ARG_L(2), hostPath)) < 0)
+        return ret;
+    if (archiveForPath(hostPath, NULL) != NULL)
+        return TOS_EACCDN;
+    dirCacheInvalidate(hostPath);
+    if ((ret = overlayPrepareCreate(hostPath)) < 0)
+        return ret;
+    ramDiskRemoving(hostPath);
+    fd = open(hostPath, O_RDWR | O_CREAT | O_TRUNC, (ARG_W(6) & FA_RDONLY) ? 0444 : 0666);
+    return fd < 0 ? errnoToGemdos(errno) : newFileHandle(fd, hostPath);
+}
+
+// Open a file in an archive. The handle gets a descriptor of /dev/null, so
+// closing and redirecting it works like for the host files.
+static int openArchiveFile(Archive* archive, const char* inside, unsigned int mode)
+{
+    const ArchiveEntry* entry = archiveFind(archive, inside);
+    const unsigned char* data;
+    int handle;
+    int fd;
+
+    if (entry == NULL || entry->isDir)
+        return TOS_EFILNF;
+    if ((mode & 3) != 0)
+        return TOS_EACCDN;
+
+    data = archiveData(archive, entry);
+    if (data == NULL)
+        return TOS_ERROR;
+
+    fd = open("/dev/null", O_RDONLY);
+    handle = fd < 0 ? errnoToGemdos(errno) : newHandle(fd);
+    if (handle < 0)
+    {
+        archiveRelease(archive, entry);
+        return handle;
+    }
+
+    archiveFiles[handle].archive = archive;
+    archiveFiles[handle].entry = entry;
+    archiveFiles[handle].data = data;
+    archiveFiles[handle].pos = 0;
+    return handle;
+}
+
+static int gemdosFopen(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    int ret;
+    int fd;
+    static const int modes[] = { O_RDONLY, O_WRONLY, O_RDWR, O_RDWR };
+    Archive* archive;
+    const char* inside;
+
+    if ((ret = resolveGuestPath(ARG_L(2), hostPath)) < 0)
+        return ret;
+    if ((archive = archiveForPath(hostPath, &inside)) != NULL)
+        return openArchiveFile(archive, inside, ARG_W(6));
+    if ((ARG_W(6) & 3) != 0 && (ret = overlayCopyUp(hostPath)) < 0)
+        return ret;
+    fd = open(hostPath, modes[ARG_W(6) & 3]);
+    return fd < 0 ? errnoToGemdos(errno) : newFileHandle(fd, hostPath);
+}
+
+static int gemdosFclose(unsigned int sp)
+{
+    int handle = (short)ARG_W(2);
+
+    if (handle < 0)
+        return TOS_E_OK;
+    if (handle >= MAX_HANDLES || handleFd[handle] < 0)
+        return TOS_EIHNDL;
+
+    return closeHandle(handle);
+}
+
+static int gemdosFread(unsigned int sp)
+{
+    unsigned short args[6];
+    unsigned int count;
+    unsigned int buf;
+    ArchiveFile* af;
+    ssize_t n;
+    int fd;
+
+    m68k_read_args(sp, args, 6);
+    fd = handleToFd((short)args[1], 0);
+    count = M68K_ARG_L(args, 2);
+    buf = M68K_ARG_L(args, 4);
+
+    if (fd < 0)
+        return TOS_EIHNDL;
+    if (!linuxIsRam(buf, count))
+        return TOS_ERANGE;
+
+    // Straight from the archive
+    if ((af = archiveFile((short)args[1])) != NULL)
+    {
+        n = af->entry->size - af->pos;
+        if ((size_t)n > count)
+            n = count;
+        memcpy(m68k_host_ptr(buf), af->data + af->pos, n);
+        af->pos += n;
+        return n;
+    }
+
+    // The data written through other handles on the file too
+    linuxConsoleFlush();
+    if (writeBehindFlush((short)args[1]) < 0)
+        return errnoToGemdos(errno);
+    writeBehindFlushAll();
+#if M68K_EMULATE_WATCHPOINTS
+    m68k_watch_host_access(buf, count, M68K_WATCH_WRITE);
+#endif
+    n = readAheadRead((short)args[1], fd, m68k_host_ptr(buf), count);
+    if (n > 0 && (short)args[1] >= 0 && (short)args[1] < MAX_HANDLES && ramFiles[(short)args[1]].path != NULL)
+        ramDiskRead += n;
+    return n < 0 ? errnoToGemdos(errno) : n;
+}
+
+static int gemdosFwrite(unsigned int sp)
+{
+    unsigned short args[6];
+    unsigned int count;
+    unsigned int buf;
+    ssize_t n;
+    int fd;
+
+    m68k_read_args(sp, args, 6);
+    fd = handleToFd((short)args[1], 1);
+    count = M68K_ARG_L(args, 2);
+    buf = M68K_ARG_L(args, 4);
+
+    if (fd < 0)
+        return TOS_EIHNDL;
+    if (!linuxIsRam(buf, count))
+        return TOS_ERANGE;
+
+    if (archiveFile((short)args[1]) != NULL)
+        return TOS_EACCDN;
+
+    linuxConsoleFlush();
+    readAheadDrop((short)args[1]);
+    readAheadDropOthers((short)args[1], fd);
+    if ((short)args[1] >= 0 && (short)args[1] < MAX_HANDLES && handleDir[(short)args[1]] != NULL)
+        dirCacheDrop(handleDir[(short)args[1]]);
+#if M68K_EMULATE_WATCHPOINTS
+    m68k_watch_host_access(buf, count, M68K_WATCH_READ);
+#endif
+    n = writeBehindWrite((short)args[1], fd, m68k_host_ptr(buf), count);
+    if (n > 0 && (short)args[1] >= 0 && (short)args[1] < MAX_HANDLES && ramFiles[(short)args[1]].path != NULL)
+    {
+        ramDiskWritten += n;
+        if (writeBehind[(short)args[1]].length == 0 && ramDiskWrote((short)args[1]) < 0)
+            return errnoToGemdos(errno);
+    }
+    return n < 0 ? errnoToGemdos(errno) : n;
+}
+
+static int gemdosFdelete(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    const char* rest;
+    int lower;
+    int ret;
+
+    if ((ret = resolveGuestPath(ARG_L(2), hostPath)) < 0)
+        return ret;
+    if (archiveForPath(hostPath, NULL) != NULL)
+        return TOS_EACCDN;
+    if (overlayForPath(hostPath, &rest, &lower) >= 0)
+        return overlayRemove(hostPath, 0);
+    dirCacheInvalidate(hostPath);
+    ramDiskRemoving(hostPath);
+    return unlink(hostPath) == 0 ? TOS_E_OK : errnoToGemdos(errno);
+}
+
+static int gemdosFseek(unsigned int sp)
+{
+    int fd;
+    static const int whence[] = { SEEK_SET, SEEK_CUR, SEEK_END };
+    int handle = (short)ARG_W(6);
+    unsigned int mode = ARG_W(8);
+    ArchiveFile* af;
+    off_t pos;
+
+    fd = handleToFd(handle, 0);
+    if (fd < 0)
+        return TOS_EIHNDL;
+    if (mode > 2)
+        return TOS_ERANGE;
+
+    if ((af = archiveFile(handle)) != NULL)
+    {
+        long base = mode == 0 ? 0 : mode == 1 ? (long)af->pos : (long)af->entry->size;
+
+        pos = base + (int)ARG_L(2);
+        if (pos < 0 || pos > af->entry->size)
+            return TOS_ERANGE;
+        af->pos = pos;
+        return pos;
+    }
+
+    if (writeBehindFlush(handle) < 0)
+        return errnoToGemdos(errno);
+    writeBehindFlushAll();
+
+    pos = readAheadSeek(handle, (int)ARG_L(2), whence[mode]);
+    if (pos >= 0)
+        return pos;
+
+    readAheadDrop(handle);
+    pos = lseek(fd, (int)ARG_L(2), whence[mode]);
+    return pos < 0 ? TOS_ERANGE : pos;
+}
+
+static int gemdosFattrib(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    struct stat st;
+    int ret;
+    unsigned int attr = ARG_W(8);
+    Archive* archive;
+    const char* inside;
+
+    if ((ret = resolveGuestPath(ARG_L(2), hostPath)) < 0)
+        return ret;
+
+    if ((archive = archiveForPath(hostPath, &inside)) != NULL)
+    {
+        const ArchiveEntry* entry = archiveFind(archive, inside);
+
+        if (entry == NULL)
+            return TOS_EFILNF;
+        if (ARG_W(6) != 0)
+            return TOS_EACCDN;
+        return FA_RDONLY | (entry->isDir ? FA_DIR : 0);
+    }
+
+    if (stat(hostPath, &st) != 0)
+        return errnoToGemdos(errno);
+
+    if (ARG_W(6) == 0)
+        return fileAttributes(&st);
+
+    dirCacheInvalidate(hostPath);
+    if ((ret = overlayCopyUp(hostPath)) < 0)
+        return ret;
+
+    if (attr & FA_RDONLY)
+        st.st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+    else
+        st.st_mode |= S_IWUSR;
+
+    return chmod(hostPath, st.st_mode & 07777) == 0 ? (int)attr : errnoToGemdos(errno);
+}
+
+// Malloc() and Mxalloc()
+static int gemdosMalloc(unsigned int sp)
+{
+    unsigned int size = ARG_L(2);
+    int mode = ARG_W(0) == 0x44 ? ARG_W(6) & 3 : HEAP_ANY;
+
+    if (size == 0xffffffff)
+        return heapLargest(mode);
+
+    return heapAlloc(size, mode);
+}
+
+static int gemdosFdup(unsigned int sp)
+{
+    int fd;
+    int handle = (short)ARG_W(2);
+    int copy;
+
+    if (handle < 0 || handle >= NUM_STD_HANDLES || handleFd[handle] < 0)
+        return TOS_EIHNDL;
+
+    fd = dup(handleFd[handle]);
+    if (fd < 0)
+        return errnoToGemdos(errno);
+
+    // The copy shares the file offset of the standard handle
+    copy = newHandle(fd);
+    if (copy >= 0)
+    {
+        readAhead[copy].disabled = 1;
+        writeBehind[copy].disabled = 1;
+    }
+    return copy;
+}
+
+static int gemdosFforce(unsigned int sp)
+{
+    int fd;
+    int handle = (short)ARG_W(2);
+
+    if (handle < 0 || handle >= NUM_STD_HANDLES || archiveFile((short)ARG_W(4)) != NULL)
+        return TOS_EIHNDL;
+    fd = handleToFd((short)ARG_W(4), handle == 1);
+    if (fd < 0 || (fd = dup(fd)) < 0)
+        return TOS_EIHNDL;
+
+    // Both handles now share the file offset
+    if ((short)ARG_W(4) >= NUM_STD_HANDLES && (short)ARG_W(4) < MAX_HANDLES)
+    {
+        readAheadDrop((short)ARG_W(4));
+        readAhead[(short)ARG_W(4)].disabled = 1;
+        writeBehindFlush((short)ARG_W(4));
+        writeBehind[(short)ARG_W(4)].disabled = 1;
+    }
+
+    if (handle == 1)
+        linuxConsoleFlush();
+    if (handleFd[handle] > 2)
+        close(handleFd[handle]);
+    handleFd[handle] = fd;
+    handleOwner[handle] = processCurrent();
+
+    free(handleDir[handle]);
+    handleDir[handle] = NULL;
+    if ((short)ARG_W(4) >= 0 && (short)ARG_W(4) < MAX_HANDLES && handleDir[(short)ARG_W(4)] != NULL)
+        handleDir[handle] = strdup(handleDir[(short)ARG_W(4)]);
+    return TOS_E_OK;
+}
+
+static int gemdosDgetpath(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    unsigned int buf = ARG_L(2);
+    unsigned int drive = ARG_W(6);
+    char* p;
+
+    drive = drive == 0 ? (unsigned int)currentDrive : drive - 1;
+    if (drive >= NUM_DRIVES || driveRoot[drive] == NULL)
+        return TOS_EDRIVE;
+
+    strcpy(hostPath, currentPath[drive]);
+    for (p = hostPath; *p != '\0'; ++p)
+    {
+        if (*p == '/')
+            *p = '\\';
+    }
+    writeGuestString(buf, hostPath);
+    return TOS_E_OK;
+}
+
+static int gemdosMfree(unsigned int sp)
+{
+    return heapFree(ARG_L(2));
+}
+
+static int gemdosMshrink(unsigned int sp)
+{
+    return heapShrink(ARG_L(4), ARG_L(8));
+}
+
+// The child runs on the emulated CPU
+static int gemdosPexec(unsigned int sp)
+{
+    unsigned int mode = ARG_W(2);
+    char hostPath[PATH_MAX] = "";
+    long ret;
+
+    if (mode == PEXEC_LOADGO || mode == PEXEC_LOAD)
+    {
+        if ((ret = resolveGuestPath(ARG_L(4), hostPath)) < 0)
+            return ret;
+    }
+
+    return processExec(mode, hostPath, ARG_L(8), ARG_L(12));
+}
+
+static int gemdosPterm(unsigned int sp)
+{
+    return terminate((short)ARG_W(2), -1);
+}
+
+static int gemdosFrename(unsigned int sp)
+{
+    char hostPath[PATH_MAX];
+    char hostPath2[PATH_MAX];
+    struct stat st;
+    const char* rest;
+    int lower;
+    int drive;
+    int ret;
+
+    if ((ret = resolveGuestPath(ARG_L(4), hostPath)) < 0
+        || (ret = resolveGuestPath(ARG_L(8), hostPath2)) < 0)
+        return ret;
+    if (archiveForPath(hostPath, NULL) != NULL || archiveForPath(hostPath2, NULL) != NULL)
+        return TOS_EACCDN;
+    dirCacheInvalidate(hostPath);
+    dirCacheInvalidate(hostPath2);
+
+    drive = overlayForPath(hostPath, &rest, &lower);
+    if (drive < 0 && overlayForPath(hostPath2, &rest, &lower) < 0)
+        return rename(hostPath, hostPath2) == 0 ? TOS_E_OK : errnoToGemdos(errno);
+
+    // The lower directories would have to be copied up with their contents
+    if (drive >= 0 && lower && stat(hostPath, &st) == 0 && S_ISDIR(st.st_mode))
+        return TOS_EACCDN;
+    if ((ret = overlayCopyUp(hostPath)) < 0 || (ret = overlayPrepareCreate(hostPath2)) < 0)
+        return ret;
+    if (rename(hostPath, hostPath2) != 0)
+        return errnoToGemdos(errno);
+
+    // The source name must not show the lower file again
+    if (drive >= 0)
+    {
+        overlayForPath(hostPath, &rest, &lower);
+        return overlayWhiteout(drive, rest);
+    }
+
+    return TOS_E_OK;
+}
+
+static int gemdosFdatime(unsigned int sp)
+{
+    struct stat st;
+    int fd;
+    unsigned int timeptr = ARG_L(2);
+    unsigned int dosTime;
+    unsigned int dosDate;
+    ArchiveFile* af;
+
+    fd = handleToFd((short)ARG_W(6), 0);
+    if (fd < 0)
+        return TOS_EIHNDL;
+
+    if ((af = archiveFile((short)ARG_W(6))) != NULL)
+    {
+        if (ARG_W(8) != 0)
+            return TOS_EACCDN;
+        toDosTime(af->entry->mtime, &dosTime, &dosDate);
+        m68k_write_memory_16(timeptr, dosTime);
+        m68k_write_memory_16(timeptr + 2, dosDate);
+        return TOS_E_OK;
+    }
+
+    // The pending data would change the modification time
+    if (writeBehindFlush((short)ARG_W(6)) < 0)
+        return errnoToGemdos(errno);
+
+    if (ARG_W(8) == 0)
+    {
+        if (fstat(fd, &st) != 0)
+            return errnoToGemdos(errno);
+        toDosTime(st.st_mtime, &dosTime, &dosDate);
+        m68k_write_memory_16(timeptr, dosTime);
+        m68k_write_memory_16(timeptr + 2, dosDate);
+    }
+    else
+    {
+        struct timespec times[2];
+
+        times[0].tv_sec = times[1].tv_sec = fromDosTime(m68k_read_memory_16(timeptr), m68k_read_memory_16(timeptr + 2));
+        times[0].tv_nsec = times[1].tv_nsec = 0;
+        if ((short)ARG_W(6) >= 0 && handleDir[(short)ARG_W(6)] != NULL)
+        {
+            const char* rest;
+            int lower;
+
+            // A lower file opened for reading is never copied up
+            if (overlayForPath(handleDir[(short)ARG_W(6)], &rest, &lower) >= 0 && lower)
+                return TOS_EACCDN;
+            dirCacheDrop(handleDir[(short)ARG_W(6)]);
+        }
+        if (futimens(fd, times) != 0)
+            return errnoToGemdos(errno);
+    }
+    return TOS_E_OK;
+}
+
+static int biosBconstat(unsigned int sp)
+{
+    return consoleStatus();
+}
+
+static int biosBconin(unsigned int sp)
+{
+    return consoleIn();
+}
+
+static int biosBconout(unsigned int sp)
+{
+    consoleOut(ARG_W(4));
+    return TOS_E_OK;
+}
+
+static int biosSetexc(unsigned int sp)
+{
+    unsigned int vector = ARG_W(2) * 4;
+    unsigned int address = ARG_L(4);
+    unsigned int old;
+
+    if (vector >= 0x400)
+        return TOS_ERANGE;
+
+    old = m68k_read_memory_32(vector);
+    if (address != 0xffffffff)
+        m68k_write_memory_32(vector, address);
+    return old;
+}
+
+static int biosTickcal(unsigned int sp)
+{
+    return 20;
+}
+
+static int biosBcostat(unsigned int sp)
+{
+    return -1;
+}
+
+static int biosMediach(unsigned int sp)
+{
+    return 0;
+}
+
+static int biosDrvmap(unsigned int sp)
+{
+    return driveMap();
+}
+
+static int biosKbshift(unsigned int sp)
+{
+    return 0;
+}
+
+static int xbiosRandom(unsigned int sp)
+{
+    return rand() & 0xffffff;
+}
+
+static int xbiosCursconf(unsigned int sp)
+{
+    return 0;
+}
+
+static int xbiosGettime(unsigned int sp)
+{
+    unsigned int dosTime;
+    unsigned int dosDate;
+
+    toDosTime(time(NULL), &dosTime, &dosDate);
+    return (dosDate << 16) | dosTime;
+}
+
+static int xbiosVsync(unsigned int sp)
+{
+    return TOS_E_OK;
+}
+
+static int xbiosSupexec(unsigned int sp)
+{
+    unsigned int* regs = m68k_get_reg_file();
+
+    // Call the routine on the emulated CPU, it will return with rts.
+    // There is no memory protection, so supervisor mode is not needed.
+    sp -= 4;
+    m68k_write_memory_32(sp, m68k_get_reg(NULL, M68K_REG_PC));
+    regs[M68K_REG_A7] = sp;
+    m68k_set_reg(M68K_REG_PC, m68k_read_memory_32(sp + 6));
+
+    // Leave D0 unchanged
+    return regs[M68K_REG_D0];
+}
+
+typedef struct
+{
+    unsigned short function;
+    int (*callback)(unsigned int sp);
+} OsCall;
+
+static const OsCall gemdosCalls[] =
+{
+    { 0x00, gemdosPterm0 },
+    { 0x01, gemdosCconin },
+    { 0x02, gemdosCconout },
+    { 0x06, gemdosCrawio },
+    { 0x07, gemdosCconin },
+    { 0x08, gemdosCconin },
+    { 0x09, gemdosCconws },
+    { 0x0a, gemdosCconrs },
+    { 0x0b, gemdosCconis },
+    { 0x0e, gemdosDsetdrv },
+    { 0x10, gemdosCconos },
+    { 0x19, gemdosDgetdrv },
+    { 0x1a, gemdosFsetdta },
+    { 0x20, gemdosSuper },
+    { 0x2a, gemdosTgetdate },
+    { 0x2c, gemdosTgettime },
+    { 0x2f, gemdosFgetdta },
+    { 0x30, gemdosSversion },
+    { 0x31, gemdosPtermres },
+    { 0x36, gemdosDfree },
+    { 0x39, gemdosDcreate },
+    { 0x3a, gemdosDdelete },
+    { 0x3b, gemdosDsetpath },
+    { 0x3c, gemdosFcreate },
+    { 0x3d, gemdosFopen },
+    { 0x3e, gemdosFclose },
+    { 0x3f, gemdosFread },
+    { 0x40, gemdosFwrite },
+    { 0x41, gemdosFdelete },
+    { 0x42, gemdosFseek },
+    { 0x43, gemdosFattrib },
+    { 0x44, gemdosMalloc },
+    { 0x45, gemdosFdup },
+    { 0x46, gemdosFforce },
+    { 0x47, gemdosDgetpath },
+    { 0x48, gemdosMalloc },
+    { 0x49, gemdosMfree },
+    { 0x4a, gemdosMshrink },
+    { 0x4b, gemdosPexec },
+    { 0x4c, gemdosPterm },
+    { 0x4e, gemdosFsfirst },
+    { 0x4f, gemdosFsnext },
+    { 0x56, gemdosFrename },
+    { 0x57, gemdosFdatime },
+};
+
+static const OsCall biosCalls[] =
+{
+    { 0x01, biosBconstat },
+    { 0x02, biosBconin },
+    { 0x03, biosBconout },
+    { 0x05, biosSetexc },
+    { 0x06, biosTickcal },
+    { 0x08, biosBcostat },
+    { 0x09, biosMediach },
+    { 0x0a, biosDrvmap },
+    { 0x0b, biosKbshift },
+};
+
+static const OsCall xbiosCalls[] =
+{
+    { 0x11, xbiosRandom },
+    { 0x15, xbiosCursconf },
+    { 0x17, xbiosGettime },
+    { 0x25, xbiosVsync },
+    { 0x26, xbiosSupexec },
+};
+
+// Calls without a registered callback end up here
+static void gemdosUnsupported(void)
+{
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned int sp = regs[M68K_REG_A7];
+
+    regs[M68K_REG_D0] = unsupported(OS_GEMDOS, ARG_W(0));
+}
+
+static void gemUnsupported(void)
+{
+    unsigned int d0 = m68k_get_reg_file()[M68K_REG_D0];
+
+    // d0 = -2 only checks if the GEM is installed: it is not
+    if ((d0 & 0xffff) != 0xfffe)
+        unsupported(OS_GEM, d0 & 0xff);
+}
+
+static void biosUnsupported(void)
+{
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned int sp = regs[M68K_REG_A7];
+
+    regs[M68K_REG_D0] = unsupported(OS_BIOS, ARG_W(0));
+}
+
+static void xbiosUnsupported(void)
+{
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned int sp = regs[M68K_REG_A7];
+
+    regs[M68K_REG_D0] = unsupported(OS_XBIOS, ARG_W(0));
+}
+
+static void installOsCalls(unsigned int trap, const OsCall* calls, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; ++i)
+        m68k_set_os_call_callback(trap, calls[i].function, calls[i].callback);
+}
+
+void m68ki_hook_linea()
+{
+    unsigned int pc = m68k_get_reg(NULL, M68K_REG_PC);
+    unsigned int* regs = m68k_get_reg_file();
+
+    unsupported(OS_LINEA, m68k_read_memory_16(pc - 2) & 0x000f);
+
+    regs[M68K_REG_D0] = 0;
+    regs[M68K_REG_A0] = 0;
+    regs[M68K_REG_A1] = 0;
+    regs[M68K_REG_A2] = 0;
+}
+
+/* ------------------------------------------------------------------------ */
+/* Initialization                                                           */
+/* ------------------------------------------------------------------------ */
+
+int linuxChdir(const char* path)
+{
+    char cwd[PATH_MAX];
+
+    if (chdir(path) != 0 || getcwd(cwd, sizeof(cwd)) == NULL)
+        return -1;
+
+    currentDrive = DRIVE_C;
+    strcpy(currentPath[DRIVE_C], strcmp(cwd, "/") != 0 ? cwd : "");
+    return 0;
+}
+
+int linuxInit(void)
+{
+    // Reserve the whole 32-bit address space, so stray guest accesses
+    // fault instead of corrupting the host memory
+    void* base = mmap(NULL, 0x100000000UL + 4096, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    char cwd[PATH_MAX];
+    int i;
+
+    if (base == MAP_FAILED)
+        return -1;
+
+    if (mprotect(base, LINUX_RAM_SIZE, PROT_READ | PROT_WRITE) != 0)
+        return -1;
+
+    m68k_memory_base = base;
+    heapAddArena(LINUX_TPA_START, LINUX_ST_RAM_END - LINUX_TPA_START, 0);
+    heapAddArena(HEAP_TT_RAM_START, LINUX_RAM_SIZE - HEAP_TT_RAM_START, 0);
+
+    for (i = 0; i < MAX_HANDLES; ++i)
+        handleFd[i] = i < NUM_STD_HANDLES ? defaultFd[i] : -1;
+
+    driveRoot[DRIVE_C] = "";
+    if (getcwd(cwd, sizeof(cwd)) != NULL && strcmp(cwd, "/") != 0)
+        strcpy(currentPath[DRIVE_C], cwd);
+
+    m68k_set_trap_callback(1, gemdosUnsupported);
+    m68k_set_trap_callback(2, gemUnsupported);
+    m68k_set_trap_callback(13, biosUnsupported);
+    m68k_set_trap_callback(14, xbiosUnsupported);
+    installOsCalls(1, gemdosCalls, sizeof(gemdosCalls) / sizeof(gemdosCalls[0]));
+    installOsCalls(13, biosCalls, sizeof(biosCalls) / sizeof(biosCalls[0]));
+    installOsCalls(14, xbiosCalls, sizeof(xbiosCalls) / sizeof(xbiosCalls[0]));
+
+    atexit(reportUnsupported);
+    atexit(linuxConsoleFlush);
+    atexit(writeBehindFlushAll);
+
+    return 0;
+}
@@ -0,0 +1,78 @@
+/*
+  linuxos.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_LINUXOS_H__
+#define __INC_LINUXOS_H__
+
+// Guest memory layout
+#define LINUX_RAM_SIZE   0x10000000UL // 256 MB, starting at address 0
+#define LINUX_SSP        0x00008800   // Top of the supervisor stack
+#define LINUX_TPA_START  0x00010000   // Start of the memory managed by Malloc()
+#define LINUX_ST_RAM_END 0x00e00000   // End of the ST RAM, the TT RAM starts at HEAP_TT_RAM_START
+
+// Map the guest memory and initialize the emulated OS.
+// Returns 0 on success, -1 on error.
+int linuxInit(void);
+
+// Change the host working directory, which is the current path of C:.
+// Returns 0 on success, -1 on error.
+int linuxChdir(const char* path);
+
+// Load a TOS program from a host path, like Pexec(PE_LOAD).
+// Returns the guest address of the basepage, or a negative GEMDOS error.
+long linuxLoadProgram(const char* path, const char* tail);
+
+// Replace the command tail and the environment of a loaded program, which
+// has not started yet, with the current environment of the host.
+// Returns 0 on success, -1 on error.
+int linuxSetArguments(unsigned int bp, const char* tail);
+
+// Free the memory of a loaded program, which has not started yet.
+void linuxUnloadProgram(unsigned int bp);
+
+// Write the buffered console output.
+void linuxConsoleFlush(void);
+
+// Returns nonzero if the guest range is backed by RAM.
+int linuxIsRam(unsigned int address, unsigned int length);
+
+// Create a RAM disk as the drive number (0 for A:), limited to size bytes,
+// or to a default size if 0. Must be called before running the program.
+// Returns 0 on success, -1 on error.
+int linuxRamDisk(int drive, unsigned long size);
+
+// Mount a ZIP or tar archive as a read-only drive number (0 for A:).
+// Must be called before running the program.
+// Returns 0 on success, -1 on error.
+int linuxArchiveDrive(int drive, const char* path);
+
+// Mount a directory as a copy-on-write drive number (0 for A:). The changes
+// go to the upper directory, or to a private RAM directory if upper is NULL,
+// and the lower directory is never modified.
+// Must be called before running the program.
+// Returns 0 on success, -1 on error.
+int linuxOverlayDrive(int drive, const char* lower, const char* upper);
+
+// Give the RAM disk and the overlay drives without an upper directory new,
+// empty directories, owned by the calling process. Called by the forked
+// jobs of the job server, so that they don't share their temporary files.
+// Returns 0 on success, -1 on error.
+int linuxPrivateTemp(void);
+
+// Print the RAM disk statistics, if there is a RAM disk.
+void linuxRamDiskReport(void);
+
+#endif /* __INC_LINUXOS_H__ */
@@ -18,6 +18,110 @@
 #ifndef __INC_M68KINL_H__
 #define __INC_M68KINL_H__
 
+/* m68k_read_args() reads the argument block of an OS call in one go, as
+ * words in host byte order. A long argument spans two words: join them
+ * with M68K_ARG_L().
+ */
+#define M68K_ARG_L(args, i) (((unsigned int)(args)[i] << 16) | (args)[(i) + 1])
+
+#ifdef HOST_LINUX
+
+#include <string.h>
+
+/* The guest memory is a block of host memory, in big-endian byte order */
+extern unsigned char* m68k_memory_base;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define M68K_BE16(x) __builtin_bswap16(x)
+#define M68K_BE32(x) __builtin_bswap32(x)
+#else
+#define M68K_BE16(x) (x)
+#define M68K_BE32(x) (x)
+#endif
+
+INLINE void* m68k_host_ptr(unsigned int address)
+{
+	return m68k_memory_base + address;
+}
+
+INLINE unsigned int m68k_guest_addr(const void* ptr)
+{
+	return (unsigned int)((const unsigned char*)ptr - m68k_memory_base);
+}
+
+INLINE unsigned int m68k_read_memory_8(unsigned int address)
+{
+	return m68k_memory_base[address];
+}
+
+INLINE unsigned int m68k_read_memory_16(unsigned int address)
+{
+	unsigned short value;
+	memcpy(&value, m68k_memory_base + address, sizeof(value));
+	return M68K_BE16(value);
+}
+
+INLINE unsigned int m68k_read_memory_32(unsigned int address)
+{
+	unsigned int value;
+	memcpy(&value, m68k_memory_base + address, sizeof(value));
+	return M68K_BE32(value);
+}
+
+INLINE unsigned int m68k_read_disassembler_8(unsigned int address)
+{
+	return m68k_read_memory_8(address);
+}
+
+INLINE unsigned int m68k_read_disassembler_16 (unsigned int address)
+{
+	return m68k_read_memory_16(address);
+}
+
+INLINE unsigned int m68k_read_disassembler_32 (unsigned int address)
+{
+	return m68k_read_memory_32(address);
+}
+
+INLINE void m68k_write_memory_8(unsigned int address, unsigned int value)
+{
+	m68k_memory_base[address] = (unsigned char)value;
+}
+
+INLINE void m68k_write_memory_16(unsigned int address, unsigned int value)
+{
+	unsigned short be = M68K_BE16((unsigned short)value);
+	memcpy(m68k_memory_base + address, &be, sizeof(be));
+}
+
+INLINE void m68k_write_memory_32(unsigned int address, unsigned int value)
+{
+	unsigned int be = M68K_BE32(value);
+	memcpy(m68k_memory_base + address, &be, sizeof(be));
+}
+
+INLINE void m68k_read_args(unsigned int sp, unsigned short* args, unsigned int count)
+{
+	unsigned int i;
+
+	memcpy(args, m68k_memory_base + sp, count * sizeof(*args));
+	for (i = 0; i < count; ++i)
+		args[i] = M68K_BE16(args[i]);
+}
+
+#else /* HOST_LINUX */
+
+/* The emulated CPU shares the address space of the host */
+INLINE void* m68k_host_ptr(unsigned int address)
+{
+	return (void*)(unsigned long)address;
+}
+
+INLINE unsigned int m68k_guest_addr(const void* ptr)
+{
+	return (unsigned int)(unsigned long)ptr;
+}
+
 INLINE unsigned int m68k_read_memory_8(unsigned int address)
 {
 	return *(unsigned char*)address;
@@ -63,4 +167,15 @@ INLINE void m68k_write_memory_32(unsigned int address, unsigned int value)
 	*(unsigned long*)address = (long)value;
 }
 
+INLINE void m68k_read_args(unsigned int sp, unsigned short* args, unsigned int count)
+{
+	const unsigned short* p = (const unsigned short*)sp;
+	unsigned int i;
+
+	for (i = 0; i < count; ++i)
+		args[i] = p[i];
+}
+
+#endif /* HOST_LINUX */
+
 #endif /* __INC_M68KINL_H__ */
@@ -239,6 +239,105 @@ void m68k_set_fc_callback(void  (*callback)(unsigned int new_fc));
 void m68k_set_instr_hook_callback(void  (*callback)(void));
 
 
+/* Set a callback for the TRAP #n instruction (n = 0-15).
+ * The callback replaces the exception processing: when it returns, the
+ * execution continues after the TRAP instruction.
+ * Default behavior: take the trap exception.
+ */
+void m68k_set_trap_callback(unsigned int trap, void  (*callback)(void));
+
+/* Set a callback for one function of an OS trap, such as GEMDOS, BIOS or
+ * XBIOS, where the function number is the word at the top of the stack.
+ * The callback gets the stack pointer and returns the value of D0.
+ * It takes precedence over the callback of the whole trap.
+ * Returns 0 on success, -1 on error.
+ */
+#define M68K_MAX_OS_CALLS 0x200 /* Function numbers per trap */
+
+int m68k_set_os_call_callback(unsigned int trap, unsigned int function, int  (*callback)(unsigned int sp));
+
+/* Set a callback to observe the OS calls handled by the host, such as for
+ * profiling. It is called with the exception vector before (enter = 1) and
+ * after (enter = 0) the host callback of each TRAP #n or line-A instruction.
+ * Before the call, the CPU registers still hold the arguments.
+ * Default behavior: do nothing.
+ */
+void m68k_set_os_call_hook_callback(void  (*callback)(unsigned int vector, int enter));
+
+
+/* Watchpoints.
+ * You must enable M68K_EMULATE_WATCHPOINTS in m68kconf.h.
+ * Unlike the instruction hook, watchpoints cost nothing per instruction:
+ * the host page containing the range is protected, the first access to it
+ * is trapped, the access is allowed to complete and the timeslice ends
+ * after the current instruction.  The callback is then called from
+ * m68k_execute() (never from the signal handler) and the page is protected
+ * again.
+ * The width of a trapped access is not known, so any access starting up to
+ * 3 bytes before the range is reported too.
+ * Pages holding a read watchpoint are fully protected, so writes to them
+ * are reported as well.
+ * m68k_add_watchpoint() returns 0 on success, or -1 if the table is full
+ * or the page cannot be protected.
+ */
+#define M68K_WATCH_READ  1
+#define M68K_WATCH_WRITE 2
+
+int  m68k_add_watchpoint(unsigned int address, unsigned int size, int type);
+int  m68k_remove_watchpoint(unsigned int address, unsigned int size, int type);
+void m68k_clear_watchpoints(void);
+void m68k_set_watchpoint_callback(void (*callback)(unsigned int address, unsigned int pc, int type));
+
+/* Host accesses to guest memory from system calls, such as read() into a
+ * guest buffer, are not trapped: the system call fails with EFAULT.
+ * Call m68k_watch_host_access() before such a call, with M68K_WATCH_READ
+ * or M68K_WATCH_WRITE as type.  It reports the watchpoints covered by the
+ * range and unprotects their pages until the callback has been called.
+ * Plain host loads and stores, such as with memcpy(), are trapped normally.
+ */
+void m68k_watch_host_access(unsigned int address, unsigned int size, int type);
+
+/* Unprotect the watched pages, so that accesses which are not the guest's,
+ * such as a debugger reading memory, are not reported, then protect them
+ * again.  Do not run the CPU in between.
+ */
+void m68k_suspend_watchpoints(void);
+void m68k_resume_watchpoints(void);
+
+
+/* Breakpoints.
+ * A breakpoint replaces the instruction word at address with a BKPT #0
+ * opcode, whose jump table entry is redirected to a dedicated handler while
+ * breakpoints are set, so execution speed is unaffected.  The original word
+ * is executed transparently when resuming.
+ * When a breakpoint is reached, the PC is left at the breakpoint address,
+ * the callback is called and the current timeslice ends.  Resuming with
+ * m68k_execute() or m68k_step() executes the original instruction, unless
+ * the PC was changed with m68k_set_reg() in the meantime.
+ * Breakpoints must be set after the first m68k_pulse_reset().
+ * m68k_set_breakpoint() returns 0 on success, or -1 if the table is full.
+ */
+int  m68k_set_breakpoint(unsigned int address);
+int  m68k_clear_breakpoint(unsigned int address);
+void m68k_clear_breakpoints(void);
+void m68k_set_breakpoint_callback(void (*callback)(unsigned int address));
+
+/* Execute exactly one instruction, even if a breakpoint is set at the PC.
+ * Returns the number of cycles used.
+ */
+int m68k_step(void);
+
+/* Step over subroutine calls and traps.
+ * Other instructions are single-stepped.  For BSR, JSR and TRAP, a temporary
+ * breakpoint is set on the next instruction and the call is executed.
+ * If the PC is not on the next instruction afterwards, the host keeps
+ * running m68k_execute() until the breakpoint callback reports that
+ * address.  The temporary breakpoint removes itself.
+ * Returns the number of cycles used.
+ */
+int m68k_step_over(void);
+
+
 
 /* ======================================================================== */
 /* ====================== FUNCTIONS TO ACCESS THE CPU ===================== */
@@ -293,6 +392,36 @@ unsigned int m68k_get_context(void* dst);
 /* set the current cpu context */
 void m68k_set_context(void* dst);
 
+/* Instance-based contexts, only available with M68K_MULTI_CONTEXT.
+ * Each host thread runs the CPU selected by m68k_use_context(), and all the
+ * other API functions apply to that CPU.  No state is copied when switching.
+ * The opcode table is shared: call m68k_pulse_reset() once before starting
+ * other threads.  Breakpoints and watchpoints are shared by all the CPUs.
+ * Only the CPU state is per context: the memory, the OS call callbacks and
+ * all the other callbacks are process-global, so the CPUs must run the same
+ * memory map and OS, and the callbacks must be thread-safe.  68Kemu itself
+ * keeps its OS state in globals, so it is built without this option and
+ * runs a single CPU per process.
+ */
+
+/* Allocate a new zeroed CPU context.  Returns NULL if out of memory.
+ * Select it, then call m68k_set_cpu_type() and m68k_pulse_reset().
+ */
+void* m68k_create_context(void);
+
+/* Free a context returned by m68k_create_context().
+ * If the calling thread was using it, it goes back to the default context.
+ */
+void m68k_destroy_context(void* context);
+
+/* Select the CPU context of the calling thread.
+ * NULL selects the default context, which all threads start with.
+ */
+void m68k_use_context(void* context);
+
+/* Get the CPU context of the calling thread */
+void* m68k_current_context(void);
+
 /* Save the current cpu context to disk.
  * You must provide a function pointer of the form:
  * void save_value(char* identifier, unsigned int value)
@@ -316,6 +445,13 @@ unsigned int m68k_get_reg(void* context, m68k_register_t reg);
 /* Poke values into the internals of the currently running CPU context */
 void m68k_set_reg(m68k_register_t reg, unsigned int value);
 
+/* Direct access to the data and address registers of the currently running
+ * CPU context, for hooks which access several registers: index the array
+ * with M68K_REG_D0 to M68K_REG_A7. A7 is the active stack pointer.
+ * The array belongs to the context: get it again after m68k_use_context().
+ */
+unsigned int* m68k_get_reg_file(void);
+
 /* Check if an instruction is valid for the specified CPU type */
 unsigned int m68k_is_valid_instruction(unsigned int instruction, unsigned int cpu_type);
 
@@ -123,6 +123,37 @@
 #define M68K_INSTRUCTION_CALLBACK() your_instruction_hook_function()
 
 
+/* If on, watchpoints can be set with m68k_add_watchpoint().
+ * The host page holding a watched range is protected with mprotect(), so
+ * this requires a host with POSIX memory protection and SIGSEGV reporting
+ * the faulting address.  Accesses to other pages run at full speed.
+ * On by default for the Linux host.
+ */
+#ifndef M68K_EMULATE_WATCHPOINTS
+#ifdef HOST_LINUX
+#define M68K_EMULATE_WATCHPOINTS    OPT_ON
+#else
+#define M68K_EMULATE_WATCHPOINTS    OPT_OFF
+#endif
+#endif /* M68K_EMULATE_WATCHPOINTS */
+
+
+/* If on, the CPU state is reached through a per-thread pointer instead of
+ * a global variable, so several CPUs can run concurrently on different host
+ * threads.  See m68k_create_context() and m68k_use_context().
+ * The memory and the callbacks stay process-global, see m68k.h.  68Kemu
+ * does not use this option.
+ * M68K_THREAD_LOCAL is the compiler's thread-local storage keyword.
+ * This costs a pointer load on every access to the CPU state.
+ */
+#ifndef M68K_MULTI_CONTEXT
+#define M68K_MULTI_CONTEXT          OPT_OFF
+#endif /* M68K_MULTI_CONTEXT */
+#ifndef M68K_THREAD_LOCAL
+#define M68K_THREAD_LOCAL           __thread
+#endif /* M68K_THREAD_LOCAL */
+
+
 /* If on, the CPU will emulate the 4-byte prefetch queue of a real 68000 */
 #define M68K_EMULATE_PREFETCH       OPT_OFF
 
@@ -166,6 +197,16 @@
 #endif /* INLINE */
 
 
+/* Size in bytes of a host data cache line.
+ * The CPU state used by every instruction is aligned on it.
+ * The ColdFire V4e has 16-byte lines, most desktop CPUs have 64-byte lines.
+ * Set it to 0 to disable the alignment.
+ */
+#ifndef M68K_CACHE_LINE_SIZE
+#define M68K_CACHE_LINE_SIZE 16
+#endif /* M68K_CACHE_LINE_SIZE */
+
+
 /* If your environment requires special prefixes for system callback functions
  * such as the argument to qsort(), then set them here or in the makefile.
  */
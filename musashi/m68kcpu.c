@@ -32,6 +32,8 @@ static const char* copyright_notice =
 /* ================================ INCLUDES ============================== */
 /* ======================================================================== */
 
+#include <stdlib.h>
+#include <string.h>
 #include "m68kops.h"
 #include "m68kcpu.h"
 
@@ -39,10 +41,6 @@ static const char* copyright_notice =
 /* ================================= DATA ================================= */
 /* ======================================================================== */
 
-int  m68ki_initial_cycles;
-int  m68ki_remaining_cycles = 0;                     /* Number of clocks remaining */
-uint m68ki_tracing = 0;
-uint m68ki_address_space;
 
 #ifdef M68K_LOG_ENABLE
 char* m68ki_cpu_names[9] =
@@ -60,10 +58,20 @@ char* m68ki_cpu_names[9] =
 #endif /* M68K_LOG_ENABLE */
 
 /* The CPU core */
+#if M68K_MULTI_CONTEXT
+static m68ki_cpu_core m68ki_cpu_default = {0};
+M68KI_THREAD_LOCAL m68ki_cpu_core* m68ki_cpu_p = &m68ki_cpu_default;
+#else
 m68ki_cpu_core m68ki_cpu = {0};
+#endif /* M68K_MULTI_CONTEXT */
+
+/* Host callbacks for the TRAP #n instructions, shared by all the CPUs */
+void (*m68ki_trap_callback[16])(void);
+m68ki_os_call_callback* m68ki_os_call_table[16];
+void (*m68ki_os_call_hook)(unsigned int vector, int enter);
 
 #if M68K_EMULATE_ADDRESS_ERROR
-jmp_buf m68ki_address_error_trap;
+M68KI_THREAD_LOCAL jmp_buf m68ki_address_error_trap;
 #endif /* M68K_EMULATE_ADDRESS_ERROR */
 
 /* Used by shift & rotate instructions */
@@ -466,6 +474,11 @@ unsigned int m68k_get_reg(void* context, m68k_register_t regnum)
 	return 0;
 }
 
+unsigned int* m68k_get_reg_file(void)
+{
+	return REG_DA;
+}
+
 void m68k_set_reg(m68k_register_t regnum, unsigned int value)
 {
 	switch(regnum)
@@ -486,7 +499,9 @@ void m68k_set_reg(m68k_register_t regnum, unsigned int value)
 		case M68K_REG_A5:	REG_A[5] = MASK_OUT_ABOVE_32(value); return;
 		case M68K_REG_A6:	REG_A[6] = MASK_OUT_ABOVE_32(value); return;
 		case M68K_REG_A7:	REG_A[7] = MASK_OUT_ABOVE_32(value); return;
-		case M68K_REG_PC:	m68ki_jump(MASK_OUT_ABOVE_32(value)); return;
+		case M68K_REG_PC:	m68ki_jump(MASK_OUT_ABOVE_32(value));
+							CPU_BKPT_RESUME = BREAKPOINT_NO_RESUME;
+							return;
 		case M68K_REG_SR:	m68ki_set_sr(value); return;
 		case M68K_REG_SP:	REG_SP = MASK_OUT_ABOVE_32(value); return;
 		case M68K_REG_USP:	if(FLAG_S)
@@ -547,6 +562,36 @@ void m68k_set_instr_hook_callback(void  (*callback)(void))
 	CALLBACK_INSTR_HOOK = callback ? callback : default_instr_hook_callback;
 }
 
+void m68k_set_trap_callback(unsigned int trap, void  (*callback)(void))
+{
+	if(trap < 16)
+		m68ki_trap_callback[trap] = callback;
+}
+
+void m68k_set_os_call_hook_callback(void  (*callback)(unsigned int vector, int enter))
+{
+	m68ki_os_call_hook = callback;
+}
+
+int m68k_set_os_call_callback(unsigned int trap, unsigned int function, int  (*callback)(unsigned int sp))
+{
+	if(trap >= 16 || function >= M68K_MAX_OS_CALLS)
+		return -1;
+
+	/* The table of a trap is allocated by its first callback */
+	if(m68ki_os_call_table[trap] == NULL)
+	{
+		if(callback == NULL)
+			return 0;
+		m68ki_os_call_table[trap] = calloc(M68K_MAX_OS_CALLS, sizeof(m68ki_os_call_callback));
+		if(m68ki_os_call_table[trap] == NULL)
+			return -1;
+	}
+
+	m68ki_os_call_table[trap][function] = callback;
+	return 0;
+}
+
 #include <stdio.h>
 /* Set the CPU type. */
 void m68k_set_cpu_type(unsigned int cpu_type)
@@ -620,6 +665,30 @@ void m68k_set_cpu_type(unsigned int cpu_type)
 	}
 }
 
+/* Execute the instruction at PC */
+INLINE void m68ki_execute_instruction(void)
+{
+	/* Set tracing accodring to T1. (T0 is done inside instruction) */
+	m68ki_trace_t1(); /* auto-disable (see m68kcpu.h) */
+
+	/* Set the address space for reads */
+	m68ki_use_data_space(); /* auto-disable (see m68kcpu.h) */
+
+	/* Call external hook to peek at CPU */
+	m68ki_instr_hook(); /* auto-disable (see m68kcpu.h) */
+
+	/* Record previous program counter */
+	REG_PPC = REG_PC;
+
+	/* Read an instruction and call its handler */
+	REG_IR = m68ki_read_imm_16();
+	m68ki_instruction_jump_table[REG_IR]();
+	USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
+
+	/* Trace m68k_exception, if necessary */
+	m68ki_exception_if_trace(); /* auto-disable (see m68kcpu.h) */
+}
+
 /* Execute some instructions until we use up num_cycles clock cycles */
 /* ASG: removed per-instruction interrupt checks */
 int m68k_execute(int num_cycles)
@@ -629,7 +698,7 @@ int m68k_execute(int num_cycles)
 	{
 		/* Set our pool of clock cycles available */
 		SET_CYCLES(num_cycles);
-		m68ki_initial_cycles = num_cycles;
+		CPU_INITIAL_CYCLES = num_cycles;
 
 		/* ASG: update cycles */
 		USE_CYCLES(CPU_INT_CYCLES);
@@ -641,36 +710,21 @@ int m68k_execute(int num_cycles)
 		/* Main loop.  Keep going until we run out of clock cycles */
 		do
 		{
-			/* Set tracing accodring to T1. (T0 is done inside instruction) */
-			m68ki_trace_t1(); /* auto-disable (see m68kcpu.h) */
-
-			/* Set the address space for reads */
-			m68ki_use_data_space(); /* auto-disable (see m68kcpu.h) */
-
-			/* Call external hook to peek at CPU */
-			m68ki_instr_hook(); /* auto-disable (see m68kcpu.h) */
-
-			/* Record previous program counter */
-			REG_PPC = REG_PC;
-
-			/* Read an instruction and call its handler */
-			REG_IR = m68ki_read_imm_16();
-			m68ki_instruction_jump_table[REG_IR]();
-			USE_CYCLES(CYC_INSTRUCTION[REG_IR]);
-
-			/* Trace m68k_exception, if necessary */
-			m68ki_exception_if_trace(); /* auto-disable (see m68kcpu.h) */
+			m68ki_execute_instruction();
 		} while(GET_CYCLES() > 0);
 
 		/* set previous PC to current PC for the next entry into the loop */
 		REG_PPC = REG_PC;
 
+		/* Watchpoint faults end the timeslice, handle them now */
+		m68ki_watch_check(); /* auto-disable (see m68kcpu.h) */
+
 		/* ASG: update cycles */
 		USE_CYCLES(CPU_INT_CYCLES);
 		CPU_INT_CYCLES = 0;
 
 		/* return how many clocks we used */
-		return m68ki_initial_cycles - GET_CYCLES();
+		return CPU_INITIAL_CYCLES - GET_CYCLES();
 	}
 
 	/* We get here if the CPU is stopped or halted */
@@ -681,9 +735,30 @@ int m68k_execute(int num_cycles)
 }
 
 
+/* Execute a single instruction, even if it is a breakpoint */
+int m68k_step(void)
+{
+	if(CPU_STOPPED)
+		return 0;
+
+	SET_CYCLES(0);
+	CPU_INITIAL_CYCLES = 0;
+	CPU_BKPT_RESUME = REG_PC;
+
+	m68ki_set_address_error_trap(); /* auto-disable (see m68kcpu.h) */
+	m68ki_execute_instruction();
+	REG_PPC = REG_PC;
+	CPU_BKPT_RESUME = BREAKPOINT_NO_RESUME;
+
+	m68ki_watch_check(); /* auto-disable (see m68kcpu.h) */
+
+	return CPU_INITIAL_CYCLES - GET_CYCLES();
+}
+
+
 int m68k_cycles_run(void)
 {
-	return m68ki_initial_cycles - GET_CYCLES();
+	return CPU_INITIAL_CYCLES - GET_CYCLES();
 }
 
 int m68k_cycles_remaining(void)
@@ -694,14 +769,14 @@ int m68k_cycles_remaining(void)
 /* Change the timeslice */
 void m68k_modify_timeslice(int cycles)
 {
-	m68ki_initial_cycles += cycles;
+	CPU_INITIAL_CYCLES += cycles;
 	ADD_CYCLES(cycles);
 }
 
 
 void m68k_end_timeslice(void)
 {
-	m68ki_initial_cycles = GET_CYCLES();
+	CPU_INITIAL_CYCLES = GET_CYCLES();
 	SET_CYCLES(0);
 }
 
@@ -750,6 +825,7 @@ void m68k_pulse_reset(void)
 	/* Clear all stop levels and eat up all remaining cycles */
 	CPU_STOPPED = 0;
 	SET_CYCLES(0);
+	CPU_BKPT_RESUME = BREAKPOINT_NO_RESUME;
 
 	/* Turn off tracing */
 	FLAG_T1 = FLAG_T0 = 0;
@@ -792,14 +868,75 @@ unsigned int m68k_context_size()
 
 unsigned int m68k_get_context(void* dst)
 {
-	if(dst) *(m68ki_cpu_core*)dst = m68ki_cpu;
+	/* The buffer may not be as aligned as the CPU state */
+	if(dst) memcpy(dst, &m68ki_cpu, sizeof(m68ki_cpu_core));
 	return sizeof(m68ki_cpu_core);
 }
 
 void m68k_set_context(void* src)
 {
-	if(src) m68ki_cpu = *(m68ki_cpu_core*)src;
+	if(src)
+	{
+		/* The block owning the current context does not change */
+		void* alloc_base = m68ki_cpu.alloc_base;
+		memcpy(&m68ki_cpu, src, sizeof(m68ki_cpu_core));
+		m68ki_cpu.alloc_base = alloc_base;
+	}
+}
+
+#if M68K_MULTI_CONTEXT
+void* m68k_create_context(void)
+{
+	m68ki_cpu_core* previous = m68ki_cpu_p;
+	char* base = malloc(sizeof(m68ki_cpu_core) + M68K_CACHE_LINE_SIZE);
+	m68ki_cpu_core* cpu;
+
+	if(base == NULL)
+		return NULL;
+
+	/* malloc() does not know about the alignment of the hot state */
+	cpu = (m68ki_cpu_core*)base;
+#if M68K_CACHE_LINE_SIZE
+	cpu = (m68ki_cpu_core*)(base + M68K_CACHE_LINE_SIZE - (unsigned long)base % M68K_CACHE_LINE_SIZE);
+#endif
+	memset(cpu, 0, sizeof(m68ki_cpu_core));
+	cpu->alloc_base = base;
+	cpu->breakpoint_resume = BREAKPOINT_NO_RESUME;
+
+	/* Install the default callbacks */
+	m68ki_cpu_p = cpu;
+	m68k_set_int_ack_callback(NULL);
+	m68k_set_bkpt_ack_callback(NULL);
+	m68k_set_reset_instr_callback(NULL);
+	m68k_set_pc_changed_callback(NULL);
+	m68k_set_fc_callback(NULL);
+	m68k_set_instr_hook_callback(NULL);
+	m68ki_cpu_p = previous;
+
+	return cpu;
+}
+
+void m68k_destroy_context(void* context)
+{
+	m68ki_cpu_core* cpu = (m68ki_cpu_core*)context;
+
+	if(cpu == NULL || cpu == &m68ki_cpu_default)
+		return;
+	if(cpu == m68ki_cpu_p)
+		m68ki_cpu_p = &m68ki_cpu_default;
+	free(cpu->alloc_base);
+}
+
+void m68k_use_context(void* context)
+{
+	m68ki_cpu_p = context != NULL ? (m68ki_cpu_core*)context : &m68ki_cpu_default;
+}
+
+void* m68k_current_context(void)
+{
+	return m68ki_cpu_p;
 }
+#endif /* M68K_MULTI_CONTEXT */
 
 void m68k_save_context(	void (*save_value)(char*, unsigned int))
 {
@@ -321,6 +321,8 @@
 #define CPU_PREF_DATA    m68ki_cpu.pref_data
 #define CPU_ADDRESS_MASK m68ki_cpu.address_mask
 #define CPU_SR_MASK      m68ki_cpu.sr_mask
+#define CPU_INITIAL_CYCLES m68ki_cpu.initial_cycles
+#define CPU_BKPT_RESUME  m68ki_cpu.breakpoint_resume
 
 #define CYC_INSTRUCTION  m68ki_cpu.cyc_instruction
 #define CYC_EXCEPTION    m68ki_cpu.cyc_exception
@@ -440,6 +442,18 @@
 	#define m68ki_instr_hook()
 #endif /* M68K_INSTRUCTION_HOOK */
 
+#if M68K_EMULATE_WATCHPOINTS
+	extern volatile uint m68ki_watch_pending;
+	void m68ki_watch_service(void);
+	/* Report watchpoint hits and protect the trapped pages again */
+	#define m68ki_watch_check() if(m68ki_watch_pending) m68ki_watch_service()
+#else
+	#define m68ki_watch_check()
+#endif /* M68K_EMULATE_WATCHPOINTS */
+
+/* Value of CPU_BKPT_RESUME when no breakpoint is being resumed */
+#define BREAKPOINT_NO_RESUME 1 /* odd, never a valid PC */
+
 #if M68K_MONITOR_PC
 	#if M68K_MONITOR_PC == OPT_SPECIFY_HANDLER
 		#define m68ki_pc_changed(A) M68K_SET_PC_CALLBACK(ADDRESS_68K(A))
@@ -458,9 +472,9 @@
 	#else
 		#define m68ki_set_fc(A) CALLBACK_SET_FC(A)
 	#endif
-	#define m68ki_use_data_space() m68ki_address_space = FUNCTION_CODE_USER_DATA
-	#define m68ki_use_program_space() m68ki_address_space = FUNCTION_CODE_USER_PROGRAM
-	#define m68ki_get_address_space() m68ki_address_space
+	#define m68ki_use_data_space() m68ki_cpu.address_space = FUNCTION_CODE_USER_DATA
+	#define m68ki_use_program_space() m68ki_cpu.address_space = FUNCTION_CODE_USER_PROGRAM
+	#define m68ki_get_address_space() m68ki_cpu.address_space
 #else
 	#define m68ki_set_fc(A)
 	#define m68ki_use_data_space()
@@ -472,13 +486,13 @@
 /* Enable or disable trace emulation */
 #if M68K_EMULATE_TRACE
 	/* Initiates trace checking before each instruction (t1) */
-	#define m68ki_trace_t1() m68ki_tracing = FLAG_T1
+	#define m68ki_trace_t1() m68ki_cpu.tracing = FLAG_T1
 	/* adds t0 to trace checking if we encounter change of flow */
-	#define m68ki_trace_t0() m68ki_tracing |= FLAG_T0
+	#define m68ki_trace_t0() m68ki_cpu.tracing |= FLAG_T0
 	/* Clear all tracing */
-	#define m68ki_clear_trace() m68ki_tracing = 0
+	#define m68ki_clear_trace() m68ki_cpu.tracing = 0
 	/* Cause a trace exception if we are tracing */
-	#define m68ki_exception_if_trace() if(m68ki_tracing) m68ki_exception_trace()
+	#define m68ki_exception_if_trace() if(m68ki_cpu.tracing) m68ki_exception_trace()
 #else
 	#define m68ki_trace_t1()
 	#define m68ki_trace_t0()
@@ -490,7 +504,7 @@
 
 /* Address error */
 #if M68K_EMULATE_ADDRESS_ERROR
-	extern jmp_buf m68ki_address_error_trap;
+	extern M68KI_THREAD_LOCAL jmp_buf m68ki_address_error_trap;
 	#define m68ki_set_address_error_trap() if(setjmp(m68ki_address_error_trap)) m68ki_exception_address_error();
 	#define m68ki_check_address_error(A) if((A)&1) longjmp(m68ki_address_error_jump, 1);
 #else
@@ -701,11 +715,11 @@
 
 /* ---------------------------- Cycle Counting ---------------------------- */
 
-#define ADD_CYCLES(A)    m68ki_remaining_cycles += (A)
-#define USE_CYCLES(A)    m68ki_remaining_cycles -= (A)
-#define SET_CYCLES(A)    m68ki_remaining_cycles = A
-#define GET_CYCLES()     m68ki_remaining_cycles
-#define USE_ALL_CYCLES() m68ki_remaining_cycles = 0
+#define ADD_CYCLES(A)    m68ki_cpu.remaining_cycles += (A)
+#define USE_CYCLES(A)    m68ki_cpu.remaining_cycles -= (A)
+#define SET_CYCLES(A)    m68ki_cpu.remaining_cycles = A
+#define GET_CYCLES()     m68ki_cpu.remaining_cycles
+#define USE_ALL_CYCLES() m68ki_cpu.remaining_cycles = 0
 
 
 
@@ -745,36 +759,50 @@
 /* =============================== PROTOTYPES ============================= */
 /* ======================================================================== */
 
+/* Align the hot parts of the CPU state on host cache lines */
+#if defined(__GNUC__) && M68K_CACHE_LINE_SIZE
+#define M68KI_CACHE_ALIGN __attribute__((aligned(M68K_CACHE_LINE_SIZE)))
+#else
+#define M68KI_CACHE_ALIGN
+#endif
+
 typedef struct
 {
-	uint cpu_type;     /* CPU Type: 68000, 68010, 68EC020, or 68020 */
-	uint dar[16];      /* Data and Address Registers */
-	uint ppc;		   /* Previous program counter */
-	uint pc;           /* Program Counter */
-	uint sp[7];        /* User, Interrupt, and Master Stack Pointers */
-	uint vbr;          /* Vector Base Register (m68010+) */
-	uint sfc;          /* Source Function Code Register (m68010+) */
-	uint dfc;          /* Destination Function Code Register (m68010+) */
-	uint cacr;         /* Cache Control Register (m68020, unemulated) */
-	uint caar;         /* Cache Address Register (m68020, unemulated) */
+	/* Hot state: touched by every instruction.
+	 * Keep it at the start of the structure, on its own cache lines.
+	 */
+	uint pc M68KI_CACHE_ALIGN; /* Program Counter */
+	uint ppc;          /* Previous program counter */
 	uint ir;           /* Instruction Register */
-	uint t1_flag;      /* Trace 1 */
-	uint t0_flag;      /* Trace 0 */
-	uint s_flag;       /* Supervisor */
-	uint m_flag;       /* Master/Interrupt state */
+	sint remaining_cycles; /* Number of clocks remaining */
 	uint x_flag;       /* Extend */
 	uint n_flag;       /* Negative */
 	uint not_z_flag;   /* Zero, inverted for speedups */
 	uint v_flag;       /* Overflow */
 	uint c_flag;       /* Carry */
+	uint tracing;      /* Trace exception pending after this instruction */
+	uint address_space; /* Function code of the current access */
+	uint address_mask; /* Available address pins */
+	uint pref_addr;    /* Last prefetch address */
+	uint pref_data;    /* Data in the prefetch queue */
+	uint8* cyc_instruction;
+	uint dar[16] M68KI_CACHE_ALIGN; /* Data and Address Registers */
+
+	/* Warm state: used by exceptions, privileged and specific instructions */
+	uint cpu_type M68KI_CACHE_ALIGN; /* CPU Type: 68000, 68010, 68EC020, or 68020 */
+	uint t1_flag;      /* Trace 1 */
+	uint t0_flag;      /* Trace 0 */
+	uint s_flag;       /* Supervisor */
+	uint m_flag;       /* Master/Interrupt state */
 	uint int_mask;     /* I0-I2 */
 	uint int_level;    /* State of interrupt pins IPL0-IPL2 -- ASG: changed from ints_pending */
 	uint int_cycles;   /* ASG: extra cycles from generated interrupts */
 	uint stopped;      /* Stopped state */
-	uint pref_addr;    /* Last prefetch address */
-	uint pref_data;    /* Data in the prefetch queue */
-	uint address_mask; /* Available address pins */
 	uint sr_mask;      /* Implemented status register bits */
+	sint initial_cycles; /* Length of the current timeslice */
+	uint breakpoint_resume; /* Breakpoint to execute instead of reporting it again */
+	uint sp[7];        /* User, Interrupt, and Master Stack Pointers */
+	uint vbr;          /* Vector Base Register (m68010+) */
 
 	/* Clocks required for instructions / exceptions */
 	uint cyc_bcc_notake_b;
@@ -786,10 +814,19 @@ typedef struct
 	uint cyc_movem_l;
 	uint cyc_shift;
 	uint cyc_reset;
-	uint8* cyc_instruction;
 	uint8* cyc_exception;
 
-	/* Callbacks to host */
+	/* Cold state: unemulated registers and callbacks to host.
+	 * It stays in this structure, after the hot and warm parts, rather than
+	 * in a separate one: the instruction loop never touches these lines, and
+	 * a single block keeps m68k_get_context(), m68k_set_context() and
+	 * m68k_create_context() a plain copy or allocation.
+	 */
+	uint sfc;          /* Source Function Code Register (m68010+) */
+	uint dfc;          /* Destination Function Code Register (m68010+) */
+	uint cacr;         /* Cache Control Register (m68020, unemulated) */
+	uint caar;         /* Cache Address Register (m68020, unemulated) */
+
 	int  (*int_ack_callback)(int int_line);           /* Interrupt Acknowledge */
 	void (*bkpt_ack_callback)(unsigned int data);     /* Breakpoint Acknowledge */
 	void (*reset_instr_callback)(void);               /* Called when a RESET instruction is encountered */
@@ -797,19 +834,36 @@ typedef struct
 	void (*set_fc_callback)(unsigned int new_fc);     /* Called when the CPU function code changes */
 	void (*instr_hook_callback)(void);                /* Called every instruction cycle prior to execution */
 
+	void* alloc_base;  /* Block returned by malloc() for m68k_create_context() */
+
 } m68ki_cpu_core;
 
 
+#if M68K_MULTI_CONTEXT
+#define M68KI_THREAD_LOCAL M68K_THREAD_LOCAL
+/* CPU used by the current thread */
+extern M68KI_THREAD_LOCAL m68ki_cpu_core* m68ki_cpu_p;
+#define m68ki_cpu (*m68ki_cpu_p)
+#else
+#define M68KI_THREAD_LOCAL
 extern m68ki_cpu_core m68ki_cpu;
-extern sint           m68ki_remaining_cycles;
-extern uint           m68ki_tracing;
+#endif /* M68K_MULTI_CONTEXT */
 extern uint8          m68ki_shift_8_table[];
 extern uint16         m68ki_shift_16_table[];
 extern uint           m68ki_shift_32_table[];
 extern uint8          m68ki_exception_cycle_table[][256];
-extern uint           m68ki_address_space;
 extern uint8          m68ki_ea_idx_cycle_table[];
 
+/* Host callbacks for the TRAP #n instructions */
+typedef int (*m68ki_os_call_callback)(unsigned int sp);
+extern void (*m68ki_trap_callback[16])(void);
+extern m68ki_os_call_callback* m68ki_os_call_table[16];
+extern void (*m68ki_os_call_hook)(unsigned int vector, int enter);
+
+/* Notify the observer of the OS calls, if any */
+#define m68ki_os_call_enter(V) do { if(m68ki_os_call_hook != NULL) m68ki_os_call_hook(V, 1); } while(0)
+#define m68ki_os_call_leave(V) do { if(m68ki_os_call_hook != NULL) m68ki_os_call_hook(V, 0); } while(0)
+
 
 /* Read data immediately after the program counter */
 INLINE uint m68ki_read_imm_16(void);
@@ -1646,35 +1700,38 @@ INLINE void m68ki_exception_trap(uint vector)
 /* Trap#n stacks a 0 frame but behaves like group2 otherwise */
 INLINE void m68ki_exception_trapN(uint vector)
 {
-	if (vector == 33)
-	{
-		extern void m68ki_hook_trap1();
-		m68ki_hook_trap1();
-	}
-	else if (vector == 34)
-	{
-		extern void m68ki_hook_trap2();
-		m68ki_hook_trap2();
-	}
-	else if (vector == 45)
+	uint trap = vector - EXCEPTION_TRAP_BASE;
+	m68ki_os_call_callback* table = m68ki_os_call_table[trap];
+	uint sr;
+
+	/* Host callback for the function number on the stack */
+	if(table != NULL)
 	{
-		extern void m68ki_hook_trap13();
-		m68ki_hook_trap13();
+		uint function = m68ki_read_16(REG_SP);
+		if(function < M68K_MAX_OS_CALLS && table[function] != NULL)
+		{
+			m68ki_os_call_enter(vector);
+			REG_D[0] = MASK_OUT_ABOVE_32(table[function](REG_SP));
+			m68ki_os_call_leave(vector);
+			return;
+		}
 	}
-	else if (vector == 46)
+
+	/* Host callback for the whole trap */
+	if(m68ki_trap_callback[trap] != NULL)
 	{
-		extern void m68ki_hook_trap14();
-		m68ki_hook_trap14();
+		m68ki_os_call_enter(vector);
+		m68ki_trap_callback[trap]();
+		m68ki_os_call_leave(vector);
+		return;
 	}
-	else
-	{
-	uint sr = m68ki_init_exception();
+
+	sr = m68ki_init_exception();
 	m68ki_stack_frame_0000(REG_PC, sr, vector);
 	m68ki_jump_vector(vector);
 
 	/* Use up some clock cycles */
 	USE_CYCLES(CYC_EXCEPTION[vector]);
-	}
 }
 
 /* Exception for trace mode */
@@ -1711,7 +1768,9 @@ INLINE void m68ki_exception_privilege_violation(void)
 INLINE void m68ki_exception_1010(void)
 {
 	extern void m68ki_hook_linea();
+	m68ki_os_call_enter(EXCEPTION_1010);
 	m68ki_hook_linea();
+	m68ki_os_call_leave(EXCEPTION_1010);
 #if 0
 	}
 	uint sr;
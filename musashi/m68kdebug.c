@@ -0,0 +1,512 @@
+/* ======================================================================== */
+/* ========================= LICENSING & COPYRIGHT ======================== */
+/* ======================================================================== */
+/*
+ *                                  MUSASHI
+ *                                Version 3.3
+ *
+ * A portable Motorola M680x0 processor emulation engine.
+ * Copyright 1998-2001 Karl Stenerud.  All rights reserved.
+ *
+ * This code may be freely used for non-commercial purposes as long as this
+ * copyright notice remains unaltered in the source code and any binary files
+ * containing this code in compiled form.
+ *
+ * All other lisencing terms must be negotiated with the author
+ * (Karl Stenerud).
+ *
+ * The latest version of this code can be obtained at:
+ * http://kstenerud.cjb.net
+ */
+
+
+
+/* ======================================================================== */
+/* ================================= NOTES ================================ */
+/* ======================================================================== */
+
+/* Debugging facilities added for 68Kemu.
+ * None of them adds any work to the instruction loop: watchpoints rely on
+ * the host MMU, and breakpoints on a BKPT opcode planted in memory whose
+ * jump table entry is redirected while breakpoints are set.
+ */
+
+
+
+/* ======================================================================== */
+/* ================================ INCLUDES ============================== */
+/* ======================================================================== */
+
+#include "m68kops.h"
+#include "m68kcpu.h"
+
+#if M68K_EMULATE_WATCHPOINTS
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif /* M68K_EMULATE_WATCHPOINTS */
+
+
+
+/* ======================================================================== */
+/* ============================== WATCHPOINTS ============================= */
+/* ======================================================================== */
+
+#if M68K_EMULATE_WATCHPOINTS
+
+#define MAX_WATCHPOINTS 32
+#define MAX_WATCH_HITS  16
+
+#define PROT_UNWATCHED (PROT_READ | PROT_WRITE)
+
+typedef struct
+{
+	uint address;
+	uint size;
+	int  type;
+} watchpoint_struct;
+
+static watchpoint_struct g_watchpoints[MAX_WATCHPOINTS];
+static uint g_watch_count = 0;
+static unsigned long g_page_size = 0;
+static struct sigaction g_old_segv_action;
+static void (*g_watch_callback)(unsigned int address, unsigned int pc, int type) = NULL;
+
+/* Faults recorded by the signal handler, reported by m68ki_watch_service() */
+static struct
+{
+	uint address;
+	uint pc;
+	int  access;
+} g_watch_hits[MAX_WATCH_HITS];
+static volatile uint g_watch_hit_count = 0;
+volatile uint m68ki_watch_pending = 0;
+
+
+static unsigned long host_page(uint address)
+{
+	return (unsigned long)m68k_host_ptr(address) & ~(g_page_size - 1);
+}
+
+/* Protection required by the watchpoints covering a host page */
+static int page_protection(unsigned long page)
+{
+	int prot = PROT_UNWATCHED;
+	uint i;
+
+	for(i = 0; i < g_watch_count; i++)
+	{
+		watchpoint_struct* wp = &g_watchpoints[i];
+
+		if(page < host_page(wp->address) || page > host_page(wp->address + wp->size - 1))
+			continue;
+		if(wp->type & M68K_WATCH_READ)
+			return PROT_NONE;
+		prot = PROT_READ;
+	}
+	return prot;
+}
+
+static int protect_range(uint address, uint size)
+{
+	unsigned long page = host_page(address);
+	unsigned long last = host_page(address + size - 1);
+
+	for(;;)
+	{
+		if(mprotect((void*)page, g_page_size, page_protection(page)) != 0)
+			return -1;
+		if(page == last)
+			return 0;
+		page += g_page_size;
+	}
+}
+
+static void watch_segv_handler(int sig, siginfo_t* info, void* context)
+{
+	unsigned long page = (unsigned long)info->si_addr & ~(g_page_size - 1);
+	int prot = page_protection(page);
+
+	if(prot == PROT_UNWATCHED)
+	{
+		/* Not a watched page, let the previous handler deal with it */
+		if(g_old_segv_action.sa_flags & SA_SIGINFO)
+			g_old_segv_action.sa_sigaction(sig, info, context);
+		else if(g_old_segv_action.sa_handler != SIG_DFL && g_old_segv_action.sa_handler != SIG_IGN)
+			g_old_segv_action.sa_handler(sig);
+		else
+			sigaction(SIGSEGV, &g_old_segv_action, NULL); /* fault again, fatally */
+		return;
+	}
+
+	/* Let the access complete when the host instruction is restarted */
+	mprotect((void*)page, g_page_size, PROT_UNWATCHED);
+
+	if(g_watch_hit_count < MAX_WATCH_HITS)
+	{
+		g_watch_hits[g_watch_hit_count].address = m68k_guest_addr(info->si_addr);
+		g_watch_hits[g_watch_hit_count].pc = REG_PPC;
+		/* Read-only pages only fault on writes */
+		g_watch_hits[g_watch_hit_count].access = prot == PROT_READ ? M68K_WATCH_WRITE : M68K_WATCH_READ | M68K_WATCH_WRITE;
+		g_watch_hit_count++;
+	}
+	m68ki_watch_pending = 1;
+
+	/* Leave m68k_execute() once the current instruction is done */
+	m68k_modify_timeslice(-m68k_cycles_remaining());
+}
+
+/* Called by m68k_execute() after a watched page has been trapped */
+void m68ki_watch_service(void)
+{
+	uint i;
+	uint j;
+
+	m68ki_watch_pending = 0;
+
+	for(i = 0; i < g_watch_hit_count; i++)
+	{
+		uint address = g_watch_hits[i].address;
+
+		for(j = 0; j < g_watch_count; j++)
+		{
+			watchpoint_struct* wp = &g_watchpoints[j];
+			int type = wp->type & g_watch_hits[i].access;
+
+			/* The access may have been up to a long word wide */
+			if(type && address + 3 >= wp->address && address < wp->address + wp->size && g_watch_callback)
+				g_watch_callback(address, g_watch_hits[i].pc, type);
+		}
+	}
+	g_watch_hit_count = 0;
+
+	/* Trap the next access to these pages */
+	for(j = 0; j < g_watch_count; j++)
+		protect_range(g_watchpoints[j].address, g_watchpoints[j].size);
+}
+
+/* System calls fail with EFAULT on protected pages instead of raising
+ * SIGSEGV, so the host reports its own accesses before making them.
+ */
+void m68k_watch_host_access(unsigned int address, unsigned int size, int type)
+{
+	unsigned long page;
+	unsigned long last;
+	uint i;
+
+	if(g_watch_count == 0 || size == 0)
+		return;
+
+	for(i = 0; i < g_watch_count; i++)
+	{
+		watchpoint_struct* wp = &g_watchpoints[i];
+
+		if(!(wp->type & type) || address + size <= wp->address || address >= wp->address + wp->size)
+			continue;
+		if(g_watch_hit_count < MAX_WATCH_HITS)
+		{
+			g_watch_hits[g_watch_hit_count].address = address > wp->address ? address : wp->address;
+			g_watch_hits[g_watch_hit_count].pc = REG_PPC;
+			g_watch_hits[g_watch_hit_count].access = type;
+			g_watch_hit_count++;
+		}
+		m68ki_watch_pending = 1;
+	}
+
+	/* Open the watched pages to the host until m68ki_watch_service() */
+	page = host_page(address);
+	last = host_page(address + size - 1);
+	for(;;)
+	{
+		if(page_protection(page) != PROT_UNWATCHED)
+		{
+			mprotect((void*)page, g_page_size, PROT_UNWATCHED);
+			m68ki_watch_pending = 1;
+		}
+		if(page == last)
+			break;
+		page += g_page_size;
+	}
+
+	if(m68ki_watch_pending)
+		m68k_modify_timeslice(-m68k_cycles_remaining());
+}
+
+int m68k_add_watchpoint(unsigned int address, unsigned int size, int type)
+{
+	if(size == 0 || !(type & (M68K_WATCH_READ | M68K_WATCH_WRITE)) || g_watch_count == MAX_WATCHPOINTS)
+		return -1;
+
+	if(g_page_size == 0)
+	{
+		struct sigaction action;
+
+		g_page_size = (unsigned long)sysconf(_SC_PAGESIZE);
+
+		action.sa_sigaction = watch_segv_handler;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_SIGINFO;
+		sigaction(SIGSEGV, &action, &g_old_segv_action);
+	}
+
+	g_watchpoints[g_watch_count].address = address;
+	g_watchpoints[g_watch_count].size = size;
+	g_watchpoints[g_watch_count].type = type & (M68K_WATCH_READ | M68K_WATCH_WRITE);
+	g_watch_count++;
+
+	if(protect_range(address, size) != 0)
+	{
+		g_watch_count--;
+		protect_range(address, size);
+		return -1;
+	}
+	return 0;
+}
+
+int m68k_remove_watchpoint(unsigned int address, unsigned int size, int type)
+{
+	uint i;
+
+	for(i = 0; i < g_watch_count; i++)
+	{
+		watchpoint_struct* wp = &g_watchpoints[i];
+
+		if(wp->address == address && wp->size == size && wp->type == type)
+		{
+			*wp = g_watchpoints[--g_watch_count];
+			return protect_range(address, size);
+		}
+	}
+	return -1;
+}
+
+void m68k_clear_watchpoints(void)
+{
+	while(g_watch_count > 0)
+	{
+		watchpoint_struct wp = g_watchpoints[--g_watch_count];
+		protect_range(wp.address, wp.size);
+	}
+}
+
+void m68k_suspend_watchpoints(void)
+{
+	uint i;
+
+	for(i = 0; i < g_watch_count; i++)
+	{
+		unsigned long page = host_page(g_watchpoints[i].address);
+		unsigned long last = host_page(g_watchpoints[i].address + g_watchpoints[i].size - 1);
+
+		for(;;)
+		{
+			mprotect((void*)page, g_page_size, PROT_UNWATCHED);
+			if(page == last)
+				break;
+			page += g_page_size;
+		}
+	}
+}
+
+void m68k_resume_watchpoints(void)
+{
+	uint i;
+
+	for(i = 0; i < g_watch_count; i++)
+		protect_range(g_watchpoints[i].address, g_watchpoints[i].size);
+}
+
+void m68k_set_watchpoint_callback(void (*callback)(unsigned int address, unsigned int pc, int type))
+{
+	g_watch_callback = callback;
+}
+
+#endif /* M68K_EMULATE_WATCHPOINTS */
+
+
+
+/* ======================================================================== */
+/* ============================== BREAKPOINTS ============================= */
+/* ======================================================================== */
+
+#define MAX_BREAKPOINTS   64
+#define BREAKPOINT_OPCODE 0x4848 /* bkpt #0 */
+
+typedef struct
+{
+	uint address;
+	uint opcode;    /* Instruction word replaced by the BKPT */
+	uint temporary; /* Set by m68k_step_over(), removed when reached */
+} breakpoint_struct;
+
+static breakpoint_struct g_breakpoints[MAX_BREAKPOINTS];
+static uint g_breakpoint_count = 0;
+static void (*g_bkpt_opcode_handler)(void) = NULL; /* Handler replaced in the jump table */
+static void (*g_breakpoint_callback)(unsigned int address) = NULL;
+
+
+static breakpoint_struct* find_breakpoint(uint address)
+{
+	uint i;
+
+	for(i = 0; i < g_breakpoint_count; i++)
+		if(g_breakpoints[i].address == address)
+			return &g_breakpoints[i];
+	return NULL;
+}
+
+/* Run the handler of an opcode as if it had been fetched normally */
+static void execute_opcode(uint opcode)
+{
+	REG_IR = opcode;
+	if(opcode == BREAKPOINT_OPCODE)
+		g_bkpt_opcode_handler();
+	else
+		m68ki_instruction_jump_table[opcode]();
+}
+
+static void remove_breakpoint(breakpoint_struct* bp)
+{
+	m68k_write_memory_16(ADDRESS_68K(bp->address), bp->opcode);
+	*bp = g_breakpoints[--g_breakpoint_count];
+
+	if(g_breakpoint_count == 0)
+		m68ki_instruction_jump_table[BREAKPOINT_OPCODE] = g_bkpt_opcode_handler;
+}
+
+/* Jump table entry for BKPT #0 while breakpoints are set */
+static void m68ki_op_breakpoint(void)
+{
+	uint address = REG_PPC;
+	breakpoint_struct* bp = find_breakpoint(address);
+
+	if(bp == NULL)
+	{
+		/* A genuine BKPT instruction */
+		g_bkpt_opcode_handler();
+		return;
+	}
+
+	if(CPU_BKPT_RESUME == address)
+	{
+		/* Resuming from this breakpoint, execute the original instruction */
+		CPU_BKPT_RESUME = BREAKPOINT_NO_RESUME;
+		execute_opcode(bp->opcode);
+		return;
+	}
+
+	/* Stop before the instruction, and run it when resuming.
+	 * A temporary breakpoint puts the original instruction back instead, so
+	 * a breakpoint set there later must not be skipped.
+	 */
+	REG_PC = address;
+	if(bp->temporary)
+	{
+		CPU_BKPT_RESUME = BREAKPOINT_NO_RESUME;
+		remove_breakpoint(bp);
+	}
+	else
+		CPU_BKPT_RESUME = address;
+
+	m68k_modify_timeslice(-m68k_cycles_remaining());
+	if(g_breakpoint_callback)
+		g_breakpoint_callback(address);
+}
+
+static int add_breakpoint(uint address, uint temporary)
+{
+	breakpoint_struct* bp;
+
+	if(address & 1)
+		return -1;
+
+	bp = find_breakpoint(address);
+	if(bp != NULL)
+	{
+		/* A permanent breakpoint is never downgraded */
+		bp->temporary &= temporary;
+		return 0;
+	}
+
+	if(g_breakpoint_count == MAX_BREAKPOINTS)
+		return -1;
+
+	if(g_breakpoint_count == 0)
+	{
+		g_bkpt_opcode_handler = m68ki_instruction_jump_table[BREAKPOINT_OPCODE];
+		m68ki_instruction_jump_table[BREAKPOINT_OPCODE] = m68ki_op_breakpoint;
+	}
+
+	bp = &g_breakpoints[g_breakpoint_count++];
+	bp->address = address;
+	bp->opcode = m68k_read_memory_16(ADDRESS_68K(address));
+	bp->temporary = temporary;
+	m68k_write_memory_16(ADDRESS_68K(address), BREAKPOINT_OPCODE);
+	return 0;
+}
+
+int m68k_set_breakpoint(unsigned int address)
+{
+	return add_breakpoint(address, 0);
+}
+
+int m68k_clear_breakpoint(unsigned int address)
+{
+	breakpoint_struct* bp = find_breakpoint(address);
+
+	if(bp == NULL)
+		return -1;
+
+	remove_breakpoint(bp);
+	return 0;
+}
+
+void m68k_clear_breakpoints(void)
+{
+	while(g_breakpoint_count > 0)
+		remove_breakpoint(&g_breakpoints[g_breakpoint_count - 1]);
+}
+
+void m68k_set_breakpoint_callback(void (*callback)(unsigned int address))
+{
+	g_breakpoint_callback = callback;
+}
+
+/* Step over calls by planting a temporary breakpoint after them */
+int m68k_step_over(void)
+{
+	uint pc = REG_PC;
+	breakpoint_struct* bp = find_breakpoint(pc);
+	uint opcode = bp != NULL ? bp->opcode : m68k_read_memory_16(ADDRESS_68K(pc));
+	char buff[100];
+	uint size;
+	int cycles;
+
+	if((opcode & 0xff00) != 0x6100 &&    /* bsr */
+	   (opcode & 0xffc0) != 0x4e80 &&    /* jsr */
+	   (opcode & 0xfff0) != 0x4e40)      /* trap */
+		return m68k_step();
+
+	/* The disassembler must see the original instruction */
+	if(bp != NULL)
+		m68k_write_memory_16(ADDRESS_68K(pc), opcode);
+	size = m68k_disassemble(buff, pc, m68k_get_reg(NULL, M68K_REG_CPU_TYPE));
+	if(bp != NULL)
+		m68k_write_memory_16(ADDRESS_68K(pc), BREAKPOINT_OPCODE);
+
+	add_breakpoint(pc + size, 1);
+	cycles = m68k_step();
+
+	/* Calls handled by the host (OS traps) have already returned */
+	bp = find_breakpoint(pc + size);
+	if(REG_PC == pc + size && bp != NULL && bp->temporary)
+		remove_breakpoint(bp);
+
+	return cycles;
+}
+
+
+
+/* ======================================================================== */
+/* ============================== END OF FILE ============================= */
+/* ======================================================================== */
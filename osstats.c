@@ -0,0 +1,297 @@
+/*
+  osstats.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  OS call statistics.
+
+  Every OS call handled by the host is counted by OS and function number,
+  and its host time is recorded into a histogram with power-of-two buckets.
+  The report is sorted by total time, so the calls worth caching, batching
+  or reimplementing come first.
+
+  Nothing is recorded until osStatsInit() is called and osStatsHook() is
+  installed as the observer of the OS calls.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include "musashi/m68k.h"
+#include "osstats.h"
+#include "process.h"
+
+enum
+{
+    OS_GEMDOS,
+    OS_BIOS,
+    OS_XBIOS,
+    OS_AES,
+    OS_VDI,
+    OS_GEM,   // Other trap #2 calls, by d0
+    OS_LINEA,
+    OS_TRAP,  // Other traps, by trap number
+    OS_COUNT
+};
+
+static const char* const osNames[OS_COUNT] =
+{
+    "GEMDOS", "BIOS", "XBIOS", "AES", "VDI", "GEM", "Line-A", "TRAP"
+};
+
+// Higher function numbers are counted together in the last entry
+#define MAX_FUNCTIONS 0x200
+
+// Bucket n counts the calls which took less than 2^(n+1) ns
+#define NUM_BUCKETS 40
+
+typedef struct
+{
+    int os;
+    unsigned int function;
+    unsigned long count;
+    unsigned long long total; // ns
+    unsigned long long max;   // ns
+    unsigned long histogram[NUM_BUCKETS];
+} CallStats;
+
+// Allocated on first use, there are few distinct calls
+static CallStats* stats[OS_COUNT][MAX_FUNCTIONS];
+
+static CallStats* pending;
+static unsigned long long pendingStart;
+static unsigned long long startTime;
+
+static volatile sig_atomic_t reportRequested;
+static int finalReportDone;
+
+unsigned long long hostTime(void)
+{
+#ifdef HOST_LINUX
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec) * 1000;
+#endif
+}
+
+static CallStats* findStats(int os, unsigned int function)
+{
+    CallStats* s;
+
+    if (function >= MAX_FUNCTIONS)
+        function = MAX_FUNCTIONS - 1;
+
+    s = stats[os][function];
+    if (s == NULL)
+    {
+        s = calloc(1, sizeof(CallStats));
+        if (s == NULL)
+            return NULL;
+        s->os = os;
+        s->function = function;
+        stats[os][function] = s;
+    }
+
+    return s;
+}
+
+// Identify the call, while the registers still hold the arguments
+static CallStats* identifyCall(unsigned int vector)
+{
+    unsigned int* regs = m68k_get_reg_file();
+    unsigned int sp = regs[M68K_REG_A7];
+    unsigned int d0 = regs[M68K_REG_D0];
+    unsigned int pb;
+
+    switch (vector)
+    {
+        case 10: // Line-A
+            return findStats(OS_LINEA, m68k_read_memory_16(m68k_get_reg(NULL, M68K_REG_PC) - 2) & 0x000f);
+
+        case 33: // Trap #1
+            return findStats(OS_GEMDOS, m68k_read_memory_16(sp));
+
+        case 34: // Trap #2
+            // The opcode is the first word of the control array
+            pb = regs[M68K_REG_D1];
+            if (d0 == 200)
+                return findStats(OS_AES, m68k_read_memory_16(m68k_read_memory_32(pb)));
+            if (d0 == 115)
+                return findStats(OS_VDI, m68k_read_memory_16(m68k_read_memory_32(pb)));
+            return findStats(OS_GEM, d0 & 0xffff);
+
+        case 45: // Trap #13
+            return findStats(OS_BIOS, m68k_read_memory_16(sp));
+
+        case 46: // Trap #14
+            return findStats(OS_XBIOS, m68k_read_memory_16(sp));
+
+        default:
+            return findStats(OS_TRAP, vector - 32);
+    }
+}
+
+static void formatTime(char* buffer, size_t size, unsigned long long ns)
+{
+    if (ns < 1000)
+        snprintf(buffer, size, "%lluns", ns);
+    else if (ns < 1000000)
+        snprintf(buffer, size, "%lluus", ns / 1000);
+    else if (ns < 1000000000)
+        snprintf(buffer, size, "%llums", ns / 1000000);
+    else
+        snprintf(buffer, size, "%llus", ns / 1000000000);
+}
+
+// Sort by decreasing total time
+static int compareStats(const void* a, const void* b)
+{
+    const CallStats* sa = *(const CallStats* const*)a;
+    const CallStats* sb = *(const CallStats* const*)b;
+
+    if (sa->total != sb->total)
+        return sa->total < sb->total ? 1 : -1;
+    if (sa->count != sb->count)
+        return sa->count < sb->count ? 1 : -1;
+    return 0;
+}
+
+static void printReport(void)
+{
+    static CallStats* sorted[OS_COUNT * MAX_FUNCTIONS];
+    unsigned long long osTotal = 0;
+    unsigned long long wallTotal = hostTime() - startTime;
+    char name[32];
+    char label[16];
+    size_t count = 0;
+    size_t i;
+    int os;
+    int function;
+    int b;
+
+    for (os = 0; os < OS_COUNT; ++os)
+    {
+        for (function = 0; function < MAX_FUNCTIONS; ++function)
+        {
+            if (stats[os][function] != NULL)
+            {
+                sorted[count++] = stats[os][function];
+                osTotal += stats[os][function]->total;
+            }
+        }
+    }
+
+    qsort(sorted, count, sizeof(sorted[0]), compareStats);
+
+    fprintf(stderr, "68kemu: %.3f ms in OS calls, %.3f ms elapsed\n",
+        osTotal / 1e6, wallTotal / 1e6);
+    fprintf(stderr, "%-14s %10s %12s %10s %10s  %s\n",
+        "Call", "Count", "Total ms", "Mean us", "Max us", "Histogram (calls < time)");
+
+    for (i = 0; i < count; ++i)
+    {
+        CallStats* s = sorted[i];
+
+        snprintf(name, sizeof(name), "%s(0x%02x)", osNames[s->os], s->function);
+        fprintf(stderr, "%-14s %10lu %12.3f %10.1f %10.1f ",
+            name, s->count, s->total / 1e6,
+            s->count != 0 ? s->total / 1e3 / s->count : 0.0, s->max / 1e3);
+
+        for (b = 0; b < NUM_BUCKETS; ++b)
+        {
+            if (s->histogram[b] != 0)
+            {
+                formatTime(label, sizeof(label), 2ULL << b);
+                fprintf(stderr, " %lu<%s", s->histogram[b], label);
+            }
+        }
+        fputc('\n', stderr);
+    }
+}
+
+static void printFinalReport(void)
+{
+    if (!finalReportDone)
+    {
+        finalReportDone = 1;
+        printReport();
+    }
+}
+
+void osStatsHook(unsigned int vector, int enter)
+{
+    unsigned long long elapsed;
+    int bucket;
+
+    if (enter)
+    {
+        pending = identifyCall(vector);
+        if (pending != NULL)
+        {
+            pending->count++;
+
+            // With TOS, Pterm() of the main program does not return to the C library
+            if (pending->os == OS_GEMDOS && (pending->function == 0x00
+                || pending->function == 0x31 || pending->function == 0x4c) && !processIsChild())
+                printFinalReport();
+        }
+        pendingStart = hostTime();
+        return;
+    }
+
+    if (pending == NULL)
+        return;
+
+    elapsed = hostTime() - pendingStart;
+    pending->total += elapsed;
+    if (elapsed > pending->max)
+        pending->max = elapsed;
+
+    bucket = elapsed < 2 ? 0 : 63 - __builtin_clzll(elapsed);
+    if (bucket >= NUM_BUCKETS)
+        bucket = NUM_BUCKETS - 1;
+    pending->histogram[bucket]++;
+
+    pending = NULL;
+}
+
+static void requestReport(int sig)
+{
+    reportRequested = 1;
+}
+
+void osStatsInit(void)
+{
+    startTime = hostTime();
+    signal(SIGUSR1, requestReport);
+    atexit(printFinalReport);
+}
+
+void osStatsPoll(void)
+{
+    if (reportRequested)
+    {
+        reportRequested = 0;
+        printReport();
+    }
+}
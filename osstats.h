@@ -0,0 +1,34 @@
+/*
+  osstats.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_OSSTATS_H__
+#define __INC_OSSTATS_H__
+
+// Start counting the OS calls and measuring their host time.
+// The report is printed at exit, and on SIGUSR1.
+void osStatsInit(void);
+
+// Observer of the OS calls, see m68k_set_os_call_hook_callback()
+void osStatsHook(unsigned int vector, int enter);
+
+// Print the report if it was requested by a signal.
+// Must be called between two m68k_execute().
+void osStatsPoll(void);
+
+// Monotonic host time, in nanoseconds
+unsigned long long hostTime(void);
+
+#endif /* __INC_OSSTATS_H__ */
@@ -0,0 +1,244 @@
+/*
+  ostrace.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Binary trace of the OS calls.
+
+  The emulator thread is the only producer of a ring buffer of fixed-size
+  records, and the writer is its only consumer, so the ring needs no lock:
+  each side only publishes its own index. The emulator never waits for the
+  writer. When the ring is full, records are dropped and counted.
+
+  With Linux, a background thread drains the ring to the file. With TOS,
+  there are no threads: the run loop drains it between two timeslices.
+  Use trace2json to convert the file to the Chrome trace format.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HOST_LINUX
+#include <pthread.h>
+#endif
+#include "musashi/m68k.h"
+#include "osstats.h"
+#include "ostrace.h"
+#include "process.h"
+#ifdef HOST_LINUX
+#include "linuxos.h"
+#endif
+
+// Number of records, must be a power of 2
+#define RING_SIZE 65536
+
+static TraceRecord* ring;
+static unsigned int head; // Next record to fill, owned by the emulator
+static unsigned int tail; // Next record to write, owned by the writer
+
+static FILE* traceFile;
+static unsigned long dropped;
+
+// The record being filled by the current call, or NULL
+static TraceRecord* current;
+
+#ifdef HOST_LINUX
+static pthread_t writerThread;
+static volatile int stopWriter;
+#endif
+
+// Write the published records to the file
+static void drain(void)
+{
+    unsigned int t = tail;
+    unsigned int h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+    while (t != h)
+    {
+        unsigned int index = t & (RING_SIZE - 1);
+        unsigned int count = h - t;
+
+        // Up to the end of the ring, then from its start
+        if (count > RING_SIZE - index)
+            count = RING_SIZE - index;
+
+        fwrite(&ring[index], sizeof(TraceRecord), count, traceFile);
+        t += count;
+    }
+
+    __atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+}
+
+#ifdef HOST_LINUX
+static void* writerMain(void* arg)
+{
+    struct timespec delay = { 0, 10000000 }; // 10 ms
+
+    while (!stopWriter)
+    {
+        drain();
+        nanosleep(&delay, NULL);
+    }
+
+    return NULL;
+}
+#endif
+
+static void publish(void)
+{
+    __atomic_store_n(&head, head + 1, __ATOMIC_RELEASE);
+    current = NULL;
+}
+
+void osTraceHook(unsigned int vector, int enter)
+{
+    unsigned int* regs;
+    unsigned int sp;
+
+    if (traceFile == NULL)
+        return;
+
+    if (!enter)
+    {
+        if (current != NULL)
+        {
+            current->duration = (unsigned int)(hostTime() - current->time);
+            current->result = m68k_get_reg_file()[M68K_REG_D0];
+            publish();
+        }
+        return;
+    }
+
+    // Reserve the record, it is published when the call returns
+    if (head - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+    {
+        dropped++;
+        current = NULL;
+        return;
+    }
+
+    regs = m68k_get_reg_file();
+    sp = regs[M68K_REG_A7];
+
+    current = &ring[head & (RING_SIZE - 1)];
+    current->pc = m68k_get_reg(NULL, M68K_REG_PC);
+    current->vector = vector;
+    current->duration = 0;
+    current->result = 0;
+
+    if (vector == 10) // Line-A
+    {
+        current->function = m68k_read_memory_16(current->pc - 2);
+        current->args[0] = current->args[1] = current->args[2] = 0;
+    }
+    else if (vector == 34) // Trap #2
+    {
+        current->function = regs[M68K_REG_D0];
+        current->args[0] = regs[M68K_REG_D0];
+        current->args[1] = regs[M68K_REG_D1];
+        current->args[2] = 0;
+    }
+    else
+    {
+        unsigned int i;
+
+        current->function = m68k_read_memory_16(sp);
+        for (i = 0; i < 3; ++i)
+        {
+            // The stack may end before the longs
+#ifdef HOST_LINUX
+            if (!linuxIsRam(sp + 2 + i * 4, 4))
+            {
+                current->args[i] = 0;
+                continue;
+            }
+#endif
+            current->args[i] = m68k_read_memory_32(sp + 2 + i * 4);
+        }
+    }
+
+    current->time = hostTime();
+
+    // With TOS, Pterm() of the main program does not return to the C library
+    if (vector == 33 && (current->function == 0x00
+        || current->function == 0x31 || current->function == 0x4c) && !processIsChild())
+    {
+        publish();
+        osTraceClose();
+    }
+}
+
+int osTraceOpen(const char* path)
+{
+    TraceHeader header;
+
+    ring = malloc(RING_SIZE * sizeof(TraceRecord));
+    if (ring == NULL)
+        return -1;
+
+    traceFile = fopen(path, "wb");
+    if (traceFile == NULL)
+    {
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.order = TRACE_ORDER;
+    header.recordSize = sizeof(TraceRecord);
+    fwrite(&header, sizeof(header), 1, traceFile);
+
+#ifdef HOST_LINUX
+    if (pthread_create(&writerThread, NULL, writerMain, NULL) != 0)
+    {
+        fclose(traceFile);
+        traceFile = NULL;
+        return -1;
+    }
+#endif
+
+    atexit(osTraceClose);
+    return 0;
+}
+
+void osTracePoll(void)
+{
+#ifndef HOST_LINUX
+    if (traceFile != NULL)
+        drain();
+#endif
+}
+
+void osTraceClose(void)
+{
+    if (traceFile == NULL)
+        return;
+
+#ifdef HOST_LINUX
+    stopWriter = 1;
+    pthread_join(writerThread, NULL);
+#endif
+
+    drain();
+    fclose(traceFile);
+    traceFile = NULL;
+
+    if (dropped != 0)
+        fprintf(stderr, "68kemu: %lu trace record(s) dropped\n", dropped);
+}
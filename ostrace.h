@@ -0,0 +1,59 @@
+/*
+  ostrace.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_OSTRACE_H__
+#define __INC_OSTRACE_H__
+
+// Binary trace file layout, read by trace2json
+#define TRACE_MAGIC   "68KTRACE"
+#define TRACE_VERSION 1
+#define TRACE_ORDER   0x01020304 // Written in host order, to detect it
+
+typedef struct
+{
+    char magic[8];
+    unsigned int version;
+    unsigned int order;
+    unsigned int recordSize;
+    unsigned int reserved;
+} TraceHeader;
+
+typedef struct
+{
+    unsigned long long time;  // Host time of the call, in ns
+    unsigned int duration;    // Host time spent in the call, in ns
+    unsigned int pc;          // Guest address after the trap instruction
+    unsigned short vector;    // Exception vector: 10 for line-A, 32+n for TRAP #n
+    unsigned short function;  // Function number on the stack, or line-A opcode
+    unsigned int args[3];     // First stack longs, or d0/d1 for trap #2
+    unsigned int result;      // d0 after the call
+} TraceRecord;
+
+// Start tracing the OS calls to a binary file.
+// Returns 0 on success, -1 on error.
+int osTraceOpen(const char* path);
+
+// Observer of the OS calls, see m68k_set_os_call_hook_callback()
+void osTraceHook(unsigned int vector, int enter);
+
+// Write the pending records, when there is no writer thread.
+// Must be called between two m68k_execute().
+void osTracePoll(void);
+
+// Flush the pending records and close the trace file.
+void osTraceClose(void);
+
+#endif /* __INC_OSTRACE_H__ */
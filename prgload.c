@@ -0,0 +1,481 @@
+/*
+  prgload.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  TOS program loader, shared by both hosts.
+
+  The whole file is read with a single read into the TPA, so that the text
+  and data segments land at their final place: the header overlaps the end
+  of the basepage, which is filled afterwards. The symbols and the
+  relocation table follow the data, where the BSS will be, so they are
+  decoded in place before the BSS is cleared.
+
+  The relocated text and data of the loaded programs are kept in a cache,
+  with the offsets of their fixups, by path, size, and modification and
+  status change times. Launching the same program again only copies the
+  image, and adds the difference of load address at each fixup if it moved.
+  The least recently used images are dropped to stay within the memory
+  budget.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "musashi/m68k.h"
+#include "guestheap.h"
+#include "prgload.h"
+#include "tosdefs.h"
+
+#ifdef HOST_LINUX
+#define PRG_CACHE_DEFAULT_BUDGET (64UL * 1024 * 1024)
+#else
+#define PRG_CACHE_DEFAULT_BUDGET (2UL * 1024 * 1024)
+#endif
+
+typedef struct PrgImage
+{
+    char* path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    time_t ctime;
+#ifdef HOST_LINUX
+    long mtimeNsec;              // Several changes may fall in one second
+    long ctimeNsec;
+#endif
+    unsigned int tlen;
+    unsigned int dlen;
+    unsigned int blen;
+    unsigned int tbase;          // Load address of the relocated image
+    unsigned char* image;        // Text and data
+    unsigned int* fixups;        // Offsets of the relocated longs
+    unsigned int fixupCount;
+    unsigned long bytes;         // Host memory used
+    unsigned long lastUse;
+    struct PrgImage* next;
+} PrgImage;
+
+// Offsets collected while relocating
+typedef struct
+{
+    unsigned int* offsets;
+    unsigned int count;
+    unsigned int capacity;
+    int failed;
+} FixupList;
+
+static PrgImage* images;
+static unsigned long cacheBudget = PRG_CACHE_DEFAULT_BUDGET;
+static unsigned long cacheUsed;
+static unsigned long useCounter;
+static unsigned long cacheHits;
+static unsigned long cacheMisses;
+static unsigned long cacheEvictions;
+
+static unsigned int getLong(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void addToLong(unsigned char* p, unsigned int delta)
+{
+    unsigned int value = getLong(p) + delta;
+
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+static void addFixup(FixupList* list, unsigned int offset)
+{
+    if (list->count == list->capacity)
+    {
+        unsigned int capacity = list->capacity != 0 ? list->capacity * 2 : 1024;
+        unsigned int* offsets = realloc(list->offsets, capacity * sizeof(unsigned int));
+
+        if (offsets == NULL)
+        {
+            list->failed = 1;
+            return;
+        }
+        list->offsets = offsets;
+        list->capacity = capacity;
+    }
+
+    list->offsets[list->count++] = offset;
+}
+
+// Apply the relocation stream to the text and data segments, and collect
+// the offsets of the fixups if list is not NULL.
+// The stream must end with a zero byte.
+static long relocate(unsigned char* text, unsigned int size, unsigned int tbase, const unsigned char* p, FixupList* list)
+{
+    unsigned int offset = getLong(p);
+
+    if (offset == 0)
+        return TOS_E_OK;
+
+    for (p += 4; ; )
+    {
+        unsigned int c;
+
+        if (size < 4 || offset > size - 4)
+            return TOS_EPLFMT;
+
+        addToLong(text + offset, tbase);
+        if (list != NULL && !list->failed)
+            addFixup(list, offset);
+
+        // 1 skips 254 bytes without a fixup
+        while ((c = *p++) == 1)
+            offset += 254;
+        if (c == 0)
+            return TOS_E_OK;
+        offset += c;
+    }
+}
+
+static void freeImage(PrgImage* entry)
+{
+    cacheUsed -= entry->bytes;
+    free(entry->path);
+    free(entry->image);
+    free(entry->fixups);
+    free(entry);
+}
+
+// Drop the least recently used images until the cache fits in the budget
+static void trimCache(unsigned long budget)
+{
+    while (cacheUsed > budget)
+    {
+        PrgImage** oldest = NULL;
+        PrgImage** link;
+        PrgImage* entry;
+
+        for (link = &images; *link != NULL; link = &(*link)->next)
+        {
+            if (oldest == NULL || (*link)->lastUse < (*oldest)->lastUse)
+                oldest = link;
+        }
+
+        entry = *oldest;
+        *oldest = entry->next;
+        freeImage(entry);
+        cacheEvictions++;
+    }
+}
+
+// Returns nonzero if the file is unchanged since the image was cached
+static int sameFile(const PrgImage* entry, const struct stat* st)
+{
+    return entry->dev == st->st_dev && entry->ino == st->st_ino && entry->size == st->st_size
+        && entry->mtime == st->st_mtime && entry->ctime == st->st_ctime
+#ifdef HOST_LINUX
+        && entry->mtimeNsec == st->st_mtim.tv_nsec && entry->ctimeNsec == st->st_ctim.tv_nsec
+#endif
+        ;
+}
+
+static PrgImage* findImage(const char* path, const struct stat* st)
+{
+    PrgImage* entry;
+
+    for (entry = images; entry != NULL; entry = entry->next)
+    {
+        if (sameFile(entry, st) && strcmp(entry->path, path) == 0)
+            return entry;
+    }
+
+    return NULL;
+}
+
+// Keep a copy of a relocated image. The cache takes the fixups.
+static void addImage(const char* path, const struct stat* st, const unsigned char* header,
+    unsigned int tbase, FixupList* fixups)
+{
+    PrgImage** link;
+    PrgImage* entry;
+    unsigned int tlen = getLong(header + 2);
+    unsigned int dlen = getLong(header + 6);
+    unsigned long bytes = sizeof(PrgImage) + strlen(path) + 1 + tlen + dlen
+        + (unsigned long)fixups->count * sizeof(unsigned int);
+
+    // The program was changed since it was cached
+    for (link = &images; *link != NULL; )
+    {
+        entry = *link;
+        if (strcmp(entry->path, path) == 0)
+        {
+            *link = entry->next;
+            freeImage(entry);
+        }
+        else
+            link = &entry->next;
+    }
+
+    if (fixups->failed || bytes > cacheBudget)
+        return;
+
+    entry = calloc(1, sizeof(PrgImage));
+    if (entry == NULL)
+        return;
+
+    entry->path = strdup(path);
+    entry->image = malloc(tlen + dlen + 1);
+    if (entry->path == NULL || entry->image == NULL)
+    {
+        free(entry->path);
+        free(entry->image);
+        free(entry);
+        return;
+    }
+
+    trimCache(cacheBudget - bytes);
+
+    memcpy(entry->image, header + PRG_HEADER_SIZE, tlen + dlen);
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->size = st->st_size;
+    entry->mtime = st->st_mtime;
+    entry->ctime = st->st_ctime;
+#ifdef HOST_LINUX
+    entry->mtimeNsec = st->st_mtim.tv_nsec;
+    entry->ctimeNsec = st->st_ctim.tv_nsec;
+#endif
+    entry->tlen = tlen;
+    entry->dlen = dlen;
+    entry->blen = getLong(header + 10);
+    entry->tbase = tbase;
+    entry->fixups = fixups->offsets;
+    entry->fixupCount = fixups->count;
+    entry->bytes = bytes;
+    entry->lastUse = ++useCounter;
+    entry->next = images;
+    images = entry;
+    cacheUsed += bytes;
+
+    fixups->offsets = NULL;
+}
+
+void prgCacheSetBudget(unsigned long budget)
+{
+    cacheBudget = budget;
+    trimCache(budget);
+}
+
+void prgCacheReport(void)
+{
+    fprintf(stderr, "68kemu: program cache: %lu hit(s), %lu miss(es), %lu eviction(s), "
+        "%lu of %lu bytes used\n", cacheHits, cacheMisses, cacheEvictions, cacheUsed, cacheBudget);
+}
+
+// Allocate the TPA, like TOS gives the largest block to the program.
+// Returns 0 if it is smaller than needed.
+static unsigned int allocTpa(unsigned long needed, unsigned int* tpaSize)
+{
+    unsigned int bp;
+
+    *tpaSize = heapLargest(HEAP_ANY);
+    bp = heapAlloc(*tpaSize, HEAP_ANY);
+    if (bp != 0 && needed > *tpaSize)
+    {
+        heapFree(bp);
+        bp = 0;
+    }
+
+    return bp;
+}
+
+static void fillBasepage(unsigned int bp, unsigned int tpaSize, unsigned int tlen, unsigned int dlen,
+    unsigned int blen, const char* tail, unsigned int env, unsigned int parent)
+{
+    unsigned int tbase = bp + BP_SIZE;
+
+    memset(m68k_host_ptr(tbase + tlen + dlen), 0, blen);
+
+    memset(m68k_host_ptr(bp), 0, BP_SIZE);
+    m68k_write_memory_32(bp + BP_LOWTPA, bp);
+    m68k_write_memory_32(bp + BP_HITPA, bp + tpaSize);
+    m68k_write_memory_32(bp + BP_TBASE, tbase);
+    m68k_write_memory_32(bp + BP_TLEN, tlen);
+    m68k_write_memory_32(bp + BP_DBASE, tbase + tlen);
+    m68k_write_memory_32(bp + BP_DLEN, dlen);
+    m68k_write_memory_32(bp + BP_BBASE, tbase + tlen + dlen);
+    m68k_write_memory_32(bp + BP_BLEN, blen);
+    m68k_write_memory_32(bp + BP_DTA, bp + BP_CMDLIN);
+    m68k_write_memory_32(bp + BP_PARENT, parent);
+    m68k_write_memory_32(bp + BP_ENV, env);
+    memcpy(m68k_host_ptr(bp + BP_CMDLIN), tail, 128);
+}
+
+long prgCreateBasepage(const char* tail, unsigned int env, unsigned int parent)
+{
+    unsigned int tpaSize;
+    unsigned int bp = allocTpa(BP_SIZE, &tpaSize);
+
+    if (bp == 0)
+        return TOS_ENSMEM;
+
+    fillBasepage(bp, tpaSize, 0, 0, 0, tail, env, parent);
+    return bp;
+}
+
+// Load a program from the cache
+static long loadImage(PrgImage* entry, const char* tail, unsigned int env, unsigned int parent)
+{
+    unsigned int tpaSize;
+    unsigned int bp = allocTpa((unsigned long)BP_SIZE + entry->tlen + entry->dlen + entry->blen, &tpaSize);
+    unsigned int tbase;
+    unsigned char* text;
+    unsigned int i;
+
+    if (bp == 0)
+        return TOS_ENSMEM;
+
+    tbase = bp + BP_SIZE;
+    text = m68k_host_ptr(tbase);
+    memcpy(text, entry->image, entry->tlen + entry->dlen);
+    if (tbase != entry->tbase)
+    {
+        for (i = 0; i < entry->fixupCount; ++i)
+            addToLong(text + entry->fixups[i], tbase - entry->tbase);
+    }
+
+    entry->lastUse = ++useCounter;
+    fillBasepage(bp, tpaSize, entry->tlen, entry->dlen, entry->blen, tail, env, parent);
+    return bp;
+}
+
+// Read and relocate a program. When warming the cache, it only gets a block
+// of the size of the file, and no basepage.
+static long loadFile(const char* path, const char* tail, unsigned int env, unsigned int parent, int warm)
+{
+    const unsigned char* header;
+    unsigned int tlen, dlen, blen, slen;
+    unsigned int tpaSize, bp, tbase, fileSize, relocOffset;
+    unsigned char* image;
+    struct stat st;
+    FixupList fixups;
+    int fd;
+    long ret = TOS_E_OK;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? TOS_EFILNF : TOS_EACCDN;
+
+    if (fstat(fd, &st) != 0 || st.st_size < PRG_HEADER_SIZE || st.st_size > 0x7fffffff)
+    {
+        close(fd);
+        return TOS_EPLFMT;
+    }
+    fileSize = (unsigned int)st.st_size;
+
+    if (warm)
+    {
+        tpaSize = BP_SIZE - PRG_HEADER_SIZE + fileSize + 1;
+        bp = heapAlloc(tpaSize, HEAP_ANY);
+    }
+    else
+        bp = allocTpa((unsigned long)BP_SIZE - PRG_HEADER_SIZE + fileSize + 1, &tpaSize);
+    if (bp == 0)
+    {
+        close(fd);
+        return TOS_ENSMEM;
+    }
+
+    tbase = bp + BP_SIZE;
+    image = m68k_host_ptr(tbase - PRG_HEADER_SIZE);
+    if (read(fd, image, fileSize) != (ssize_t)fileSize)
+        ret = TOS_EPLFMT;
+    close(fd);
+    image[fileSize] = 0; // Terminate a truncated relocation table
+
+    header = image;
+    tlen = getLong(header + 2);
+    dlen = getLong(header + 6);
+    blen = getLong(header + 10);
+    slen = getLong(header + 14);
+
+    // The segments are in the file, so they fit in the TPA
+    if (ret == TOS_E_OK && (((header[0] << 8) | header[1]) != PRG_MAGIC
+        || tlen > fileSize - PRG_HEADER_SIZE
+        || dlen > fileSize - PRG_HEADER_SIZE - tlen
+        || slen > fileSize - PRG_HEADER_SIZE - tlen - dlen))
+        ret = TOS_EPLFMT;
+    if (ret == TOS_E_OK && !warm && blen > tpaSize - BP_SIZE - tlen - dlen)
+        ret = TOS_ENSMEM;
+    relocOffset = PRG_HEADER_SIZE + tlen + dlen + slen;
+
+    // Relocation, unless the absolute flag is set
+    memset(&fixups, 0, sizeof(fixups));
+    if (ret == TOS_E_OK && header[26] == 0 && header[27] == 0 && relocOffset + 4 <= fileSize)
+        ret = relocate(image + PRG_HEADER_SIZE, tlen + dlen, tbase, image + relocOffset,
+            cacheBudget != 0 ? &fixups : NULL);
+
+    if (ret < 0)
+    {
+        free(fixups.offsets);
+        heapFree(bp);
+        return ret;
+    }
+
+    if (cacheBudget != 0)
+    {
+        cacheMisses++;
+        addImage(path, &st, header, tbase, &fixups);
+        free(fixups.offsets);
+    }
+
+    if (warm)
+    {
+        heapFree(bp);
+        return TOS_E_OK;
+    }
+
+    fillBasepage(bp, tpaSize, tlen, dlen, blen, tail, env, parent);
+    return bp;
+}
+
+long prgLoad(const char* path, const char* tail, unsigned int env, unsigned int parent)
+{
+    struct stat st;
+    PrgImage* entry;
+
+    if (cacheBudget != 0 && stat(path, &st) == 0 && (entry = findImage(path, &st)) != NULL)
+    {
+        cacheHits++;
+        return loadImage(entry, tail, env, parent);
+    }
+
+    return loadFile(path, tail, env, parent, 0);
+}
+
+long prgCacheWarm(const char* path)
+{
+    struct stat st;
+
+    if (cacheBudget == 0 || (stat(path, &st) == 0 && findImage(path, &st) != NULL))
+        return TOS_E_OK;
+
+    return loadFile(path, NULL, 0, 0, 1);
+}
@@ -0,0 +1,43 @@
+/*
+  prgload.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_PRGLOAD_H__
+#define __INC_PRGLOAD_H__
+
+// Load a TOS program into the guest heap, like Pexec(PE_LOAD).
+// env is the guest address of the environment strings, and parent the
+// basepage of the parent, or 0. tail is the 128-byte command tail.
+// Returns the guest address of the basepage, or a negative GEMDOS error.
+long prgLoad(const char* path, const char* tail, unsigned int env, unsigned int parent);
+
+// Create a basepage in the largest free block, like Pexec(PE_BASEPAGE).
+// Returns the guest address of the basepage, or a negative GEMDOS error.
+long prgCreateBasepage(const char* tail, unsigned int env, unsigned int parent);
+
+// Set the memory budget of the cache of relocated images, in bytes.
+// 0 disables the cache.
+void prgCacheSetBudget(unsigned long budget);
+
+// Load a program into the cache only, if it is not there yet. It needs a
+// free block of the size of the file, not the largest one, so this works
+// while another program is loaded.
+// Returns 0 on success, or a negative GEMDOS error.
+long prgCacheWarm(const char* path);
+
+// Print the statistics of the image cache.
+void prgCacheReport(void);
+
+#endif /* __INC_PRGLOAD_H__ */
@@ -0,0 +1,255 @@
+/*
+  process.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Child processes started by Pexec(), shared by both hosts.
+
+  The child runs on the same emulated CPU as its parent. Starting it saves
+  the registers of the parent in a stack of waiting parents. When the child
+  terminates, the innermost parent is restored, and resumes after its call
+  to Pexec() with the exit code in D0.
+
+  The blocks allocated by a process are owned by its basepage, and freed
+  when it terminates, like the files it opened are closed by the host. The TPA and the environment of a child started by
+  Pexec(PE_LOADGO) or Pexec(PE_GOTHENFREE) are given to the child.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "musashi/m68k.h"
+#include "guestheap.h"
+#include "prgload.h"
+#include "process.h"
+#include "tosdefs.h"
+
+#define NUM_SAVED_REGS (M68K_REG_A6 - M68K_REG_D0 + 1)
+
+// Context of a parent waiting for its child
+typedef struct Process
+{
+    unsigned int regs[NUM_SAVED_REGS]; // D0 to A6, A7 is in the stack pointers
+    unsigned int usp;
+    unsigned int isp;
+    unsigned int msp;
+    unsigned int sr;
+    unsigned int pc;
+    unsigned int bp;
+    unsigned int dta;
+    struct Process* next;
+} Process;
+
+static Process* waiting;         // Innermost first
+static unsigned int current;     // Basepage of the running process
+
+static ProcessGetDtaFunc* getDtaFunc;
+static ProcessSetDtaFunc* setDtaFunc;
+static ProcessCloseFunc* closeFunc;
+
+void processInit(unsigned int bp, ProcessGetDtaFunc* getDta, ProcessSetDtaFunc* setDta,
+    ProcessCloseFunc* closeFiles)
+{
+    current = bp;
+    getDtaFunc = getDta;
+    setDtaFunc = setDta;
+    closeFunc = closeFiles;
+    heapSetOwner(bp);
+}
+
+unsigned int processCurrent(void)
+{
+    return current;
+}
+
+// Copy the environment for a child, or the one of the parent if env is 0
+static unsigned int copyEnvironment(unsigned int env)
+{
+    unsigned int size = 0;
+    unsigned int copy;
+
+    if (env == 0 && current != 0)
+        env = m68k_read_memory_32(current + BP_ENV);
+
+    if (env != 0)
+    {
+        while (m68k_read_memory_8(env + size) != 0)
+        {
+            while (m68k_read_memory_8(env + size++) != 0)
+                ;
+        }
+    }
+
+    copy = heapAlloc(size + 2, HEAP_ANY);
+    if (copy == 0)
+        return 0;
+
+    if (size != 0)
+        memcpy(m68k_host_ptr(copy), m68k_host_ptr(env), size);
+    m68k_write_memory_16(copy + size, 0);
+
+    return copy;
+}
+
+static void readTail(unsigned int tail, char buffer[128])
+{
+    int i;
+
+    memset(buffer, 0, 128);
+    if (tail == 0)
+        return;
+
+    for (i = 0; i < 128; ++i)
+        buffer[i] = (char)m68k_read_memory_8(tail + i);
+}
+
+// The child frees its TPA and its environment when it terminates
+static void giveMemory(unsigned int bp)
+{
+    unsigned int env = m68k_read_memory_32(bp + BP_ENV);
+
+    heapChown(bp, bp);
+    if (current == 0 || env != m68k_read_memory_32(current + BP_ENV))
+        heapChown(env, bp);
+}
+
+static void startChild(unsigned int bp)
+{
+    Process* parent = malloc(sizeof(Process));
+    unsigned int stack = m68k_read_memory_32(bp + BP_HITPA) - 8;
+    int i;
+
+    if (parent == NULL)
+    {
+        fprintf(stderr, "68kemu: out of host memory.\n");
+        exit(1);
+    }
+
+    for (i = 0; i < NUM_SAVED_REGS; ++i)
+        parent->regs[i] = m68k_get_reg(NULL, M68K_REG_D0 + i);
+    parent->usp = m68k_get_reg(NULL, M68K_REG_USP);
+    parent->isp = m68k_get_reg(NULL, M68K_REG_ISP);
+    parent->msp = m68k_get_reg(NULL, M68K_REG_MSP);
+    parent->sr = m68k_get_reg(NULL, M68K_REG_SR);
+    parent->pc = m68k_get_reg(NULL, M68K_REG_PC);
+    parent->bp = current;
+    parent->dta = getDtaFunc();
+    parent->next = waiting;
+    waiting = parent;
+
+    m68k_write_memory_32(bp + BP_PARENT, current);
+    current = bp;
+    heapSetOwner(bp);
+    setDtaFunc(bp + BP_CMDLIN);
+
+    // Same initial state as the main program
+    m68k_write_memory_32(stack + 4, bp);
+    m68k_write_memory_32(stack, 0);
+    m68k_set_reg(M68K_REG_SR, 0x0300);
+    m68k_set_reg(M68K_REG_SP, stack);
+    m68k_set_reg(M68K_REG_PC, m68k_read_memory_32(bp + BP_TBASE));
+}
+
+long processExec(int mode, const char* path, unsigned int tail, unsigned int env)
+{
+    char tailBuffer[128];
+    unsigned int envCopy;
+    long bp;
+
+    switch (mode)
+    {
+        case PEXEC_LOADGO:
+        case PEXEC_LOAD:
+        case PEXEC_BASEPAGE:
+        case PEXEC_XBASEPAGE:
+            readTail(tail, tailBuffer);
+            envCopy = copyEnvironment(env);
+            if (envCopy == 0)
+                return TOS_ENSMEM;
+
+            if (mode == PEXEC_LOADGO || mode == PEXEC_LOAD)
+                bp = prgLoad(path, tailBuffer, envCopy, current);
+            else
+                bp = prgCreateBasepage(tailBuffer, envCopy, current);
+
+            if (bp < 0)
+            {
+                heapFree(envCopy);
+                return bp;
+            }
+
+            if (mode != PEXEC_LOADGO)
+                return bp;
+
+            giveMemory(bp);
+            startChild(bp);
+            return TOS_E_OK;
+
+        // The basepage is the tail parameter
+        case PEXEC_GO:
+        case PEXEC_GOTHENFREE:
+            if (!heapOwns(tail))
+                return TOS_EIMBA;
+
+            if (mode == PEXEC_GOTHENFREE)
+                giveMemory(tail);
+            startChild(tail);
+            return TOS_E_OK;
+
+        default:
+            return TOS_EINVFN;
+    }
+}
+
+int processTerminate(long keep)
+{
+    Process* parent = waiting;
+    int i;
+
+    if (parent == NULL)
+        return 0;
+
+    closeFunc(current);
+    if (keep < 0)
+        heapFreeOwner(current);
+    else
+    {
+        // The resident blocks belong to nobody
+        heapShrink(current, keep);
+        heapTransfer(current, 0);
+    }
+
+    waiting = parent->next;
+    current = parent->bp;
+    heapSetOwner(current);
+    setDtaFunc(parent->dta);
+
+    // Setting SR swaps the stack pointers, so it comes first
+    m68k_set_reg(M68K_REG_SR, parent->sr);
+    m68k_set_reg(M68K_REG_USP, parent->usp);
+    m68k_set_reg(M68K_REG_ISP, parent->isp);
+    m68k_set_reg(M68K_REG_MSP, parent->msp);
+    for (i = 0; i < NUM_SAVED_REGS; ++i)
+        m68k_set_reg(M68K_REG_D0 + i, parent->regs[i]);
+    m68k_set_reg(M68K_REG_PC, parent->pc);
+
+    free(parent);
+    return 1;
+}
+
+int processIsChild(void)
+{
+    return waiting != NULL;
+}
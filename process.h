@@ -0,0 +1,49 @@
+/*
+  process.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_PROCESS_H__
+#define __INC_PROCESS_H__
+
+// Access to the DTA of the host, which is saved with the parent context.
+typedef unsigned int ProcessGetDtaFunc(void);
+typedef void ProcessSetDtaFunc(unsigned int dta);
+
+// Close the files opened by a child, given its basepage, when it terminates.
+typedef void ProcessCloseFunc(unsigned int bp);
+
+// Set the basepage of the main program.
+void processInit(unsigned int bp, ProcessGetDtaFunc* getDta, ProcessSetDtaFunc* setDta,
+    ProcessCloseFunc* closeFiles);
+
+// Basepage of the running process, which owns the files it opens.
+unsigned int processCurrent(void);
+
+// Pexec() on the emulated CPU, from an OS call callback. path is the host
+// path of the program, for the modes which load one. When a child is
+// started, the caller resumes at the return of Pexec() once it terminates.
+// Returns the value of D0.
+long processExec(int mode, const char* path, unsigned int tail, unsigned int env);
+
+// Pterm() from an OS call callback, freeing the memory of the process, or
+// keeping the first keep bytes of its TPA and all its blocks if keep >= 0.
+// Returns nonzero if the parent was resumed: the callback must then return
+// the exit code. Returns 0 if the main program terminates.
+int processTerminate(long keep);
+
+// Returns nonzero if the running process is a child started by Pexec().
+int processIsChild(void);
+
+#endif /* __INC_PROCESS_H__ */
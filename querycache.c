@@ -0,0 +1,273 @@
+/*
+  querycache.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Cache of the OS queries passed to the underlying TOS.
+
+  Some calls only return a state which rarely changes, like Dgetdrv() or
+  Getrez(). Their results are kept, and answered without the real trap until
+  a call which may change that state is made. Each query belongs to a group,
+  and the invalidation rules list the calls which drop the groups.
+
+  The rules are in two tables below: add an entry to cache another query,
+  or to make another call drop a group. A few states also change without any
+  call, like the keyboard or the clock: those queries have a lifetime, in
+  timeslices of the run loop.
+*/
+
+#include <string.h>
+#include "querycache.h"
+
+// Groups of queries dropped together
+#define GROUP_DRIVE    0x01 // Current drive
+#define GROUP_PATH     0x02 // Current directories
+#define GROUP_FILES    0x04 // File attributes
+#define GROUP_TIME     0x08 // Date and time
+#define GROUP_KEYBOARD 0x10 // Shift keys
+#define GROUP_SCREEN   0x20 // Video mode
+#define GROUP_ALL      0xff
+
+// Key of a query, besides its function number
+enum
+{
+    KEY_NONE,
+    KEY_WORD,   // Word argument
+    KEY_STRING  // String pointed to by a long argument
+};
+
+// Offsets are in words from the function number on the stack
+typedef struct
+{
+    unsigned char trap;
+    unsigned short function;
+    unsigned char condOffset;    // Word which must be condValue, or 0
+    unsigned short condValue;
+    unsigned char keyType;
+    unsigned char keyOffset;
+    unsigned char outputOffset;  // Pointer to a string result, or 0
+    unsigned char lifetime;      // In timeslices, or 0 until invalidated
+    unsigned char group;
+} QueryRule;
+
+typedef struct
+{
+    unsigned char trap;
+    unsigned short function;
+    unsigned char groups;
+} InvalidationRule;
+
+static const QueryRule queryRules[] =
+{
+    { 1, 0x19, 0, 0, KEY_NONE, 0, 0, 0, GROUP_DRIVE },              // Dgetdrv()
+    { 1, 0x2a, 0, 0, KEY_NONE, 0, 0, 16, GROUP_TIME },              // Tgetdate()
+    { 1, 0x2c, 0, 0, KEY_NONE, 0, 0, 16, GROUP_TIME },              // Tgettime()
+    { 1, 0x43, 3, 0, KEY_STRING, 1, 0, 0, GROUP_FILES },            // Fattrib(name, 0, 0)
+    { 1, 0x47, 0, 0, KEY_WORD, 3, 1, 0, GROUP_PATH },               // Dgetpath(buf, drive)
+    { 13, 0x0b, 1, 0xffff, KEY_NONE, 0, 0, 1, GROUP_KEYBOARD },     // Kbshift(-1)
+    { 14, 0x04, 0, 0, KEY_NONE, 0, 0, 0, GROUP_SCREEN },            // Getrez()
+};
+
+static const InvalidationRule invalidationRules[] =
+{
+    // The relative paths depend on the current drive and directory
+    { 1, 0x0e, GROUP_DRIVE | GROUP_PATH | GROUP_FILES },            // Dsetdrv()
+    { 1, 0x3b, GROUP_PATH | GROUP_FILES },                          // Dsetpath()
+    { 1, 0x2b, GROUP_TIME },                                        // Tsetdate()
+    { 1, 0x2d, GROUP_TIME },                                        // Tsettime()
+    { 1, 0x39, GROUP_FILES },                                       // Dcreate()
+    { 1, 0x3a, GROUP_PATH | GROUP_FILES },                          // Ddelete()
+    { 1, 0x3c, GROUP_FILES },                                       // Fcreate()
+    { 1, 0x3e, GROUP_FILES },                                       // Fclose()
+    { 1, 0x40, GROUP_FILES },                                       // Fwrite()
+    { 1, 0x41, GROUP_FILES },                                       // Fdelete()
+    { 1, 0x43, GROUP_FILES },                                       // Fattrib(name, 1, attr)
+    { 1, 0x4b, GROUP_ALL },                                         // Pexec()
+    { 1, 0x56, GROUP_FILES },                                       // Frename()
+    { 1, 0x57, GROUP_FILES },                                       // Fdatime()
+    { 1, 0x12d, GROUP_FILES },                                      // Flink()
+    { 1, 0x12e, GROUP_FILES },                                      // Fsymlink()
+    { 1, 0x132, GROUP_FILES },                                      // Fchmod()
+    { 13, 0x04, GROUP_FILES },                                      // Rwabs()
+    { 13, 0x0b, GROUP_KEYBOARD },                                   // Kbshift(mode)
+    { 14, 0x05, GROUP_SCREEN },                                     // Setscreen()
+    { 14, 0x16, GROUP_TIME },                                       // Settime()
+    { 14, 0x26, GROUP_ALL },                                        // Supexec()
+    { 14, 0x58, GROUP_SCREEN },                                     // VsetMode()
+};
+
+#define NUM_QUERY_RULES (sizeof(queryRules) / sizeof(queryRules[0]))
+#define NUM_INVALIDATION_RULES (sizeof(invalidationRules) / sizeof(invalidationRules[0]))
+
+// Direct-mapped cache, must be a power of 2
+#define CACHE_SIZE 32
+#define STRING_SIZE 128
+
+typedef struct
+{
+    const QueryRule* rule;       // NULL if the slot is empty
+    unsigned int key;            // Word key, or hash of the string key
+    unsigned long result;
+    unsigned long slice;         // Timeslice of the real call
+    char keyString[STRING_SIZE];
+    char output[STRING_SIZE];
+} CachedQuery;
+
+static CachedQuery cache[CACHE_SIZE];
+static unsigned int cachedGroups;
+static unsigned long currentSlice;
+
+static const QueryRule* findQueryRule(unsigned int trap, unsigned short* sp)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_QUERY_RULES; ++i)
+    {
+        const QueryRule* rule = &queryRules[i];
+
+        if (rule->trap == trap && rule->function == sp[0])
+        {
+            if (rule->condOffset != 0 && sp[rule->condOffset] != rule->condValue)
+                return NULL;
+            return rule;
+        }
+    }
+
+    return NULL;
+}
+
+static const char* stringArg(unsigned short* sp, unsigned int offset)
+{
+    return *(const char**)(sp + offset);
+}
+
+// Compute the key of a query, and find its slot.
+// Returns NULL if the query cannot be cached.
+static CachedQuery* findSlot(const QueryRule* rule, unsigned short* sp, unsigned int* key)
+{
+    unsigned int hash = (unsigned int)(rule - queryRules) * 0x9e3779b1u;
+    const char* s;
+
+    *key = 0;
+    if (rule->keyType == KEY_WORD)
+        *key = sp[rule->keyOffset];
+    else if (rule->keyType == KEY_STRING)
+    {
+        // FNV-1a
+        s = stringArg(sp, rule->keyOffset);
+        if (strlen(s) >= STRING_SIZE)
+            return NULL;
+        for (*key = 2166136261u; *s != '\0'; ++s)
+            *key = (*key ^ (unsigned char)*s) * 16777619u;
+    }
+
+    hash ^= *key * 0x85ebca6bu;
+    return &cache[(hash ^ (hash >> 16)) & (CACHE_SIZE - 1)];
+}
+
+static void dropGroups(unsigned int groups)
+{
+    size_t i;
+
+    if ((cachedGroups & groups) == 0)
+        return;
+
+    for (i = 0; i < CACHE_SIZE; ++i)
+    {
+        if (cache[i].rule != NULL && (cache[i].rule->group & groups) != 0)
+            cache[i].rule = NULL;
+    }
+
+    cachedGroups &= ~groups;
+}
+
+void queryCacheNotify(unsigned int trap, unsigned short* sp)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_INVALIDATION_RULES; ++i)
+    {
+        if (invalidationRules[i].trap == trap && invalidationRules[i].function == sp[0])
+        {
+            dropGroups(invalidationRules[i].groups);
+            return;
+        }
+    }
+}
+
+int queryCacheLookup(unsigned int trap, unsigned short* sp, unsigned long* result)
+{
+    const QueryRule* rule = findQueryRule(trap, sp);
+    CachedQuery* slot;
+    unsigned int key;
+
+    if (rule == NULL)
+    {
+        queryCacheNotify(trap, sp);
+        return 0;
+    }
+
+    slot = findSlot(rule, sp, &key);
+    if (slot == NULL || slot->rule != rule || slot->key != key)
+        return 0;
+    if (rule->lifetime != 0 && currentSlice - slot->slice >= rule->lifetime)
+        return 0;
+    if (rule->keyType == KEY_STRING && strcmp(slot->keyString, stringArg(sp, rule->keyOffset)) != 0)
+        return 0;
+
+    if (rule->outputOffset != 0)
+        strcpy(*(char**)(sp + rule->outputOffset), slot->output);
+
+    *result = slot->result;
+    return 1;
+}
+
+void queryCacheStore(unsigned int trap, unsigned short* sp, unsigned long result)
+{
+    const QueryRule* rule = findQueryRule(trap, sp);
+    CachedQuery* slot;
+    unsigned int key;
+
+    // The errors are not cached
+    if (rule == NULL || (long)result < 0)
+        return;
+
+    slot = findSlot(rule, sp, &key);
+    if (slot == NULL)
+        return;
+
+    if (rule->outputOffset != 0)
+    {
+        const char* output = stringArg(sp, rule->outputOffset);
+
+        if (strlen(output) >= STRING_SIZE)
+            return;
+        strcpy(slot->output, output);
+    }
+
+    if (rule->keyType == KEY_STRING)
+        strcpy(slot->keyString, stringArg(sp, rule->keyOffset));
+
+    slot->rule = rule;
+    slot->key = key;
+    slot->result = result;
+    slot->slice = currentSlice;
+    cachedGroups |= rule->group;
+}
+
+void queryCachePoll(void)
+{
+    ++currentSlice;
+}
@@ -0,0 +1,37 @@
+/*
+  querycache.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+#ifndef __INC_QUERYCACHE_H__
+#define __INC_QUERYCACHE_H__
+
+// Answer an OS query from the cache, given the trap number and the stack
+// of the call. Returns nonzero if *result was set and the real call must be
+// skipped. Otherwise, the call is passed to queryCacheNotify().
+int queryCacheLookup(unsigned int trap, unsigned short* sp, unsigned long* result);
+
+// Remember the result of a query passed to the real OS.
+// Does nothing if the call is not a query.
+void queryCacheStore(unsigned int trap, unsigned short* sp, unsigned long result);
+
+// Apply the invalidation rules of a call which is not looked up,
+// such as the calls with a dedicated callback.
+void queryCacheNotify(unsigned int trap, unsigned short* sp);
+
+// Count a timeslice, for the queries with a lifetime.
+// Must be called between two m68k_execute().
+void queryCachePoll(void);
+
+#endif /* __INC_QUERYCACHE_H__ */
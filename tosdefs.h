@@ -0,0 +1,84 @@
+/*
+  tosdefs.h
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+// TOS definitions needed without the MiNTLib headers,
+// as seen from the emulated CPU.
+
+#ifndef __INC_TOSDEFS_H__
+#define __INC_TOSDEFS_H__
+
+// GEMDOS error codes
+#define TOS_E_OK    0
+#define TOS_ERROR   -1
+#define TOS_EINVFN  -32
+#define TOS_EFILNF  -33
+#define TOS_EPTHNF  -34
+#define TOS_ENHNDL  -35
+#define TOS_EACCDN  -36
+#define TOS_EIHNDL  -37
+#define TOS_ENSMEM  -39
+#define TOS_EIMBA   -40
+#define TOS_EDRIVE  -46
+#define TOS_ENSAME  -48
+#define TOS_ENMFIL  -49
+#define TOS_ERANGE  -64
+#define TOS_EPLFMT  -66
+#define TOS_EGSBF   -67
+
+// Basepage field offsets
+#define BP_LOWTPA  0x00
+#define BP_HITPA   0x04
+#define BP_TBASE   0x08
+#define BP_TLEN    0x0c
+#define BP_DBASE   0x10
+#define BP_DLEN    0x14
+#define BP_BBASE   0x18
+#define BP_BLEN    0x1c
+#define BP_DTA     0x20
+#define BP_PARENT  0x24
+#define BP_ENV     0x2c
+#define BP_CMDLIN  0x80
+#define BP_SIZE    0x100
+
+// Pexec() modes
+#define PEXEC_LOADGO     0
+#define PEXEC_LOAD       3
+#define PEXEC_GO         4
+#define PEXEC_BASEPAGE   5
+#define PEXEC_GOTHENFREE 6
+#define PEXEC_XBASEPAGE  7
+
+// PRG file header
+#define PRG_MAGIC       0x601a
+#define PRG_HEADER_SIZE 28
+
+// DTA field offsets
+#define DTA_ATTRIB 21
+#define DTA_TIME   22
+#define DTA_DATE   24
+#define DTA_LENGTH 26
+#define DTA_NAME   30
+#define DTA_SIZE   44
+
+// File attributes
+#define FA_RDONLY 0x01
+#define FA_HIDDEN 0x02
+#define FA_SYSTEM 0x04
+#define FA_LABEL  0x08
+#define FA_DIR    0x10
+#define FA_ARCH   0x20
+
+#endif /* __INC_TOSDEFS_H__ */
@@ -0,0 +1,245 @@
+/*
+  trace2json.c
+
+  This file is part of:
+  68Kemu - A CPU emulator for Atari TOS computers
+  http://vincent.riviere.free.fr/soft/68kemu/
+
+  To the extent possible under law, the author(s) have dedicated all copyright
+  and related and neighboring rights to this software to the public domain
+  worldwide. This software is distributed without any warranty.
+
+  You should have received a copy of the CC0 Public Domain Dedication along
+  with this software.
+  If not, see <http://creativecommons.org/publicdomain/zero/1.0/>.
+*/
+
+/*
+  Convert a 68kemu OS call trace to the Chrome trace event format, which
+  can be loaded into chrome://tracing or Perfetto.
+
+  This tool runs on the build machine. The trace may come from a host with
+  another byte order or structure padding, so the records are decoded by
+  field offset, with the record size and byte order stored in the header.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ostrace.h"
+
+// Field offsets in a record
+#define REC_TIME     0
+#define REC_DURATION 8
+#define REC_PC       12
+#define REC_VECTOR   16
+#define REC_FUNCTION 18
+#define REC_ARGS     20
+#define REC_RESULT   32
+#define REC_MIN_SIZE 36
+
+typedef struct
+{
+    unsigned short function;
+    const char* name;
+} FunctionName;
+
+static const FunctionName gemdosNames[] =
+{
+    { 0x00, "Pterm0" }, { 0x01, "Cconin" }, { 0x02, "Cconout" },
+    { 0x03, "Cauxin" }, { 0x04, "Cauxout" }, { 0x05, "Cprnout" },
+    { 0x06, "Crawio" }, { 0x07, "Crawcin" }, { 0x08, "Cnecin" },
+    { 0x09, "Cconws" }, { 0x0a, "Cconrs" }, { 0x0b, "Cconis" },
+    { 0x0e, "Dsetdrv" }, { 0x10, "Cconos" }, { 0x19, "Dgetdrv" },
+    { 0x1a, "Fsetdta" }, { 0x20, "Super" }, { 0x2a, "Tgetdate" },
+    { 0x2b, "Tsetdate" }, { 0x2c, "Tgettime" }, { 0x2d, "Tsettime" },
+    { 0x2f, "Fgetdta" }, { 0x30, "Sversion" }, { 0x31, "Ptermres" },
+    { 0x36, "Dfree" }, { 0x39, "Dcreate" }, { 0x3a, "Ddelete" },
+    { 0x3b, "Dsetpath" }, { 0x3c, "Fcreate" }, { 0x3d, "Fopen" },
+    { 0x3e, "Fclose" }, { 0x3f, "Fread" }, { 0x40, "Fwrite" },
+    { 0x41, "Fdelete" }, { 0x42, "Fseek" }, { 0x43, "Fattrib" },
+    { 0x44, "Mxalloc" }, { 0x45, "Fdup" }, { 0x46, "Fforce" },
+    { 0x47, "Dgetpath" }, { 0x48, "Malloc" }, { 0x49, "Mfree" },
+    { 0x4a, "Mshrink" }, { 0x4b, "Pexec" }, { 0x4c, "Pterm" },
+    { 0x4e, "Fsfirst" }, { 0x4f, "Fsnext" }, { 0x56, "Frename" },
+    { 0x57, "Fdatime" },
+    { 0, NULL }
+};
+
+static const FunctionName biosNames[] =
+{
+    { 0x00, "Getmpb" }, { 0x01, "Bconstat" }, { 0x02, "Bconin" },
+    { 0x03, "Bconout" }, { 0x04, "Rwabs" }, { 0x05, "Setexc" },
+    { 0x06, "Tickcal" }, { 0x07, "Getbpb" }, { 0x08, "Bcostat" },
+    { 0x09, "Mediach" }, { 0x0a, "Drvmap" }, { 0x0b, "Kbshift" },
+    { 0, NULL }
+};
+
+static const FunctionName xbiosNames[] =
+{
+    { 0x02, "Physbase" }, { 0x03, "Logbase" }, { 0x04, "Getrez" },
+    { 0x05, "Setscreen" }, { 0x11, "Random" }, { 0x15, "Cursconf" },
+    { 0x16, "Settime" }, { 0x17, "Gettime" }, { 0x25, "Vsync" },
+    { 0x26, "Supexec" },
+    { 0, NULL }
+};
+
+static int swap;
+
+static unsigned int get16(const unsigned char* p)
+{
+    unsigned short v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? (unsigned short)((v >> 8) | (v << 8)) : v;
+}
+
+static unsigned int get32(const unsigned char* p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static unsigned long long get64(const unsigned char* p)
+{
+    unsigned long long v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap64(v) : v;
+}
+
+static const char* lookup(const FunctionName* names, unsigned int function)
+{
+    for (; names->name != NULL; ++names)
+    {
+        if (names->function == function)
+            return names->name;
+    }
+
+    return NULL;
+}
+
+static void callName(char* buffer, size_t size, unsigned int vector, unsigned int function)
+{
+    const char* name = NULL;
+
+    switch (vector)
+    {
+        case 10:
+            snprintf(buffer, size, "Line-A 0x%04x", function);
+            return;
+
+        case 33:
+            name = lookup(gemdosNames, function);
+            snprintf(buffer, size, "GEMDOS %s(0x%02x)", name ? name : "", function);
+            return;
+
+        case 34:
+            snprintf(buffer, size, "%s", function == 200 ? "AES" : function == 115 ? "VDI" : "GEM");
+            return;
+
+        case 45:
+            name = lookup(biosNames, function);
+            snprintf(buffer, size, "BIOS %s(0x%02x)", name ? name : "", function);
+            return;
+
+        case 46:
+            name = lookup(xbiosNames, function);
+            snprintf(buffer, size, "XBIOS %s(0x%02x)", name ? name : "", function);
+            return;
+
+        default:
+            snprintf(buffer, size, "TRAP #%u(0x%02x)", vector - 32, function);
+            return;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* in;
+    FILE* out = stdout;
+    TraceHeader header;
+    unsigned char* record;
+    unsigned long long first = 0;
+    unsigned long count = 0;
+    char name[64];
+
+    if (argc < 2 || argc > 3)
+    {
+        fprintf(stderr, "usage: %s <trace.bin> [trace.json]\n", argv[0]);
+        return 1;
+    }
+
+    in = fopen(argv[1], "rb");
+    if (in == NULL)
+    {
+        fprintf(stderr, "error: cannot open %s.\n", argv[1]);
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, in) != 1
+        || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        fprintf(stderr, "error: %s is not a 68kemu trace.\n", argv[1]);
+        return 1;
+    }
+
+    swap = header.order != TRACE_ORDER;
+    if (swap)
+    {
+        header.version = __builtin_bswap32(header.version);
+        header.recordSize = __builtin_bswap32(header.recordSize);
+    }
+
+    if (header.version != TRACE_VERSION || header.recordSize < REC_MIN_SIZE || header.recordSize > 1024)
+    {
+        fprintf(stderr, "error: unsupported trace version.\n");
+        return 1;
+    }
+
+    if (argc == 3)
+    {
+        out = fopen(argv[2], "w");
+        if (out == NULL)
+        {
+            fprintf(stderr, "error: cannot create %s.\n", argv[2]);
+            return 1;
+        }
+    }
+
+    record = malloc(header.recordSize);
+    if (record == NULL)
+        return 1;
+
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n", out);
+
+    while (fread(record, header.recordSize, 1, in) == 1)
+    {
+        unsigned long long time = get64(record + REC_TIME);
+        unsigned int vector = get16(record + REC_VECTOR);
+        unsigned int function = get16(record + REC_FUNCTION);
+
+        if (count == 0)
+            first = time;
+
+        callName(name, sizeof(name), vector, function);
+        fprintf(out,
+            "%s{\"name\":\"%s\",\"cat\":\"os\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"pc\":\"0x%08x\","
+            "\"args\":[\"0x%08x\",\"0x%08x\",\"0x%08x\"],\"result\":\"0x%08x\"}}",
+            count == 0 ? "" : ",\n", name,
+            (time - first) / 1e3, get32(record + REC_DURATION) / 1e3,
+            get32(record + REC_PC), get32(record + REC_ARGS),
+            get32(record + REC_ARGS + 4), get32(record + REC_ARGS + 8),
+            get32(record + REC_RESULT));
+        ++count;
+    }
+
+    fputs("\n]}\n", out);
+
+    free(record);
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+
+    return 0;
+}